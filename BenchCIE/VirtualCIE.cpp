@@ -0,0 +1,847 @@
+#include "VirtualCIE.h"
+#include "../cie-pkcs11/Crypto/DES3.h"
+#include "../cie-pkcs11/Crypto/MAC.h"
+#include "../cie-pkcs11/Crypto/RSA.h"
+#include "../cie-pkcs11/Crypto/sha256.h"
+#include "../cie-pkcs11/Crypto/ASNParser.h"
+#include "../cie-pkcs11/Util/util.h"
+#include <openssl/bn.h>
+#include <openssl/dh.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <thread>
+
+extern CLog Log;
+extern ByteArray baExtAuth_PrivExp;
+
+static char *szCompiledFile=__FILE__;
+
+#define CIE_KEY_Sign_ID 0x81
+#define CIE_KEY_DAPP_ID 0x82
+#define CIE_KEY_Servizi_ID 0x83
+#define CIE_KEY_ExtAuth_ID 0x84
+#define CIE_PIN_ID 0x81
+#define CIE_PUK_ID 0x82
+
+#define CIE_PIN_TRIES 3
+#define CIE_PUK_TRIES 10
+
+// lunghezze fisse dei campi del certificato IFD costruito dalla DAPP (vedi IAS::DAPP)
+#define DAPP_CHR_LEN 12
+#define DAPP_CHA_LEN 7
+#define DAPP_OID_LEN 9
+#define DAPP_PUBEXP_LEN 4
+
+static uint8_t IAS_AID[] = { 0xA0, 0x00, 0x00, 0x00, 0x30, 0x80, 0x00, 0x00, 0x00, 0x09, 0x81, 0x60, 0x01 };
+static uint8_t CIE_AID[] = { 0xA0, 0x00, 0x00, 0x00, 0x00, 0x39 };
+
+static void increment(ByteArray &seq) {
+	for (size_t i = seq.size(); i > 0; i--) {
+		if (seq[i - 1] < 255) {
+			seq[i - 1]++;
+			for (size_t j = i; j < seq.size(); j++)
+				seq[j] = 0;
+			return;
+		}
+	}
+}
+
+static ByteDynArray BNToByteArray(const BIGNUM *bn, size_t size = 0) {
+	size_t bnSize = BN_num_bytes(bn);
+	ByteDynArray ba(size > bnSize ? size : bnSize);
+	ba.fill(0);
+	BN_bn2bin(bn, ba.data() + ba.size() - bnSize);
+	return ba;
+}
+
+static CASNTag *FindTag(CASNTagArray &tags, DWORD id) {
+	for (std::size_t i = 0; i < tags.size(); i++) {
+		if (tags[i]->tagInt() == id)
+			return tags[i].get();
+	}
+	return nullptr;
+}
+
+static RSA *GenerateRSAKey(ByteDynArray &module, ByteDynArray &pubexp, ByteDynArray &privexp) {
+	RSA *key = RSA_new();
+	BIGNUM *BNpubexp = BN_new();
+	BN_set_word(BNpubexp, 65537);
+	int ok = RSA_generate_key_ex(key, 2048, BNpubexp, nullptr);
+	BN_free(BNpubexp);
+	if (ok != 1) {
+		RSA_free(key);
+		throw logged_error("Errore nella generazione della chiave RSA");
+	}
+	module = BNToByteArray(key->n);
+	pubexp = BNToByteArray(key->e);
+	privexp = BNToByteArray(key->d);
+	return key;
+}
+
+// l'esponente privato della chiave di ExtAuth e' fisso nel middleware (ExtAuthKey.cpp):
+// cerco un modulo per cui sia invertibile e ne ricavo l'esponente pubblico
+static void GenerateCAKey(ByteDynArray &module, ByteDynArray &pubexp) {
+	BN_CTX *ctx = BN_CTX_new();
+	BIGNUM *d = BN_bin2bn(baExtAuth_PrivExp.data(), (int)baExtAuth_PrivExp.size(), nullptr);
+	BIGNUM *p = BN_new(), *q = BN_new(), *n = BN_new(), *phi = BN_new();
+	BIGNUM *p1 = BN_new(), *q1 = BN_new(), *gcd = BN_new();
+	BIGNUM *e = nullptr;
+	while (e == nullptr) {
+		if (!BN_generate_prime_ex(p, 1024, 0, nullptr, nullptr, nullptr) ||
+			!BN_generate_prime_ex(q, 1024, 0, nullptr, nullptr, nullptr))
+			break;
+		BN_mul(n, p, q, ctx);
+		BN_sub(p1, p, BN_value_one());
+		BN_sub(q1, q, BN_value_one());
+		BN_mul(phi, p1, q1, ctx);
+		BN_gcd(gcd, d, phi, ctx);
+		if (BN_num_bits(n) == 2048 && BN_is_one(gcd))
+			e = BN_mod_inverse(nullptr, d, phi, ctx);
+	}
+	if (e != nullptr) {
+		module = BNToByteArray(n);
+		pubexp = BNToByteArray(e);
+		BN_free(e);
+	}
+	BN_free(d); BN_free(p); BN_free(q); BN_free(n);
+	BN_free(phi); BN_free(p1); BN_free(q1); BN_free(gcd);
+	BN_CTX_free(ctx);
+	if (module.isEmpty())
+		throw logged_error("Errore nella generazione della chiave di ExtAuth");
+}
+
+static ByteDynArray CreateCertificate(RSA *key, ByteArray &PAN) {
+	std::string serial;
+	dumpHexData(PAN.mid(5, 6), serial, false);
+
+	EVP_PKEY *pkey = EVP_PKEY_new();
+	EVP_PKEY_set1_RSA(pkey, key);
+	X509 *x509 = X509_new();
+	X509_set_version(x509, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_get_notBefore(x509), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509), 10L * 365 * 24 * 3600);
+	X509_set_pubkey(x509, pkey);
+	X509_NAME *name = X509_get_subject_name(x509);
+	X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC, (const unsigned char*)"IT", -1, -1, 0);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"CIE VIRTUALE", -1, -1, 0);
+	X509_NAME_add_entry_by_txt(name, "serialNumber", MBSTRING_ASC, (const unsigned char*)serial.c_str(), -1, -1, 0);
+	X509_set_issuer_name(x509, name);
+	X509_sign(x509, pkey, EVP_sha256());
+
+	ByteDynArray cert(i2d_X509(x509, nullptr));
+	uint8_t *certData = cert.data();
+	i2d_X509(x509, &certData);
+	X509_free(x509);
+	EVP_PKEY_free(pkey);
+	return cert;
+}
+
+static ByteDynArray PublicKeyFile(ByteArray &module, ByteArray &pubexp) {
+	// SEQUENCE { INTEGER modulo, INTEGER esponente }, come EF.IntAuth sulla carta reale
+	ByteDynArray mod, exp, seq, file;
+	mod.set((uint8_t)0x00, &module);
+	seq.setASN1Tag(0x02, mod).append(ASN1Tag(0x02, pubexp));
+	file.setASN1Tag(0x30, seq);
+	return file;
+}
+
+static StatusWord SignPKCS1(ByteDynArray &module, ByteDynArray &privexp, ByteArray &data, ByteDynArray &resp) {
+	if (data.size() + 11 > module.size())
+		return 0x6700;
+	ByteDynArray block(module.size());
+	block.rightcopy(data);
+	PutPaddingBT1(block, (unsigned long)data.size());
+	CRSA key(module, privexp);
+	resp = key.RSA_PURE(block);
+	return 0x9000;
+}
+
+CVirtualCIE::CVirtualCIE(const char *szPIN, const char *szPUK) : Latency(0), APDUCount(0), Foreign(false)
+{
+	init_func
+	// ATR di una CIE Gemalto, con TCK calcolato
+	uint8_t atr[] = { 0x3B, 0x8F, 0x80, 0x01, 0x80, 0x31, 0x80, 0x65, 0xB0, 0x85, 0x04, 0x00, 0x11, 0x12, 0x0F, 0xFF, 0x82, 0x90, 0x00, 0x00 };
+	for (size_t i = 1; i < sizeof(atr) - 1; i++)
+		atr[sizeof(atr) - 1] ^= atr[i];
+	ATR = VarToByteArray(atr);
+
+	// ogni istanza ha un proprio numero di serie nel PAN, e quindi la propria cache di
+	// abilitazione, come carte diverse
+	static std::atomic<WORD> serial(0);
+	WORD cardSerial = serial++;
+	PAN = ByteDynArray(std::string("00000000001234567890120000000000"));
+	PAN[9] = HIBYTE(cardSerial);
+	PAN[10] = LOBYTE(cardSerial);
+	PIN = ByteArray((uint8_t*)szPIN, strlen(szPIN));
+	PUK = ByteArray((uint8_t*)szPUK, strlen(szPUK));
+	PINTries = CIE_PIN_TRIES;
+	PUKTries = CIE_PUK_TRIES;
+
+	SN_ICC.resize(8);
+	SN_ICC.random();
+
+	GenerateKeys();
+	Reset();
+	exit_func
+}
+
+CVirtualCIE::~CVirtualCIE()
+{
+}
+
+void CVirtualCIE::GenerateKeys() {
+	init_func
+	DH *dh = DH_get_2048_256();
+	if (dh == nullptr)
+		throw logged_error("Errore nella generazione dei parametri DH");
+	dh_p = BNToByteArray(dh->p);
+	dh_q = BNToByteArray(dh->q);
+	// la carta restituisce g della stessa lunghezza di p
+	dh_g = BNToByteArray(dh->g, dh_p.size());
+	DH_free(dh);
+
+	GenerateCAKey(CA_module, CA_pubexp);
+	// CHR: 4 byte a zero + CAR (8 byte); CHA: AID (6 byte) + ruolo
+	CA_CHR = ByteDynArray(std::string("000000004954434130303031"));
+	CA_CHA = ByteDynArray(std::string("A0000000003901"));
+
+	ByteDynArray pubexp;
+	RSA_free(GenerateRSAKey(DappModule, DappPubExp, DappPrivExp));
+	RSA_free(GenerateRSAKey(ServiziModule, pubexp, ServiziPrivExp));
+	Files[0x1005] = PublicKeyFile(ServiziModule, pubexp);
+	RSA *signKey = GenerateRSAKey(SignModule, pubexp, SignPrivExp);
+	Files[0x1003] = CreateCertificate(signKey, PAN);
+	RSA_free(signKey);
+
+	Files[0xd003] = PAN;
+	Files[0x1004] = PublicKeyFile(DappModule, DappPubExp);
+	Files[0x1001] = ByteArray((uint8_t*)"VIRTUALCIE01", 12);
+	Files[0x1002] = ByteArray((uint8_t*)"CA00000AA", 9);
+	// EF.SOD: contenuto fittizio, non verificabile con VerificaSOD
+	ByteDynArray sod(1024);
+	sod.random();
+	Files[0x1006].setASN1Tag(0x77, sod);
+	exit_func
+}
+
+void CVirtualCIE::CloseSM() {
+	ActiveSM = false;
+	ExtAuthDone = false;
+	DappDone = false;
+	PINVerified = false;
+	PUKVerified = false;
+	sessENC.clear();
+	sessMAC.clear();
+	sessSSC.clear();
+	pendingSSC.clear();
+	challenge.clear();
+}
+
+void CVirtualCIE::Reset() {
+	CloseSM();
+	selectedEF = 0;
+	chainData.clear();
+	dh_IFDpubKey.clear();
+	IFDModule.clear();
+	IFDPubExp.clear();
+	IFD_CHR.clear();
+	verifyKey = 0;
+	intAuthKey = 0;
+}
+
+HRESULT CVirtualCIE::TransmitCallback(void *data, uint8_t *apdu, DWORD apduSize, uint8_t *resp, DWORD *respSize) {
+	CVirtualCIE *card = (CVirtualCIE*)data;
+	if (card == nullptr)
+		return SCARD_E_INVALID_HANDLE;
+
+	ByteDynArray response;
+	if (apduSize == 2) {
+		// codici di controllo gestiti da TokenTransmitCallback in CIEP11Template.cpp
+		WORD code = *(WORD*)apdu;
+		if (code == 0xfffd) {
+			SCARDHANDLE hCard = 0;
+			ByteArray hCardBa = VarToByteArray(hCard);
+			response.set(&hCardBa, (uint8_t)0x90, (uint8_t)0x00);
+		}
+		else if (code == 0xfffe || code == 0xffff) {
+			std::lock_guard<std::mutex> lock(card->cardMutex);
+			card->Reset();
+			response.set((uint8_t)0x90, (uint8_t)0x00);
+		}
+		else
+			response.set((uint8_t)0x67, (uint8_t)0x00);
+	}
+	else {
+		ByteArray apduBa(apdu, apduSize);
+		try {
+			card->Transmit(apduBa, response);
+		}
+		catch (...) {
+			response.set((uint8_t)0x6f, (uint8_t)0x00);
+		}
+	}
+
+	if (response.size() > *respSize)
+		return SCARD_E_INSUFFICIENT_BUFFER;
+	memcpy(resp, response.data(), response.size());
+	*respSize = (DWORD)response.size();
+	return SCARD_S_SUCCESS;
+}
+
+void CVirtualCIE::Transmit(ByteArray &apdu, ByteDynArray &resp) {
+	std::lock_guard<std::mutex> lock(cardMutex);
+	APDUCount++;
+
+	std::chrono::microseconds delay = Latency;
+	Command cmd;
+	ByteDynArray data;
+	StatusWord sw;
+	if (!ParseAPDU(apdu, cmd))
+		sw = 0x6700;
+	else {
+		auto insDelay = InsLatency.find(cmd.ins);
+		if (insDelay != InsLatency.end())
+			delay += insDelay->second;
+
+		if ((cmd.cla & 0x0C) == 0x0C) {
+			sw = UnwrapSM(cmd);
+			if (sw == 0x9000) {
+				sw = Process(cmd, data);
+				// come la carta reale, protegge solo le risposte con esito positivo
+				if (ActiveSM && (sw == 0x9000 || sw == 0x6282 || sw == 0x6b00)) {
+					resp = WrapSM(data, sw);
+					if (!pendingSSC.isEmpty()) {
+						sessSSC = pendingSSC;
+						pendingSSC.clear();
+					}
+					std::this_thread::sleep_for(delay);
+					return;
+				}
+				data.clear();
+			}
+		}
+		else {
+			// un comando in chiaro chiude il canale SM
+			if (ActiveSM)
+				CloseSM();
+			sw = Process(cmd, data);
+		}
+	}
+
+	resp = data;
+	resp.push(HIBYTE(sw));
+	resp.push(LOBYTE(sw));
+	std::this_thread::sleep_for(delay);
+}
+
+bool CVirtualCIE::ParseAPDU(ByteArray &apdu, Command &cmd) {
+	if (apdu.size() < 4)
+		return false;
+	cmd.cla = apdu[0];
+	cmd.ins = apdu[1];
+	cmd.p1 = apdu[2];
+	cmd.p2 = apdu[3];
+	cmd.data.clear();
+	cmd.le = 0;
+
+	if (apdu.size() == 4)
+		return true;
+	if (apdu.size() == 5) {
+		cmd.le = apdu[4] == 0 ? 0x100 : apdu[4];
+		return true;
+	}
+	if (apdu[4] == 0 && apdu.size() >= 7) {
+		// forma estesa
+		if (apdu.size() == 7) {
+			cmd.le = (apdu[5] << 8) | apdu[6];
+			if (cmd.le == 0)
+				cmd.le = 0x10000;
+			return true;
+		}
+		size_t lc = (apdu[5] << 8) | apdu[6];
+		if (apdu.size() != lc + 7 && apdu.size() != lc + 9)
+			return false;
+		cmd.data = apdu.mid(7, lc);
+		if (apdu.size() == lc + 9) {
+			cmd.le = (apdu[lc + 7] << 8) | apdu[lc + 8];
+			if (cmd.le == 0)
+				cmd.le = 0x10000;
+		}
+		return true;
+	}
+	size_t lc = apdu[4];
+	if (apdu.size() != lc + 5 && apdu.size() != lc + 6)
+		return false;
+	cmd.data = apdu.mid(5, lc);
+	if (apdu.size() == lc + 6)
+		cmd.le = apdu[lc + 5] == 0 ? 0x100 : apdu[lc + 5];
+	return true;
+}
+
+StatusWord CVirtualCIE::UnwrapSM(Command &cmd) {
+	if (!ActiveSM)
+		return ERR_CARD_NO_SM_KEY;
+
+	increment(sessSSC);
+	uint8_t head[] = { cmd.cla, cmd.ins, cmd.p1, cmd.p2 };
+	auto calcMac = ISOPad(ByteDynArray(sessSSC).append(VarToByteArray(head)));
+
+	ByteDynArray encData, cmdMac;
+	DWORD le = 0;
+	ByteArray &dos = cmd.data;
+	size_t index = 0;
+	while (index < dos.size()) {
+		uint8_t tag = dos[index];
+		size_t llen = 1, len = dos[index + 1];
+		if (len == 0x81) {
+			llen = 2;
+			len = dos[index + 2];
+		}
+		else if (len == 0x82) {
+			llen = 3;
+			len = (dos[index + 2] << 8) | dos[index + 3];
+		}
+		ByteArray content = dos.mid(index + 1 + llen, len);
+		switch (tag) {
+		case 0x87:
+			encData = content.mid(1);
+			calcMac.append(dos.mid(index, 1 + llen + len));
+			break;
+		case 0x85:
+			encData = content;
+			calcMac.append(dos.mid(index, 1 + llen + len));
+			break;
+		case 0x97:
+			if (len == 2)
+				le = (content[0] << 8) | content[1];
+			else if (len == 1)
+				le = content[0];
+			if (le == 0)
+				le = (len == 2) ? 0x10000 : 0x100;
+			calcMac.append(dos.mid(index, 1 + llen + len));
+			break;
+		case 0x8e:
+			cmdMac = content;
+			break;
+		default:
+			CloseSM();
+			return ERR_CARD_SMKEY_FORMAT;
+		}
+		index += 1 + llen + len;
+	}
+
+	ByteDynArray iv(8);
+	iv.fill(0);
+	CMAC sigMac(sessMAC, iv);
+	if (cmdMac.isEmpty() || sigMac.Mac(ISOPad(calcMac)) != cmdMac) {
+		CloseSM();
+		return ERR_CARD_SMKEY_FORMAT;
+	}
+
+	ByteDynArray data;
+	if (!encData.isEmpty()) {
+		CDES3 encDes(sessENC, iv);
+		data = encDes.RawDecode(encData);
+		data.resize(RemoveISOPad(data), true);
+	}
+	cmd.cla &= ~0x0C;
+	cmd.data = data;
+	cmd.le = le;
+	return 0x9000;
+}
+
+ByteDynArray CVirtualCIE::WrapSM(ByteArray &data, StatusWord sw) {
+	increment(sessSSC);
+	ByteDynArray iv(8);
+	iv.fill(0);
+	uint8_t Val01 = 1;
+
+	ByteDynArray smResp;
+	if (!data.isEmpty()) {
+		CDES3 encDes(sessENC, iv);
+		ByteDynArray enc = encDes.RawEncode(ISOPad(data));
+		smResp.setASN1Tag(0x87, VarToByteDynArray(Val01).append(enc));
+	}
+	uint8_t do99[] = { 0x99, 0x02, HIBYTE(sw), LOBYTE(sw) };
+	smResp.append(VarToByteArray(do99));
+
+	CMAC sigMac(sessMAC, iv);
+	ByteDynArray mac = sigMac.Mac(ISOPad(ByteDynArray(sessSSC).append(smResp)));
+	smResp.append(ASN1Tag(0x8e, mac));
+	smResp.append(VarToByteArray(do99).right(2));
+	return smResp;
+}
+
+StatusWord CVirtualCIE::Process(Command &cmd, ByteDynArray &resp) {
+	if ((cmd.cla & ~0x1C) != 0)
+		return 0x6e00;
+
+	// chaining: accumulo i dati fino all'ultimo comando della catena
+	if (cmd.cla & 0x10) {
+		chainData.append(cmd.data);
+		return 0x9000;
+	}
+	if (!chainData.isEmpty()) {
+		cmd.data = ByteDynArray(chainData).append(cmd.data);
+		chainData.clear();
+	}
+
+	switch (cmd.ins) {
+	case 0xa4:
+		return Select(cmd, resp);
+	case 0xb0:
+		return ReadBinary(cmd, resp);
+	case 0xcb:
+		return GetData(cmd, resp);
+	case 0x22:
+		return MSE(cmd);
+	case 0x2a:
+		return VerifyCertificate(cmd);
+	case 0x84: {
+		DWORD len = cmd.le == 0 ? 8 : cmd.le;
+		if (len > 0x100)
+			return 0x6700;
+		challenge.resize(len);
+		challenge.random();
+		resp = challenge;
+		return 0x9000;
+	}
+	case 0x82:
+		return ExternalAuthenticate(cmd);
+	case 0x88:
+		return InternalAuthenticate(cmd, resp);
+	case 0x20:
+		return Verify(cmd);
+	case 0x24:
+		return ChangeReference(cmd);
+	case 0x2c:
+		return ResetRetryCounter(cmd);
+	default:
+		return 0x6d00;
+	}
+}
+
+StatusWord CVirtualCIE::Select(Command &cmd, ByteDynArray &resp) {
+	switch (cmd.p1) {
+	case 0x00:
+		selectedEF = 0;
+		return 0x9000;
+	case 0x04:
+		if (Foreign || (cmd.data != VarToByteArray(IAS_AID) && cmd.data != VarToByteArray(CIE_AID)))
+			return 0x6a82;
+		selectedEF = 0;
+		return 0x9000;
+	case 0x02: {
+		if (cmd.data.size() != 2)
+			return 0x6700;
+		WORD id = (cmd.data[0] << 8) | cmd.data[1];
+		auto file = Files.find(id);
+		if (file == Files.end())
+			return 0x6a82;
+		selectedEF = id;
+		if ((cmd.p2 & 0x0c) != 0x0c) {
+			// FCP minimo: solo la dimensione del file
+			uint8_t fcp[] = { 0x62, 0x04, 0x80, 0x02, HIBYTE(file->second.size()), LOBYTE(file->second.size()) };
+			resp = VarToByteArray(fcp);
+		}
+		return 0x9000;
+	}
+	default:
+		return 0x6a86;
+	}
+}
+
+StatusWord CVirtualCIE::ReadBinary(Command &cmd, ByteDynArray &resp) {
+	if (selectedEF == 0)
+		return 0x6986;
+	if (cmd.p1 & 0x80)
+		return 0x6a81;
+
+	ByteDynArray &content = Files[selectedEF];
+	size_t offset = (cmd.p1 << 8) | cmd.p2;
+	if (offset >= content.size())
+		return 0x6b00;
+	size_t len = cmd.le == 0 ? 0x100 : cmd.le;
+	if (offset + len > content.size()) {
+		resp = content.mid(offset);
+		return 0x6282;
+	}
+	resp = content.mid(offset, len);
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::GetData(Command &cmd, ByteDynArray &resp) {
+	if (cmd.p1 != 0x3f || cmd.p2 != 0xff)
+		return 0x6a86;
+	ByteArray &req = cmd.data;
+	if (req.size() < 4 || req[0] != 0x4d)
+		return 0x6a80;
+
+	if (req[2] == 0xa6) {
+		// chiave pubblica DH della carta: completo lo scambio e attivo il SM
+		if (dh_IFDpubKey.isEmpty())
+			return 0x6985;
+		do {
+			dh_prKey.resize(dh_q.size());
+			dh_prKey.random();
+		} while (dh_q[0] < dh_prKey[0]);
+		dh_prKey.right(1)[0] |= 1;
+
+		CRSA rsa(dh_p, dh_prKey);
+		dh_pubKey = rsa.RSA_PURE(dh_g);
+		ByteDynArray secret = rsa.RSA_PURE(dh_IFDpubKey);
+
+		CSHA256 sha256;
+		uint8_t diffENC[] = { 0x00, 0x00, 0x00, 0x01 };
+		uint8_t diffMAC[] = { 0x00, 0x00, 0x00, 0x02 };
+		sessENC = sha256.Digest(ByteDynArray(secret).append(VarToByteArray(diffENC))).left(16);
+		sessMAC = sha256.Digest(ByteDynArray(secret).append(VarToByteArray(diffMAC))).left(16);
+		sessSSC.resize(8);
+		sessSSC.fill(0);
+		sessSSC[7] = 1;
+		ActiveSM = true;
+
+		ByteDynArray pubKey;
+		pubKey.setASN1Tag(0x91, dh_pubKey);
+		resp.setASN1Tag(0xa6, pubKey);
+		return 0x9000;
+	}
+
+	if (req[2] != 0x70 || req.size() < 7 || req[4] != 0xbf)
+		return 0x6a88;
+
+	ByteDynArray params, doBF;
+	if (req[5] == 0xa1) {
+		// parametri DH: tutti insieme (Gemalto) o uno alla volta (NXP)
+		if (req.size() >= 12 && req[9] == 0x02) {
+			switch (req[10]) {
+			case 0x97: params.setASN1Tag(0x97, dh_g); break;
+			case 0x98: params.setASN1Tag(0x98, dh_p); break;
+			case 0x99: params.setASN1Tag(0x99, dh_q); break;
+			default: return 0x6a88;
+			}
+		}
+		else
+			params.setASN1Tag(0x97, dh_g).append(ASN1Tag(0x98, dh_p)).append(ASN1Tag(0x99, dh_q));
+		ByteDynArray doA3;
+		doA3.setASN1Tag(0xa3, params);
+		doBF.setASN1Tag(0xbfa101, doA3);
+	}
+	else if (req[5] == 0xa0) {
+		if (req[6] != (CIE_KEY_ExtAuth_ID & 0x7f))
+			return 0x6a88;
+		params.setASN1Tag(0x81, CA_module).append(ASN1Tag(0x82, CA_pubexp)).append(ASN1Tag(0x5f20, CA_CHR)).append(ASN1Tag(0x5f4c, CA_CHA));
+		ByteDynArray do7F49;
+		do7F49.setASN1Tag(0x7f49, params);
+		doBF.setASN1Tag(0xbfa004, do7F49);
+	}
+	else
+		return 0x6a88;
+
+	resp.setASN1Tag(0x70, doBF);
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::MSE(Command &cmd) {
+	CASNParser parser;
+	parser.Parse(cmd.data);
+
+	WORD p1p2 = (cmd.p1 << 8) | cmd.p2;
+	switch (p1p2) {
+	case 0x41a6: {
+		CASNTag *pubKey = FindTag(parser.tags, 0x91);
+		if (pubKey == nullptr || pubKey->content.size() != dh_p.size())
+			return 0x6a80;
+		dh_IFDpubKey = pubKey->content;
+		return 0x9000;
+	}
+	case 0x81b6: {
+		CASNTag *keyRef = FindTag(parser.tags, 0x83);
+		if (keyRef == nullptr || keyRef->content.size() != 1)
+			return 0x6a80;
+		verifyKey = keyRef->content[0];
+		return 0x9000;
+	}
+	case 0x81a4: {
+		// il CHR deve essere quello del certificato appena verificato
+		CASNTag *chr = FindTag(parser.tags, 0x83);
+		if (chr == nullptr)
+			return 0x6a80;
+		if (IFD_CHR.isEmpty() || chr->content != IFD_CHR)
+			return 0x6a88;
+		return 0x9000;
+	}
+	case 0x41a4: {
+		CASNTag *keyRef = FindTag(parser.tags, 0x84);
+		if (keyRef == nullptr || keyRef->content.size() != 1)
+			return 0x6a80;
+		intAuthKey = keyRef->content[0];
+		return 0x9000;
+	}
+	default:
+		return 0x6a86;
+	}
+}
+
+StatusWord CVirtualCIE::VerifyCertificate(Command &cmd) {
+	if (cmd.p1 != 0x00 || cmd.p2 != 0xae)
+		return 0x6a86;
+	if (verifyKey != CIE_KEY_ExtAuth_ID)
+		return 0x6a88;
+
+	CASNParser parser;
+	parser.Parse(cmd.data);
+	if (parser.tags.size() != 1)
+		return 0x6a80;
+	CASNTag *sig = FindTag(parser.tags[0]->tags, 0x5f37);
+	CASNTag *pkRem = FindTag(parser.tags[0]->tags, 0x5f38);
+	CASNTag *car = FindTag(parser.tags[0]->tags, 0x42);
+	if (sig == nullptr || pkRem == nullptr || car == nullptr)
+		return 0x6a80;
+	if (car->content != CA_CHR.mid(4))
+		return 0x6a88;
+
+	CRSA caKey(CA_module, CA_pubexp);
+	ByteDynArray recovered = caKey.RSA_PURE(sig->content);
+	if (recovered[0] != 0x6a || recovered.right(1)[0] != 0xbc)
+		return 0x6300;
+	ByteDynArray endEntityCert = recovered.mid(1, recovered.size() - SHA256_DIGEST_LENGTH - 2);
+	endEntityCert.append(pkRem->content);
+	CSHA256 sha256;
+	if (sha256.Digest(endEntityCert) != recovered.mid(recovered.size() - SHA256_DIGEST_LENGTH - 1, SHA256_DIGEST_LENGTH))
+		return 0x6300;
+
+	// CPI | CAR | CHR | CHA | OID | modulo | esponente pubblico
+	size_t chrStart = 1 + car->content.size();
+	size_t modStart = chrStart + DAPP_CHR_LEN + DAPP_CHA_LEN + DAPP_OID_LEN;
+	if (endEntityCert.size() <= modStart + DAPP_PUBEXP_LEN)
+		return 0x6a80;
+	IFD_CHR = endEntityCert.mid(chrStart, DAPP_CHR_LEN);
+	IFDModule = endEntityCert.mid(modStart, endEntityCert.size() - modStart - DAPP_PUBEXP_LEN);
+	IFDPubExp = endEntityCert.right(DAPP_PUBEXP_LEN);
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::ExternalAuthenticate(Command &cmd) {
+	if (IFDModule.isEmpty() || challenge.isEmpty() || dh_pubKey.isEmpty())
+		return 0x6985;
+	if (cmd.data.size() != 8 + IFDModule.size())
+		return 0x6700;
+
+	ByteArray snIFD = cmd.data.left(8);
+	if (snIFD != IFD_CHR.right(8))
+		return 0x6a88;
+
+	CRSA ifdKey(IFDModule, IFDPubExp);
+	ByteDynArray sig = cmd.data.mid(8);
+	ByteDynArray recovered = ifdKey.RSA_PURE(sig);
+	if (recovered[0] != 0x6a || recovered.right(1)[0] != 0xbc)
+		return 0x6300;
+
+	ByteArray PRND = recovered.mid(1, recovered.size() - SHA256_DIGEST_LENGTH - 2);
+	ByteDynArray toHash;
+	toHash.set(&PRND, &dh_IFDpubKey, &snIFD, &challenge, &dh_pubKey, &dh_g, &dh_p, &dh_q);
+	CSHA256 sha256;
+	if (sha256.Digest(toHash) != recovered.mid(recovered.size() - SHA256_DIGEST_LENGTH - 1, SHA256_DIGEST_LENGTH))
+		return 0x6300;
+
+	ExtAuthDone = true;
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::InternalAuthenticate(Command &cmd, ByteDynArray &resp) {
+	switch (intAuthKey) {
+	case CIE_KEY_DAPP_ID: {
+		if (!ExtAuthDone)
+			return 0x6982;
+		ByteDynArray &rndIFD = cmd.data;
+		ByteDynArray PRND2(DappModule.size() - SHA256_DIGEST_LENGTH - 2);
+		PRND2.random();
+		ByteDynArray toHash;
+		toHash.set(&PRND2, &dh_pubKey, &SN_ICC, &rndIFD, &dh_IFDpubKey, &dh_g, &dh_p, &dh_q);
+		CSHA256 sha256;
+		ByteDynArray hashICC = sha256.Digest(toHash);
+		ByteDynArray toSign;
+		toSign.set((uint8_t)0x6a, &PRND2, &hashICC, (uint8_t)0xbc);
+		CRSA dappKey(DappModule, DappPrivExp);
+		ByteDynArray signResp = dappKey.RSA_PURE(toSign);
+		resp.set(&SN_ICC, &signResp);
+
+		// il nuovo SSC vale dalla risposta successiva
+		ByteArray challengeBa = challenge.right(4);
+		ByteArray rndIFDBa = rndIFD.right(4);
+		pendingSSC.set(&challengeBa, &rndIFDBa);
+		DappDone = true;
+		return 0x9000;
+	}
+	case CIE_KEY_Servizi_ID:
+		return SignPKCS1(ServiziModule, ServiziPrivExp, cmd.data, resp);
+	case CIE_KEY_Sign_ID:
+		if (!PINVerified)
+			return 0x6982;
+		return SignPKCS1(SignModule, SignPrivExp, cmd.data, resp);
+	default:
+		return 0x6a88;
+	}
+}
+
+StatusWord CVirtualCIE::Verify(Command &cmd) {
+	if (!DappDone)
+		return 0x6982;
+
+	bool isPIN = cmd.p2 == CIE_PIN_ID;
+	if (!isPIN && cmd.p2 != CIE_PUK_ID)
+		return 0x6a88;
+	ByteDynArray &ref = isPIN ? PIN : PUK;
+	int &tries = isPIN ? PINTries : PUKTries;
+	bool &verified = isPIN ? PINVerified : PUKVerified;
+
+	if (cmd.data.isEmpty())
+		return 0x63c0 | tries;
+	if (tries == 0)
+		return 0x6983;
+	if (cmd.data != ref) {
+		tries--;
+		verified = false;
+		return 0x63c0 | tries;
+	}
+	tries = isPIN ? CIE_PIN_TRIES : CIE_PUK_TRIES;
+	verified = true;
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::ChangeReference(Command &cmd) {
+	if (!DappDone)
+		return 0x6982;
+	if (cmd.p2 != CIE_PIN_ID)
+		return 0x6a88;
+	if (cmd.data.size() <= PIN.size())
+		return 0x6700;
+	if (PINTries == 0)
+		return 0x6983;
+	if (cmd.data.left(PIN.size()) != PIN) {
+		PINTries--;
+		PINVerified = false;
+		return 0x63c0 | PINTries;
+	}
+	PIN = cmd.data.mid(PIN.size());
+	PINTries = CIE_PIN_TRIES;
+	return 0x9000;
+}
+
+StatusWord CVirtualCIE::ResetRetryCounter(Command &cmd) {
+	if (!PUKVerified)
+		return 0x6982;
+	if (cmd.p2 != CIE_PIN_ID)
+		return 0x6a88;
+	if (cmd.p1 == 0x02) {
+		if (cmd.data.isEmpty())
+			return 0x6700;
+		PIN = cmd.data;
+	}
+	else if (cmd.p1 != 0x03)
+		return 0x6a86;
+	PINTries = CIE_PIN_TRIES;
+	return 0x9000;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "../cie-pkcs11/PCSC/Token.h"
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+// Carta CIE (IAS, profilo Gemalto) emulata in memoria.
+// Si collega a CToken/IAS al posto del lettore tramite TransmitCallback:
+//
+//		CVirtualCIE card;
+//		IAS ias(CVirtualCIE::TransmitCallback, card.ATR);
+//		ias.SetCardContext(&card);
+//
+// Implementa i comandi usati dal middleware (SELECT, READ BINARY, GET DATA, MSE, PSO,
+// GET CHALLENGE, EXTERNAL/INTERNAL AUTHENTICATE, VERIFY, CHANGE REFERENCE DATA,
+// RESET RETRY COUNTER), lo scambio DH, la DAPP e il Secure Messaging 3DES/retail MAC.
+// Non riproduce il file system reale: gli EF sono cercati per ID indipendentemente dal DF
+// selezionato e la carta non risponde mai con 61xx.
+class CVirtualCIE
+{
+public:
+	CVirtualCIE(const char *szPIN = "12345678", const char *szPUK = "87654321");
+	~CVirtualCIE();
+
+	static HRESULT TransmitCallback(void *data, uint8_t *apdu, DWORD apduSize, uint8_t *resp, DWORD *respSize);
+
+	ByteDynArray ATR;
+	ByteDynArray PAN;
+	// contenuto degli EF, per ID; puo' essere modificato prima dell'uso
+	std::map<WORD, ByteDynArray> Files;
+
+	// ritardo applicato ad ogni APDU, piu' un eventuale ritardo aggiuntivo per INS
+	std::chrono::microseconds Latency;
+	std::map<uint8_t, std::chrono::microseconds> InsLatency;
+
+	std::atomic<DWORD> APDUCount;
+
+	// carta non CIE (bancaria, tessera sanitaria...): rifiuta la SELECT delle applicazioni
+	// IAS e CIE. L'ATR va sostituito a parte
+	bool Foreign;
+
+private:
+	struct Command {
+		uint8_t cla, ins, p1, p2;
+		ByteDynArray data;
+		DWORD le;
+	};
+
+	std::mutex cardMutex;
+
+	ByteDynArray PIN, PUK;
+	int PINTries, PUKTries;
+
+	ByteDynArray dh_g, dh_p, dh_q, dh_prKey, dh_pubKey, dh_IFDpubKey;
+	ByteDynArray CA_module, CA_pubexp, CA_CHR, CA_CHA;
+	ByteDynArray DappModule, DappPrivExp, DappPubExp;
+	ByteDynArray ServiziModule, ServiziPrivExp;
+	ByteDynArray SignModule, SignPrivExp;
+	ByteDynArray SN_ICC;
+
+	// stato di sicurezza, azzerato dal reset e dalla chiusura del canale SM
+	bool ActiveSM;
+	bool ExtAuthDone, DappDone;
+	bool PINVerified, PUKVerified;
+	ByteDynArray sessENC, sessMAC, sessSSC;
+	// SSC da usare dopo la risposta in corso (fine della DAPP)
+	ByteDynArray pendingSSC;
+	ByteDynArray IFDModule, IFDPubExp, IFD_CHR;
+	ByteDynArray challenge;
+	uint8_t verifyKey, intAuthKey;
+
+	WORD selectedEF;
+	ByteDynArray chainData;
+
+	void GenerateKeys();
+	void Reset();
+	void CloseSM();
+
+	bool ParseAPDU(ByteArray &apdu, Command &cmd);
+	StatusWord UnwrapSM(Command &cmd);
+	ByteDynArray WrapSM(ByteArray &data, StatusWord sw);
+	StatusWord Process(Command &cmd, ByteDynArray &resp);
+
+	StatusWord Select(Command &cmd, ByteDynArray &resp);
+	StatusWord ReadBinary(Command &cmd, ByteDynArray &resp);
+	StatusWord GetData(Command &cmd, ByteDynArray &resp);
+	StatusWord MSE(Command &cmd);
+	StatusWord VerifyCertificate(Command &cmd);
+	StatusWord ExternalAuthenticate(Command &cmd);
+	StatusWord InternalAuthenticate(Command &cmd, ByteDynArray &resp);
+	StatusWord Verify(Command &cmd);
+	StatusWord ChangeReference(Command &cmd);
+	StatusWord ResetRetryCounter(Command &cmd);
+	void Transmit(ByteArray &apdu, ByteDynArray &resp);
+};
@@ -0,0 +1,430 @@
+#include "VirtualPCSC.h"
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstring>
+
+// le firme seguono PCSC.framework (tipi a 32 bit espliciti), non le macro LONG/DWORD
+// del middleware
+
+#ifndef SCARD_ABSENT
+#define SCARD_ABSENT		0x0002
+#define SCARD_PRESENT		0x0004
+#define SCARD_POWERED		0x0010
+#define SCARD_SPECIFIC		0x0040
+#endif
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = { SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST) };
+const SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST) };
+const SCARD_IO_REQUEST g_rgSCardRawPci = { 0x00010000, sizeof(SCARD_IO_REQUEST) };
+
+std::chrono::microseconds CVirtualPCSC::CallLatency(0);
+std::atomic<DWORD> CVirtualPCSC::CallCount(0);
+std::atomic<DWORD> CVirtualPCSC::TransmitCount(0);
+
+static const char szPnPNotification[] = "\\\\?PnP?\\Notification";
+
+struct VReader {
+	std::string name;
+	std::shared_ptr<CVirtualCIE> card;
+	// contatore degli eventi nella parola alta dello stato, come pcsc-lite
+	uint32_t events = 0;
+	// identificano inserimento e reset correnti: un handle aperto prima vede la carta cambiata
+	uint32_t insertion = 0;
+	uint32_t resets = 0;
+	SCARDHANDLE transaction = 0;
+};
+
+struct VHandle {
+	std::string reader;
+	uint32_t insertion;
+	uint32_t resets;
+};
+
+// il middleware rilascia contesti e handle anche dai propri distruttori statici (la lista
+// degli slot): lo stato del PC/SC emulato non si distrugge mai
+static std::mutex &pcscMutex = *new std::mutex;
+static std::condition_variable &pcscEvent = *new std::condition_variable;
+static std::vector<std::unique_ptr<VReader>> &readers = *new std::vector<std::unique_ptr<VReader>>;
+static std::map<SCARDCONTEXT, uint32_t> &contexts = *new std::map<SCARDCONTEXT, uint32_t>;		// contesto -> numero di SCardCancel ricevute
+static std::map<SCARDHANDLE, VHandle> &handles = *new std::map<SCARDHANDLE, VHandle>;
+static int32_t lastId = 0x1000;
+
+static void ipcCall() {
+	CVirtualPCSC::CallCount++;
+	if (CVirtualPCSC::CallLatency.count() > 0)
+		std::this_thread::sleep_for(CVirtualPCSC::CallLatency);
+}
+
+static VReader *findReader(const std::string &name) {
+	for (auto &r : readers)
+		if (r->name == name)
+			return r.get();
+	return nullptr;
+}
+
+static void resetCard(VReader *r) {
+	r->resets++;
+	uint8_t reset[] = { 0xff, 0xff };
+	uint8_t resp[2];
+	DWORD respSize = sizeof(resp);
+	CVirtualCIE::TransmitCallback(r->card.get(), reset, sizeof(reset), resp, &respSize);
+}
+
+// da chiamare con pcscMutex
+static int32_t checkHandle(SCARDHANDLE hCard, VReader *&r, VHandle *&h) {
+	auto it = handles.find(hCard);
+	if (it == handles.end())
+		return SCARD_E_INVALID_HANDLE;
+	h = &it->second;
+	r = findReader(h->reader);
+	if (r == nullptr)
+		return SCARD_E_READER_UNAVAILABLE;
+	if (r->card == nullptr || r->insertion != h->insertion)
+		return SCARD_W_REMOVED_CARD;
+	if (r->resets != h->resets)
+		return SCARD_W_RESET_CARD;
+	return SCARD_S_SUCCESS;
+}
+
+// da chiamare con pcscMutex: aspetta che nessun altro handle abbia una transazione sulla carta
+static int32_t waitTransaction(std::unique_lock<std::mutex> &lock, SCARDHANDLE hCard, VReader *&r, VHandle *&h) {
+	while (true) {
+		int32_t ris = checkHandle(hCard, r, h);
+		if (ris != SCARD_S_SUCCESS)
+			return ris;
+		if (r->transaction == 0 || r->transaction == hCard)
+			return SCARD_S_SUCCESS;
+		pcscEvent.wait(lock);
+	}
+}
+
+void CVirtualPCSC::AddReader(const char *szReader) {
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	if (findReader(szReader) != nullptr)
+		return;
+	readers.emplace_back(new VReader());
+	readers.back()->name = szReader;
+	pcscEvent.notify_all();
+}
+
+void CVirtualPCSC::RemoveReader(const char *szReader) {
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	for (auto it = readers.begin(); it != readers.end(); it++) {
+		if ((*it)->name == szReader) {
+			readers.erase(it);
+			break;
+		}
+	}
+	pcscEvent.notify_all();
+}
+
+void CVirtualPCSC::Insert(const char *szReader, std::shared_ptr<CVirtualCIE> card) {
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r = findReader(szReader);
+	if (r == nullptr)
+		return;
+	r->card = card;
+	r->insertion++;
+	r->events++;
+	r->transaction = 0;
+	// una carta appena inserita parte dallo stato di power-on
+	resetCard(r);
+	pcscEvent.notify_all();
+}
+
+void CVirtualPCSC::Remove(const char *szReader) {
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r = findReader(szReader);
+	if (r == nullptr || r->card == nullptr)
+		return;
+	r->card = nullptr;
+	r->events++;
+	r->transaction = 0;
+	pcscEvent.notify_all();
+}
+
+std::vector<std::string> CVirtualPCSC::Readers() {
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	std::vector<std::string> names;
+	for (auto &r : readers)
+		names.push_back(r->name);
+	return names;
+}
+
+void CVirtualPCSC::ResetCounters() {
+	CallCount = 0;
+	TransmitCount = 0;
+}
+
+extern "C" {
+
+int32_t SCardEstablishContext(uint32_t dwScope, const void *pvReserved1, const void *pvReserved2, SCARDCONTEXT *phContext) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	*phContext = ++lastId;
+	contexts[*phContext] = 0;
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardReleaseContext(SCARDCONTEXT hContext) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	if (contexts.erase(hContext) == 0)
+		return SCARD_E_INVALID_HANDLE;
+	pcscEvent.notify_all();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardIsValidContext(SCARDCONTEXT hContext) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	return contexts.find(hContext) != contexts.end() ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+int32_t SCardCancel(SCARDCONTEXT hContext) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	auto it = contexts.find(hContext);
+	if (it == contexts.end())
+		return SCARD_E_INVALID_HANDLE;
+	it->second++;
+	pcscEvent.notify_all();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardListReaders(SCARDCONTEXT hContext, const char *mszGroups, char *mszReaders, uint32_t *pcchReaders) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	if (contexts.find(hContext) == contexts.end())
+		return SCARD_E_INVALID_HANDLE;
+	if (readers.empty())
+		return SCARD_E_NO_READERS_AVAILABLE;
+	std::string list;
+	for (auto &r : readers)
+		list.append(r->name).push_back(0);
+	list.push_back(0);
+	if (mszReaders != nullptr) {
+		if (*pcchReaders < list.size()) {
+			*pcchReaders = (uint32_t)list.size();
+			return SCARD_E_INSUFFICIENT_BUFFER;
+		}
+		memcpy(mszReaders, list.data(), list.size());
+	}
+	*pcchReaders = (uint32_t)list.size();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardGetStatusChange(SCARDCONTEXT hContext, uint32_t dwTimeout, SCARD_READERSTATE *rgReaderStates, uint32_t cReaders) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	auto ctx = contexts.find(hContext);
+	if (ctx == contexts.end())
+		return SCARD_E_INVALID_HANDLE;
+	uint32_t cancelled = ctx->second;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwTimeout);
+
+	while (true) {
+		bool changed = false;
+		for (uint32_t i = 0; i < cReaders; i++) {
+			auto &state = rgReaderStates[i];
+			uint32_t current = state.dwCurrentState;
+			uint32_t event;
+			if (strcmp(state.szReader, szPnPNotification) == 0) {
+				// lo pseudo-lettore cambia quando cambia la lista dei lettori
+				event = (uint32_t)readers.size() << 16;
+				if (current == SCARD_STATE_UNAWARE || (current >> 16) != (event >> 16))
+					event |= SCARD_STATE_CHANGED;
+			}
+			else if (current & SCARD_STATE_IGNORE) {
+				event = SCARD_STATE_IGNORE;
+			}
+			else {
+				VReader *r = findReader(state.szReader);
+				if (r == nullptr)
+					event = SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE;
+				else {
+					event = (r->card ? SCARD_STATE_PRESENT : SCARD_STATE_EMPTY) | (r->events << 16);
+					state.cbAtr = 0;
+					if (r->card) {
+						state.cbAtr = (uint32_t)r->card->ATR.size();
+						memcpy(state.rgbAtr, r->card->ATR.data(), state.cbAtr);
+					}
+				}
+				uint32_t mask = SCARD_STATE_PRESENT | SCARD_STATE_EMPTY | SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE;
+				if (current == SCARD_STATE_UNAWARE || (current & mask) != (event & mask) || (current >> 16) != (event >> 16))
+					event |= SCARD_STATE_CHANGED;
+			}
+			state.dwEventState = event;
+			if (event & SCARD_STATE_CHANGED)
+				changed = true;
+		}
+		if (changed)
+			return SCARD_S_SUCCESS;
+		if (dwTimeout == 0)
+			return SCARD_E_TIMEOUT;
+
+		if (dwTimeout == INFINITE)
+			pcscEvent.wait(lock);
+		else if (pcscEvent.wait_until(lock, deadline) == std::cv_status::timeout)
+			return SCARD_E_TIMEOUT;
+
+		ctx = contexts.find(hContext);
+		if (ctx == contexts.end() || ctx->second != cancelled)
+			return SCARD_E_CANCELLED;
+	}
+}
+
+int32_t SCardConnect(SCARDCONTEXT hContext, const char *szReader, uint32_t dwShareMode, uint32_t dwPreferredProtocols, SCARDHANDLE *phCard, uint32_t *pdwActiveProtocol) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	if (contexts.find(hContext) == contexts.end())
+		return SCARD_E_INVALID_HANDLE;
+	VReader *r = findReader(szReader);
+	if (r == nullptr)
+		return SCARD_E_UNKNOWN_READER;
+	if (r->card == nullptr)
+		return SCARD_E_NO_SMARTCARD;
+	*phCard = ++lastId;
+	handles[*phCard] = VHandle{ r->name, r->insertion, r->resets };
+	if (pdwActiveProtocol)
+		*pdwActiveProtocol = SCARD_PROTOCOL_T1;
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardReconnect(SCARDHANDLE hCard, uint32_t dwShareMode, uint32_t dwPreferredProtocols, uint32_t dwInitialization, uint32_t *pdwActiveProtocol) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = checkHandle(hCard, r, h);
+	if (ris == SCARD_E_INVALID_HANDLE || ris == SCARD_E_READER_UNAVAILABLE)
+		return ris;
+	if (r->card == nullptr)
+		return SCARD_E_NO_SMARTCARD;
+	if (dwInitialization == SCARD_RESET_CARD || dwInitialization == SCARD_UNPOWER_CARD)
+		resetCard(r);
+	h->insertion = r->insertion;
+	h->resets = r->resets;
+	if (pdwActiveProtocol)
+		*pdwActiveProtocol = SCARD_PROTOCOL_T1;
+	pcscEvent.notify_all();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardDisconnect(SCARDHANDLE hCard, uint32_t dwDisposition) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = checkHandle(hCard, r, h);
+	if (ris == SCARD_E_INVALID_HANDLE)
+		return ris;
+	if (r != nullptr && r->transaction == hCard)
+		r->transaction = 0;
+	if (ris == SCARD_S_SUCCESS && (dwDisposition == SCARD_RESET_CARD || dwDisposition == SCARD_UNPOWER_CARD))
+		resetCard(r);
+	handles.erase(hCard);
+	pcscEvent.notify_all();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardBeginTransaction(SCARDHANDLE hCard) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = waitTransaction(lock, hCard, r, h);
+	if (ris != SCARD_S_SUCCESS)
+		return ris;
+	r->transaction = hCard;
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardEndTransaction(SCARDHANDLE hCard, uint32_t dwDisposition) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = checkHandle(hCard, r, h);
+	if (ris == SCARD_E_INVALID_HANDLE || ris == SCARD_E_READER_UNAVAILABLE)
+		return ris;
+	if (r->transaction == hCard)
+		r->transaction = 0;
+	if (ris == SCARD_S_SUCCESS && (dwDisposition == SCARD_RESET_CARD || dwDisposition == SCARD_UNPOWER_CARD)) {
+		resetCard(r);
+		h->resets = r->resets;
+	}
+	pcscEvent.notify_all();
+	return ris;
+}
+
+int32_t SCardStatus(SCARDHANDLE hCard, char *mszReaderNames, uint32_t *pcchReaderLen, uint32_t *pdwState, uint32_t *pdwProtocol, unsigned char *pbAtr, uint32_t *pcbAtrLen) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = checkHandle(hCard, r, h);
+	if (ris != SCARD_S_SUCCESS)
+		return ris;
+	if (pcchReaderLen) {
+		if (mszReaderNames && *pcchReaderLen >= r->name.size() + 2) {
+			memcpy(mszReaderNames, r->name.c_str(), r->name.size() + 1);
+			mszReaderNames[r->name.size() + 1] = 0;
+		}
+		*pcchReaderLen = (uint32_t)r->name.size() + 2;
+	}
+	if (pdwState)
+		*pdwState = SCARD_PRESENT | SCARD_POWERED | SCARD_SPECIFIC;
+	if (pdwProtocol)
+		*pdwProtocol = SCARD_PROTOCOL_T1;
+	if (pcbAtrLen) {
+		if (pbAtr && *pcbAtrLen >= r->card->ATR.size())
+			memcpy(pbAtr, r->card->ATR.data(), r->card->ATR.size());
+		*pcbAtrLen = (uint32_t)r->card->ATR.size();
+	}
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardGetAttrib(SCARDHANDLE hCard, uint32_t dwAttrId, uint8_t *pbAttr, uint32_t *pcbAttrLen) {
+	ipcCall();
+	std::unique_lock<std::mutex> lock(pcscMutex);
+	VReader *r;
+	VHandle *h;
+	int32_t ris = checkHandle(hCard, r, h);
+	if (ris != SCARD_S_SUCCESS)
+		return ris;
+	// l'unico attributo richiesto dal middleware e' l'ATR (SCARD_ATTR_ATR_STRING)
+	if (dwAttrId != ((9 << 16) | 0x0303))
+		return SCARD_E_INVALID_PARAMETER;
+	if (pbAttr != nullptr) {
+		if (*pcbAttrLen < r->card->ATR.size())
+			return SCARD_E_INSUFFICIENT_BUFFER;
+		memcpy(pbAttr, r->card->ATR.data(), r->card->ATR.size());
+	}
+	*pcbAttrLen = (uint32_t)r->card->ATR.size();
+	return SCARD_S_SUCCESS;
+}
+
+int32_t SCardTransmit(SCARDHANDLE hCard, const SCARD_IO_REQUEST *pioSendPci, const unsigned char *pbSendBuffer, uint32_t cbSendLength, SCARD_IO_REQUEST *pioRecvPci, unsigned char *pbRecvBuffer, uint32_t *pcbRecvLength) {
+	ipcCall();
+	CVirtualPCSC::TransmitCount++;
+	std::shared_ptr<CVirtualCIE> card;
+	{
+		std::unique_lock<std::mutex> lock(pcscMutex);
+		VReader *r;
+		VHandle *h;
+		int32_t ris = waitTransaction(lock, hCard, r, h);
+		if (ris != SCARD_S_SUCCESS)
+			return ris;
+		card = r->card;
+	}
+	// la carta serializza da se' le APDU: i lettori diversi lavorano in parallelo
+	DWORD respSize = *pcbRecvLength;
+	HRESULT ris = CVirtualCIE::TransmitCallback(card.get(), (uint8_t*)pbSendBuffer, cbSendLength, pbRecvBuffer, &respSize);
+	*pcbRecvLength = respSize;
+	return (int32_t)ris;
+}
+
+}
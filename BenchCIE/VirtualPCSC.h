@@ -0,0 +1,37 @@
+#pragma once
+
+#include "VirtualCIE.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+
+// PC/SC emulato in memoria: implementa le SCard* usate dal middleware su lettori virtuali
+// in cui il banco di prova inserisce ed estrae delle CVirtualCIE. Nel target BenchCIE prende
+// il posto di PCSC.framework, quindi il middleware compilato nel banco di prova non vede
+// differenze rispetto ad un lettore reale:
+//
+//		CVirtualPCSC::AddReader("Lettore 1");
+//		CVirtualPCSC::Insert("Lettore 1", std::make_shared<CVirtualCIE>());
+//
+// Riproduce la semantica che il middleware usa: transazioni esclusive per carta, reset e
+// estrazione visti dagli altri handle come SCARD_W_RESET_CARD / SCARD_W_REMOVED_CARD,
+// SCardGetStatusChange con contatore degli eventi nella parola alta e pseudo-lettore PnP,
+// SCardCancel sulle attese in corso.
+class CVirtualPCSC
+{
+public:
+	static void AddReader(const char *szReader);
+	static void RemoveReader(const char *szReader);
+	static void Insert(const char *szReader, std::shared_ptr<CVirtualCIE> card);
+	static void Remove(const char *szReader);
+	static std::vector<std::string> Readers();
+
+	// ritardo applicato ad ogni chiamata SCard*, per simulare la IPC verso il demone PC/SC
+	static std::chrono::microseconds CallLatency;
+	// chiamate SCard* ricevute, e quante di queste sono SCardTransmit
+	static std::atomic<DWORD> CallCount;
+	static std::atomic<DWORD> TransmitCount;
+	static void ResetCounters();
+};
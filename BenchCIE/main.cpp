@@ -0,0 +1,1262 @@
+/*
+ *  BenchCIE: banco di prova del middleware su una CIE emulata.
+ *
+ *  Il middleware e' compilato nel banco di prova insieme a CVirtualCIE (la carta) e a
+ *  CVirtualPCSC (i lettori): le SCard* sono quelle emulate, quindi PKCS#11, slot, sessioni,
+ *  IAS e Secure Messaging girano come su una carta reale, con ritardi configurabili per
+ *  le APDU e per la IPC verso il demone PC/SC.
+ *
+ *		BenchCIE test				verifica il flusso IAS e PKCS#11 sulla carta emulata
+ *		BenchCIE <scenario> [...]	misura uno scenario, vedi BenchCIE senza argomenti
+ *		BenchCIE -v ...				lascia sullo stdout i dump di debug del middleware
+ *
+ *  I dati di abilitazione della carta emulata vanno in una HOME temporanea.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include <openssl/objects.h>
+
+#include "../cie-pkcs11/PKCS11/cryptoki.h"
+#include "../cie-pkcs11/PKCS11/PKCS11Functions.h"
+#include "../cie-pkcs11/CSP/IAS.h"
+#include "../cie-pkcs11/Crypto/RSA.h"
+#include "../cie-pkcs11/Crypto/MAC.h"
+#include "../cie-pkcs11/Util/log.h"
+#include "VirtualCIE.h"
+#include "VirtualPCSC.h"
+
+typedef std::chrono::steady_clock Clock;
+
+extern CLog Log;
+
+static const char *szPIN = "12345678";
+static CK_FUNCTION_LIST_PTR p11;
+// risultati e verifiche; lo stdout del processo, su cui il middleware scrive i dump delle
+// APDU, va su /dev/null a meno di -v
+static FILE *out = stdout;
+static int failures = 0;
+
+#define CHECK(cond, desc) check((cond), desc, __LINE__)
+
+static void check(bool ok, const char *desc, int line) {
+	fprintf(out, "  %s %s\n", ok ? "ok  " : "FAIL", desc);
+	if (!ok) {
+		fprintf(out, "       (main.cpp:%d)\n", line);
+		failures++;
+	}
+}
+
+static double elapsedMs(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// reset della carta emulata, come lo fa il lettore all'inserimento
+static void resetCard(CVirtualCIE &card) {
+	uint8_t reset[] = { 0xff, 0xff };
+	uint8_t resp[2];
+	DWORD respSize = sizeof(resp);
+	CVirtualCIE::TransmitCallback(&card, reset, sizeof(reset), resp, &respSize);
+}
+
+// abilitazione della carta: salva in cache le prime 4 cifre del PIN e il certificato,
+// cifrati con la chiave derivata dalla carta, come fa AbilitaCIE dopo la verifica del SOD
+// (il SOD della carta emulata non e' firmato da una CA riconosciuta)
+static void enableCard(CVirtualCIE &card) {
+	IAS ias((CToken::TokenTransmitCallback)CVirtualCIE::TransmitCallback, card.ATR);
+	ias.SetCardContext(&card);
+	ias.token.Reset();
+	ias.SelectAID_IAS();
+	ias.ReadPAN();
+	ByteDynArray resp;
+	ias.SelectAID_CIE();
+	ias.ReadDappPubKey(resp);
+	ias.InitEncKey();
+
+	std::string PANStr;
+	dumpHexData(ias.PAN.mid(5, 6), PANStr, false);
+	ByteArray pinBa((uint8_t*)szPIN, 4);
+	ias.SetCache(PANStr.c_str(), card.Files[0x1003], pinBa);
+	resetCard(card);
+}
+
+static RSA *certKey(ByteArray cert) {
+	const unsigned char *data = cert.data();
+	X509 *x509 = d2i_X509(nullptr, &data, (long)cert.size());
+	if (x509 == nullptr)
+		return nullptr;
+	EVP_PKEY *pkey = X509_get_pubkey(x509);
+	RSA *rsa = pkey ? EVP_PKEY_get1_RSA(pkey) : nullptr;
+	EVP_PKEY_free(pkey);
+	X509_free(x509);
+	return rsa;
+}
+
+// flusso IAS completo direttamente sulla carta: DH, DAPP, VERIFY PIN e firma in SM
+static void testIAS() {
+	fprintf(out, "Flusso IAS su CVirtualCIE\n");
+	CVirtualCIE card;
+	IAS ias((CToken::TokenTransmitCallback)CVirtualCIE::TransmitCallback, card.ATR);
+	ias.SetCardContext(&card);
+	ias.token.Reset();
+
+	ias.SelectAID_IAS();
+	ias.ReadPAN();
+	CHECK(ias.PAN == card.PAN, "lettura del PAN");
+
+	ias.SelectAID_CIE();
+	ias.InitDHParam();
+	ByteDynArray dappKey;
+	ias.ReadDappPubKey(dappKey);
+	ias.InitExtAuthKeyParam();
+	ias.DHKeyExchange();
+	CHECK(ias.ActiveSM, "scambio DH e apertura del canale SM");
+
+	ias.DAPP();
+	CHECK(true, "DAPP");
+
+	ByteDynArray toSign(32);
+	toSign.random();
+	ByteDynArray signature;
+	bool refused = false;
+	try {
+		ias.Sign(toSign, signature);
+	}
+	catch (std::exception &) {
+		refused = true;
+	}
+	CHECK(refused, "firma rifiutata senza PIN");
+
+	ByteArray wrongPIN((uint8_t*)"00000000", 8);
+	CHECK((ias.VerifyPIN(wrongPIN) & 0xfff0) == 0x63c0, "PIN errato rifiutato");
+	ByteArray PIN((uint8_t*)szPIN, 8);
+	CHECK(ias.VerifyPIN(PIN) == 0x9000, "VERIFY PIN");
+
+	signature.clear();
+	ias.Sign(toSign, signature);
+	RSA *rsa = certKey(card.Files[0x1003]);
+	ByteDynArray clear(signature.size());
+	int len = rsa ? RSA_public_decrypt((int)signature.size(), signature.data(), clear.data(), rsa, RSA_PKCS1_PADDING) : -1;
+	CHECK(len == (int)toSign.size() && ByteArray(clear.data(), len) == toSign, "firma in SM verificata con la chiave del certificato");
+	RSA_free(rsa);
+
+	CHECK(card.APDUCount > 0, "APDU ricevute dalla carta");
+}
+
+static CK_RV loadP11() {
+	if (p11 != nullptr)
+		return CKR_OK;
+	return C_GetFunctionList(&p11);
+}
+
+static CK_OBJECT_HANDLE findObject(CK_SESSION_HANDLE hSession, CK_OBJECT_CLASS cls) {
+	CK_ATTRIBUTE tmpl[] = { { CKA_CLASS, &cls, sizeof(cls) } };
+	CK_OBJECT_HANDLE hObject = 0;
+	CK_ULONG found = 0;
+	if (p11->C_FindObjectsInit(hSession, tmpl, 1) != CKR_OK)
+		return 0;
+	p11->C_FindObjects(hSession, &hObject, 1, &found);
+	p11->C_FindObjectsFinal(hSession);
+	return found == 1 ? hObject : 0;
+}
+
+// DigestInfo SHA256 da firmare con CKM_RSA_PKCS, come fanno le applicazioni di firma
+static ByteDynArray digestInfo(ByteArray data) {
+	static const uint8_t sha256Prefix[] = { 0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+	ByteDynArray info(sizeof(sha256Prefix) + SHA256_DIGEST_LENGTH);
+	memcpy(info.data(), sha256Prefix, sizeof(sha256Prefix));
+	SHA256(data.data(), data.size(), info.data() + sizeof(sha256Prefix));
+	return info;
+}
+
+static CK_RV sign(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, ByteArray data, ByteDynArray &signature) {
+	CK_MECHANISM mech = { CKM_RSA_PKCS, nullptr, 0 };
+	ByteDynArray info = digestInfo(data);
+	signature.resize(512);
+	CK_ULONG sigLen = (CK_ULONG)signature.size();
+	CK_RV rv = p11->C_SignInit(hSession, &mech, hKey);
+	if (rv == CKR_OK)
+		rv = p11->C_Sign(hSession, info.data(), (CK_ULONG)info.size(), signature.data(), &sigLen);
+	if (rv == CKR_OK)
+		signature.resize(sigLen, true);
+	return rv;
+}
+
+// firma SHA256 con RSA PKCS#1 e verifica con il certificato letto dal token
+static bool signAndVerify(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, CK_OBJECT_HANDLE hCert) {
+	uint8_t data[] = "banco di prova CIE";
+	ByteDynArray signature;
+	if (sign(hSession, hKey, ByteArray(data, sizeof(data)), signature) != CKR_OK)
+		return false;
+
+	CK_ATTRIBUTE value = { CKA_VALUE, nullptr, 0 };
+	if (p11->C_GetAttributeValue(hSession, hCert, &value, 1) != CKR_OK)
+		return false;
+	ByteDynArray cert(value.ulValueLen);
+	value.pValue = cert.data();
+	if (p11->C_GetAttributeValue(hSession, hCert, &value, 1) != CKR_OK)
+		return false;
+
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	SHA256(data, sizeof(data), digest);
+	RSA *rsa = certKey(cert);
+	bool ok = rsa != nullptr && RSA_verify(NID_sha256, digest, sizeof(digest), signature.data(), (unsigned int)signature.size(), rsa) == 1;
+	RSA_free(rsa);
+	return ok;
+}
+
+static ByteDynArray certValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hCert) {
+	CK_ATTRIBUTE value = { CKA_VALUE, nullptr, 0 };
+	if (p11->C_GetAttributeValue(hSession, hCert, &value, 1) != CKR_OK)
+		return ByteDynArray();
+	ByteDynArray cert(value.ulValueLen);
+	value.pValue = cert.data();
+	if (p11->C_GetAttributeValue(hSession, hCert, &value, 1) != CKR_OK)
+		return ByteDynArray();
+	return cert;
+}
+
+// firma di count DigestInfo con C_CIE_SignBatch; nullIndex < count lascia NULL quel buffer di firma
+static CK_RV signBatch(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, size_t count, std::vector<ByteDynArray> &infos, std::vector<ByteDynArray> &signatures, std::vector<CK_RV> &results, size_t nullIndex = SIZE_MAX) {
+	CK_CIE_FUNCTION_LIST_PTR cieList;
+	CK_RV rv = C_CIE_GetFunctionListExt(&cieList);
+	if (rv != CKR_OK)
+		return rv;
+	std::vector<CK_BYTE_PTR> ppData, ppSignature;
+	std::vector<CK_ULONG> dataLen, sigLen;
+	infos.clear();
+	signatures.assign(count, ByteDynArray(512));
+	results.assign(count, CKR_GENERAL_ERROR);
+	for (size_t i = 0; i < count; i++) {
+		uint8_t data[4] = { 'C', 'I', 'E', (uint8_t)i };
+		infos.push_back(digestInfo(VarToByteArray(data)));
+	}
+	for (size_t i = 0; i < count; i++) {
+		ppData.push_back(infos[i].data());
+		dataLen.push_back((CK_ULONG)infos[i].size());
+		ppSignature.push_back(i == nullIndex ? nullptr : signatures[i].data());
+		sigLen.push_back((CK_ULONG)signatures[i].size());
+	}
+	CK_MECHANISM mech = { CKM_RSA_PKCS, nullptr, 0 };
+	rv = p11->C_SignInit(hSession, &mech, hKey);
+	if (rv == CKR_OK)
+		rv = cieList->C_CIE_SignBatch(hSession, (CK_ULONG)count, ppData.data(), dataLen.data(), ppSignature.data(), sigLen.data(), results.data());
+	for (size_t i = 0; i < count && rv == CKR_OK; i++) {
+		if (results[i] == CKR_OK)
+			signatures[i].resize(sigLen[i], true);
+	}
+	return rv;
+}
+
+// lotto di firme verificate una per una con il certificato letto dal token
+static bool signBatchAndVerify(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, CK_OBJECT_HANDLE hCert, size_t count) {
+	std::vector<ByteDynArray> infos, signatures;
+	std::vector<CK_RV> results;
+	if (signBatch(hSession, hKey, count, infos, signatures, results) != CKR_OK)
+		return false;
+	RSA *rsa = certKey(certValue(hSession, hCert));
+	bool ok = rsa != nullptr;
+	for (size_t i = 0; i < count && ok; i++) {
+		ByteDynArray clear(signatures[i].size());
+		int len = results[i] == CKR_OK ? RSA_public_decrypt((int)signatures[i].size(), signatures[i].data(), clear.data(), rsa, RSA_PKCS1_PADDING) : -1;
+		ok = len == (int)infos[i].size() && ByteArray(clear.data(), len) == infos[i];
+	}
+	RSA_free(rsa);
+	return ok;
+}
+
+// reset della carta da parte di un'altra applicazione: il canale SM del middleware si chiude
+static void resetReader(const char *szReader) {
+	SCARDCONTEXT hContext;
+	SCARDHANDLE hCard;
+	DWORD protocol;
+	SCardEstablishContext(SCARD_SCOPE_SYSTEM, nullptr, nullptr, &hContext);
+	if (SCardConnect(hContext, szReader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &protocol) == SCARD_S_SUCCESS)
+		SCardDisconnect(hCard, SCARD_RESET_CARD);
+	SCardReleaseContext(hContext);
+}
+
+// stesso flusso attraverso PKCS#11 e il PC/SC emulato
+static void testP11() {
+	fprintf(out, "Flusso PKCS#11 su CVirtualPCSC\n");
+	auto card = std::make_shared<CVirtualCIE>();
+	enableCard(*card);
+	CVirtualPCSC::AddReader("BenchCIE 0");
+	CVirtualPCSC::Insert("BenchCIE 0", card);
+
+	CHECK(loadP11() == CKR_OK && p11->C_Initialize(nullptr) == CKR_OK, "C_Initialize");
+	CK_SLOT_ID slots[8];
+	CK_ULONG slotCount = 8;
+	CHECK(p11->C_GetSlotList(TRUE, slots, &slotCount) == CKR_OK && slotCount == 1, "C_GetSlotList con la carta inserita");
+
+	CK_TOKEN_INFO tokenInfo;
+	CHECK(p11->C_GetTokenInfo(slots[0], &tokenInfo) == CKR_OK, "C_GetTokenInfo");
+
+	CK_SESSION_HANDLE hSession;
+	CHECK(p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, nullptr, nullptr, &hSession) == CKR_OK, "C_OpenSession");
+	CK_UTF8CHAR wrongPIN[] = "0000";
+	CHECK(p11->C_Login(hSession, CKU_USER, wrongPIN, 4) == CKR_PIN_INCORRECT, "C_Login con PIN errato");
+	CHECK(p11->C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)szPIN + 4, 4) == CKR_OK, "C_Login");
+
+	CK_OBJECT_HANDLE hKey = findObject(hSession, CKO_PRIVATE_KEY);
+	CK_OBJECT_HANDLE hCert = findObject(hSession, CKO_CERTIFICATE);
+	CHECK(hKey != 0 && hCert != 0, "chiave privata e certificato");
+	CHECK(signAndVerify(hSession, hKey, hCert), "C_Sign verificata con il certificato");
+	CHECK(signAndVerify(hSession, hKey, hCert), "seconda C_Sign sullo stesso canale SM");
+	CHECK(signBatchAndVerify(hSession, hKey, hCert, 3), "C_CIE_SignBatch verificata con il certificato");
+	resetReader("BenchCIE 0");
+	CHECK(signBatchAndVerify(hSession, hKey, hCert, 3), "C_CIE_SignBatch dopo il reset della carta da un'altra applicazione");
+	std::vector<ByteDynArray> infos, signatures;
+	std::vector<CK_RV> results;
+	CHECK(signBatch(hSession, hKey, 3, infos, signatures, results, 1) == CKR_ARGUMENTS_BAD, "C_CIE_SignBatch con un buffer di firma NULL");
+
+	CHECK(p11->C_Logout(hSession) == CKR_OK, "C_Logout");
+	CHECK(p11->C_CloseSession(hSession) == CKR_OK, "C_CloseSession");
+
+	CHECK(p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, nullptr, nullptr, &hSession) == CKR_OK, "C_OpenSession prima dell'estrazione");
+	CVirtualPCSC::Remove("BenchCIE 0");
+	CK_SLOT_ID slotID;
+	CHECK(p11->C_WaitForSlotEvent(0, &slotID, nullptr) == CKR_OK && slotID == slots[0], "C_WaitForSlotEvent all'estrazione");
+	CK_SESSION_INFO sessionInfo;
+	CHECK(p11->C_GetSessionInfo(hSession, &sessionInfo) == CKR_SESSION_HANDLE_INVALID, "sessione chiusa dall'estrazione");
+	slotCount = 8;
+	CHECK(p11->C_GetSlotList(TRUE, slots, &slotCount) == CKR_OK && slotCount == 0, "C_GetSlotList dopo l'estrazione");
+
+	CHECK(p11->C_Finalize(nullptr) == CKR_OK, "C_Finalize");
+	CVirtualPCSC::RemoveReader("BenchCIE 0");
+}
+
+static int runTests(int, char **) {
+	testIAS();
+	testP11();
+	fprintf(out, "%s\n", failures == 0 ? "Tutte le verifiche superate" : "Verifiche fallite");
+	return failures == 0 ? 0 : 1;
+}
+
+// una carta abilitata in ciascuno di n lettori emulati, con il ritardo per APDU indicato
+static std::vector<std::shared_ptr<CVirtualCIE>> insertCards(int n, std::chrono::microseconds latency) {
+	std::vector<std::shared_ptr<CVirtualCIE>> cards;
+	for (int i = 0; i < n; i++) {
+		auto card = std::make_shared<CVirtualCIE>();
+		enableCard(*card);
+		card->Latency = latency;
+		std::string reader = "BenchCIE " + std::to_string(i);
+		CVirtualPCSC::AddReader(reader.c_str());
+		CVirtualPCSC::Insert(reader.c_str(), card);
+		cards.push_back(card);
+	}
+	return cards;
+}
+
+static void removeCards(size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		std::string reader = "BenchCIE " + std::to_string(i);
+		CVirtualPCSC::Remove(reader.c_str());
+		CVirtualPCSC::RemoveReader(reader.c_str());
+	}
+}
+
+// C_Initialize e gli slot con la carta inserita; false se non sono quelli attesi
+static bool initSlots(std::vector<CK_SLOT_ID> &slots, size_t expected) {
+	if (loadP11() != CKR_OK || p11->C_Initialize(nullptr) != CKR_OK)
+		return false;
+	slots.resize(expected);
+	CK_ULONG slotCount = (CK_ULONG)expected;
+	if (p11->C_GetSlotList(TRUE, slots.data(), &slotCount) != CKR_OK || slotCount != expected) {
+		fprintf(out, "attesi %d slot con la carta\n", (int)expected);
+		return false;
+	}
+	return true;
+}
+
+// sessione con login utente e chiave di firma della carta nello slot
+static CK_RV openUserSession(CK_SLOT_ID slot, CK_SESSION_HANDLE &hSession, CK_OBJECT_HANDLE &hKey) {
+	CK_RV rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, nullptr, nullptr, &hSession);
+	if (rv == CKR_OK)
+		rv = p11->C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)szPIN + 4, 4);
+	if (rv == CKR_OK && (hKey = findObject(hSession, CKO_PRIVATE_KEY)) == 0)
+		rv = CKR_KEY_HANDLE_INVALID;
+	return rv;
+}
+
+// firme in parallelo su 1..N lettori, un thread per lettore: le firme al secondo devono
+// crescere con il numero di lettori
+//		BenchCIE slots [lettori] [firme per lettore] [us per APDU]
+static int benchSlots(int argc, char **argv) {
+	int readers = argc > 0 ? atoi(argv[0]) : 4;
+	int signs = argc > 1 ? atoi(argv[1]) : 10;
+	auto cards = insertCards(readers, std::chrono::microseconds(argc > 2 ? atoi(argv[2]) : 20000));
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, readers))
+		return 1;
+
+	std::vector<CK_SESSION_HANDLE> sessions(readers);
+	std::vector<CK_OBJECT_HANDLE> keys(readers);
+	for (int i = 0; i < readers; i++) {
+		if (openUserSession(slots[i], sessions[i], keys[i]) != CKR_OK) {
+			fprintf(out, "login fallito sul lettore %d\n", i);
+			return 1;
+		}
+	}
+
+	for (int n = 1; n <= readers; n++) {
+		std::atomic<int> errors(0);
+		std::vector<std::thread> threads;
+		auto start = Clock::now();
+		for (int i = 0; i < n; i++) {
+			threads.emplace_back([&, i]() {
+				uint8_t data[32] = { 0 };
+				for (int j = 0; j < signs; j++) {
+					ByteDynArray signature;
+					if (sign(sessions[i], keys[i], VarToByteArray(data), signature) != CKR_OK)
+						errors++;
+				}
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+		double ms = elapsedMs(start);
+		fprintf(out, "slots: %d lettori, %.1f firme/s%s\n", n, n * signs * 1000.0 / ms, errors != 0 ? " (con errori)" : "");
+	}
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// digest SHA1 e verifica RSA, calcolati dal middleware senza la carta, da 1..N thread su
+// sessioni proprie mentre sullo stesso lettore e' sempre in corso una firma lenta
+//		BenchCIE software [thread] [ms per la firma sulla carta]
+static int benchSoftware(int argc, char **argv) {
+	int maxThreads = argc > 0 ? atoi(argv[0]) : 4;
+	auto cards = insertCards(1, std::chrono::microseconds(0));
+	cards[0]->InsLatency[0x88] = std::chrono::milliseconds(argc > 1 ? atoi(argv[1]) : 200);
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, 1))
+		return 1;
+
+	CK_SESSION_HANDLE hSignSession;
+	CK_OBJECT_HANDLE hKey;
+	if (openUserSession(slots[0], hSignSession, hKey) != CKR_OK)
+		return 1;
+	CK_OBJECT_HANDLE hPubKey = findObject(hSignSession, CKO_PUBLIC_KEY);
+	ByteDynArray data(4096);
+	data.random();
+	ByteDynArray signature;
+	if (hPubKey == 0 || sign(hSignSession, hKey, data, signature) != CKR_OK) {
+		fprintf(out, "chiave pubblica o firma non disponibili\n");
+		return 1;
+	}
+	ByteDynArray info = digestInfo(data);
+
+	std::atomic<bool> stop(false);
+	std::thread signer([&]() {
+		ByteDynArray sig;
+		while (!stop)
+			sign(hSignSession, hKey, data, sig);
+	});
+
+	std::vector<CK_SESSION_HANDLE> sessions(maxThreads);
+	for (auto &hSession : sessions)
+		p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, nullptr, nullptr, &hSession);
+	for (int n = 1; n <= maxThreads; n++) {
+		std::atomic<int> ops(0), errors(0);
+		std::atomic<bool> done(false);
+		std::vector<std::thread> threads;
+		auto start = Clock::now();
+		for (int i = 0; i < n; i++) {
+			threads.emplace_back([&, i]() {
+				CK_MECHANISM sha1 = { CKM_SHA_1, nullptr, 0 };
+				CK_MECHANISM rsa = { CKM_RSA_PKCS, nullptr, 0 };
+				uint8_t digest[20];
+				while (!done) {
+					CK_ULONG digestLen = sizeof(digest);
+					if (p11->C_DigestInit(sessions[i], &sha1) != CKR_OK ||
+						p11->C_Digest(sessions[i], data.data(), (CK_ULONG)data.size(), digest, &digestLen) != CKR_OK ||
+						p11->C_VerifyInit(sessions[i], &rsa, hPubKey) != CKR_OK ||
+						p11->C_Verify(sessions[i], info.data(), (CK_ULONG)info.size(), signature.data(), (CK_ULONG)signature.size()) != CKR_OK)
+						errors++;
+					ops++;
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		done = true;
+		for (auto &t : threads)
+			t.join();
+		double ms = elapsedMs(start);
+		fprintf(out, "software: %d thread, %.0f digest+verifica/s durante la firma%s\n", n, ops * 1000.0 / ms, errors != 0 ? " (con errori)" : "");
+	}
+	stop = true;
+	signer.join();
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// righe di log al secondo viste dal chiamante, da N thread in parallelo (il log e'
+// abilitato se manca il file INI)
+//		BenchCIE log [thread] [righe per thread]
+static int benchLog(int argc, char **argv) {
+	int threadCount = argc > 0 ? atoi(argv[0]) : 4;
+	int lines = argc > 1 ? atoi(argv[1]) : 20000;
+	std::vector<std::thread> threads;
+	auto start = Clock::now();
+	for (int i = 0; i < threadCount; i++) {
+		threads.emplace_back([lines, i]() {
+			for (int j = 0; j < lines; j++)
+				Log.write("BenchCIE thread %d riga %d", i, j);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	double ms = elapsedMs(start);
+	fprintf(out, "log: %d thread, %.0f righe/s, %.2f us per riga\n", threadCount, threadCount * lines * 1000.0 / ms, ms * 1000 / ((double)threadCount * lines));
+	return 0;
+}
+
+static __attribute__((noinline)) int tracedCall(int i) {
+	init_func
+	return i + 1;
+	exit_func
+}
+
+static __attribute__((noinline)) int plainCall(int i) {
+	return i + 1;
+}
+
+// costo di init_func per chiamata, rispetto ad una funzione senza traccia. La traccia
+// si abilita come in produzione, con LogEnable e FunctionLog nel file INI
+//		BenchCIE trace [chiamate]
+static int benchTrace(int argc, char **argv) {
+	int calls = argc > 0 ? atoi(argv[0]) : 1000000;
+	volatile int sink = 0;
+	auto start = Clock::now();
+	for (int i = 0; i < calls; i++)
+		sink = plainCall(sink);
+	double plainMs = elapsedMs(start);
+	start = Clock::now();
+	for (int i = 0; i < calls; i++)
+		sink = tracedCall(sink);
+	double tracedMs = elapsedMs(start);
+	fprintf(out, "trace: %.1f ns per chiamata con init_func, %.1f ns senza\n", tracedMs * 1e6 / calls, plainMs * 1e6 / calls);
+	return 0;
+}
+
+// apertura di sessione e login su una carta appena abilitata (fredda) e dopo un
+// C_Finalize/C_Initialize, quando la cache su disco dei dati della carta e' gia' scritta
+//		BenchCIE open [us per APDU]
+static int benchOpen(int argc, char **argv) {
+	auto cards = insertCards(1, std::chrono::microseconds(argc > 0 ? atoi(argv[0]) : 1000));
+	for (const char *round : { "fredda", "calda " }) {
+		std::vector<CK_SLOT_ID> slots;
+		if (!initSlots(slots, 1))
+			return 1;
+		cards[0]->APDUCount = 0;
+		auto start = Clock::now();
+		CK_SESSION_HANDLE hSession;
+		if (p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, nullptr, nullptr, &hSession) != CKR_OK ||
+			p11->C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)szPIN + 4, 4) != CKR_OK) {
+			fprintf(out, "login fallito\n");
+			return 1;
+		}
+		double ms = elapsedMs(start);
+		fprintf(out, "open: carta %s, C_OpenSession+C_Login %.2f ms, %u APDU\n", round, ms, (unsigned)cards[0]->APDUCount);
+		p11->C_Logout(hSession);
+		p11->C_CloseSession(hSession);
+		p11->C_Finalize(nullptr);
+	}
+	removeCards(cards.size());
+	return 0;
+}
+
+// latenza di C_Login ripetuti, con una pausa fra l'uno e l'altro come fra due firme
+// dell'utente (i calcoli in background hanno il tempo di completarsi)
+//		BenchCIE login [login] [pausa in ms] [us per APDU]
+static int benchLogin(int argc, char **argv) {
+	int logins = argc > 0 ? atoi(argv[0]) : 10;
+	auto pause = std::chrono::milliseconds(argc > 1 ? atoi(argv[1]) : 200);
+	auto cards = insertCards(1, std::chrono::microseconds(argc > 2 ? atoi(argv[2]) : 0));
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, 1))
+		return 1;
+	CK_SESSION_HANDLE hSession;
+	p11->C_OpenSession(slots[0], CKF_SERIAL_SESSION, nullptr, nullptr, &hSession);
+
+	double loginMs = 0, maxMs = 0;
+	for (int i = 0; i < logins; i++) {
+		std::this_thread::sleep_for(pause);
+		auto start = Clock::now();
+		if (p11->C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)szPIN + 4, 4) != CKR_OK) {
+			fprintf(out, "C_Login fallita\n");
+			return 1;
+		}
+		double ms = elapsedMs(start);
+		loginMs += ms;
+		maxMs = std::max(maxMs, ms);
+		p11->C_Logout(hSession);
+	}
+	fprintf(out, "login: %.2f ms in media, %.2f ms al massimo\n", loginMs / logins, maxMs);
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// autenticazioni ripetute direttamente su IAS, con reset della carta tra l'una e l'altra:
+// tempo e APDU di InitExtAuthKeyParam + DAPP
+//		BenchCIE dapp [autenticazioni]
+static int benchDapp(int argc, char **argv) {
+	int runs = argc > 0 ? atoi(argv[0]) : 20;
+	CVirtualCIE card;
+	IAS ias((CToken::TokenTransmitCallback)CVirtualCIE::TransmitCallback, card.ATR);
+	ias.SetCardContext(&card);
+	ias.token.Reset();
+	ias.SelectAID_IAS();
+	ias.ReadPAN();
+
+	double dappMs = 0, firstMs = 0;
+	DWORD apdus = 0;
+	for (int i = 0; i < runs; i++) {
+		// reset della carta: la DAPP si ripete su un nuovo canale
+		ias.token.Reset();
+		ias.ActiveSM = false;
+		ias.SelectAID_IAS();
+		ias.SelectAID_CIE();
+		ias.InitDHParam();
+		ByteDynArray dappKey;
+		ias.ReadDappPubKey(dappKey);
+		card.APDUCount = 0;
+		auto start = Clock::now();
+		ias.InitExtAuthKeyParam();
+		double ms = elapsedMs(start);
+		DWORD count = card.APDUCount;
+		ias.DHKeyExchange();
+		card.APDUCount = 0;
+		start = Clock::now();
+		ias.DAPP();
+		ms += elapsedMs(start);
+		count += card.APDUCount;
+		if (i == 0)
+			firstMs = ms;
+		else {
+			dappMs += ms;
+			apdus += count;
+		}
+	}
+	fprintf(out, "dapp: prima %.2f ms, poi %.2f ms e %.1f APDU per autenticazione\n", firstMs, dappMs / (runs - 1), (double)apdus / (runs - 1));
+	return 0;
+}
+
+static ByteDynArray bnBytes(const BIGNUM *bn) {
+	ByteDynArray ba(BN_num_bytes(bn));
+	BN_bn2bin(bn, ba.data());
+	return ba;
+}
+
+// operazione privata con la chiave completa, se CRSA ha il costruttore per il CRT
+template <typename R>
+static double crtPrivOp(RSA *key, ByteArray &data, ByteDynArray &result, int ops, std::true_type) {
+	ByteDynArray n = bnBytes(key->n), e = bnBytes(key->e), d = bnBytes(key->d), p = bnBytes(key->p), q = bnBytes(key->q),
+		dP = bnBytes(key->dmp1), dQ = bnBytes(key->dmq1), qInv = bnBytes(key->iqmp);
+	auto start = Clock::now();
+	for (int i = 0; i < ops; i++)
+		result = R(n, e, d, p, q, dP, dQ, qInv).RSA_PURE(data);
+	return elapsedMs(start) / ops;
+}
+
+template <typename R>
+static double crtPrivOp(RSA *, ByteArray &, ByteDynArray &, int, std::false_type) {
+	return -1;
+}
+
+// operazione privata RSA sull'host, come in DAPP: solo esponente privato e chiave completa
+//		BenchCIE rsa [operazioni] [bit]
+static int benchRSA(int argc, char **argv) {
+	int ops = argc > 0 ? atoi(argv[0]) : 50;
+	int bits = argc > 1 ? atoi(argv[1]) : 2048;
+	RSA *key = RSA_new();
+	BIGNUM *f4 = BN_new();
+	BN_set_word(f4, RSA_F4);
+	RSA_generate_key_ex(key, bits, f4, nullptr);
+	BN_free(f4);
+
+	ByteDynArray n = bnBytes(key->n), d = bnBytes(key->d);
+	ByteDynArray data(n.size());
+	data.fill(0x5a);
+	data[0] = 0;
+
+	ByteDynArray plain, crt;
+	auto start = Clock::now();
+	for (int i = 0; i < ops; i++)
+		plain = CRSA(n, d).RSA_PURE(data);
+	double plainMs = elapsedMs(start) / ops;
+
+	typedef std::is_constructible<CRSA, ByteArray&, ByteArray&, ByteArray&, ByteArray&, ByteArray&, ByteArray&, ByteArray&, ByteArray&> hasCRT;
+	double crtMs = crtPrivOp<CRSA>(key, data, crt, ops, hasCRT());
+	RSA_free(key);
+
+	fprintf(out, "rsa %d: solo esponente %.2f ms", bits, plainMs);
+	if (crtMs < 0)
+		fprintf(out, ", CRT non disponibile\n");
+	else {
+		fprintf(out, ", CRT %.2f ms\n", crtMs);
+		if (crt != plain) {
+			fprintf(out, "risultati diversi\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// esponenziazioni ripetute con lo stesso modulo, come quelle di DH, DAPP e verifica del SOD:
+// costruzione di CRSA e RSA_PURE, con l'esponente pubblico e con uno da 256 bit come in DH,
+// anche da piu' thread sullo stesso modulo
+//		BenchCIE modexp [operazioni] [thread]
+static int benchModExp(int argc, char **argv) {
+	int ops = argc > 0 ? atoi(argv[0]) : 200;
+	int threads = argc > 1 ? atoi(argv[1]) : 1;
+	for (int bits : { 1024, 2048 }) {
+		RSA *key = RSA_new();
+		BIGNUM *f4 = BN_new();
+		BN_set_word(f4, RSA_F4);
+		RSA_generate_key_ex(key, bits, f4, nullptr);
+		BN_free(f4);
+		ByteDynArray n = bnBytes(key->n), e = bnBytes(key->e);
+		RSA_free(key);
+		ByteDynArray x(32);
+		x.fill(0xa5);
+		ByteDynArray data(n.size());
+		data.fill(0x5a);
+		data[0] = 0;
+
+		for (ByteDynArray *exp : { &e, &x }) {
+			ByteDynArray expected = CRSA(n, *exp).RSA_PURE(data);
+			std::atomic<int> wrong(0);
+			std::vector<std::thread> workers;
+			auto start = Clock::now();
+			for (int t = 0; t < threads; t++) {
+				workers.emplace_back([&]() {
+					for (int i = 0; i < ops; i++) {
+						if (CRSA(n, *exp).RSA_PURE(data) != expected)
+							wrong++;
+					}
+				});
+			}
+			for (auto &w : workers)
+				w.join();
+			double us = elapsedMs(start) * 1000 / ((double)ops * threads);
+			fprintf(out, "modexp %d, esponente %d bit: %.1f us per operazione\n", bits, exp == &e ? 17 : 256, us);
+			if (wrong != 0) {
+				fprintf(out, "%d risultati errati\n", (int)wrong);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// letture ripetute del certificato sul canale SM aperto con DH e DAPP, senza ritardi: ogni
+// APDU costa la cifratura e il MAC del comando e la verifica e decifratura della risposta,
+// sia nel middleware che nella carta emulata
+//		BenchCIE sm [letture]
+static int benchSM(int argc, char **argv) {
+	int reads = argc > 0 ? atoi(argv[0]) : 200;
+	CVirtualCIE card;
+	IAS ias((CToken::TokenTransmitCallback)CVirtualCIE::TransmitCallback, card.ATR);
+	ias.SetCardContext(&card);
+	ias.token.Reset();
+	ias.SelectAID_IAS();
+	ias.ReadPAN();
+	ias.SelectAID_CIE();
+	ias.InitDHParam();
+	ByteDynArray dappKey;
+	ias.ReadDappPubKey(dappKey);
+	ias.InitExtAuthKeyParam();
+	ias.DHKeyExchange();
+	ias.DAPP();
+
+	ByteDynArray cert;
+	card.APDUCount = 0;
+	auto start = Clock::now();
+	for (int i = 0; i < reads; i++) {
+		cert.clear();
+		ias.ReadCertCIE(cert);
+	}
+	double ms = elapsedMs(start);
+	if (cert != card.Files[0x1003]) {
+		fprintf(out, "certificato letto in SM diverso da quello della carta\n");
+		return 1;
+	}
+	fprintf(out, "sm: %.0f APDU/s, %.0f KB/s (%u byte in %.1f APDU per lettura)\n", card.APDUCount * 1000 / ms,
+		(double)cert.size() * reads / ms * 1000 / 1024, (unsigned)cert.size(), (double)card.APDUCount / reads);
+	return 0;
+}
+
+// MAC retail su messaggi delle dimensioni di un'APDU, di una risposta estesa e di un blocco
+// del SOD, con la stessa istanza di CMAC come nel contesto SM
+//		BenchCIE mac [MB per dimensione]
+static int benchMac(int argc, char **argv) {
+	double mb = argc > 0 ? atof(argv[0]) : 16;
+	ByteDynArray key(16), iv(8);
+	key.fill(0x3c);
+	iv.fill(0);
+	CMAC mac(key, iv);
+	for (size_t size : { 16, 256, 4096, 65536 }) {
+		ByteDynArray data(size);
+		data.fill(0x5a);
+		size_t count = std::max<size_t>(1, (size_t)(mb * 1024 * 1024 / size));
+		auto start = Clock::now();
+		for (size_t i = 0; i < count; i++)
+			mac.Mac(data);
+		double ms = elapsedMs(start);
+		fprintf(out, "mac %5u byte: %.0f MB/s, %.2f us per MAC\n", (unsigned)size, (double)size * count / ms * 1000 / (1024 * 1024), ms * 1000 / count);
+	}
+	return 0;
+}
+
+// APDU inviate alla carta per operazione: le letture di IAS ripetute due volte di seguito
+// (la seconda trova la carta gia' sul DF giusto) e login e firme via PKCS#11
+//		BenchCIE apdu [firme]
+static int benchApdu(int argc, char **argv) {
+	int signs = argc > 0 ? atoi(argv[0]) : 10;
+	{
+		CVirtualCIE card;
+		IAS ias((CToken::TokenTransmitCallback)CVirtualCIE::TransmitCallback, card.ATR);
+		ias.SetCardContext(&card);
+		ias.token.Reset();
+		ias.SelectAID_IAS();
+		ByteDynArray data;
+		std::pair<const char *, std::function<void()>> ops[] = {
+			{ "ReadPAN", [&]() { ias.ReadPAN(); } },
+			{ "ReadCertCIE", [&]() { data.clear(); ias.ReadCertCIE(data); } },
+			{ "InitEncKey", [&]() { ias.InitEncKey(); } },
+		};
+		for (auto &op : ops) {
+			DWORD count[2];
+			for (int i = 0; i < 2; i++) {
+				card.APDUCount = 0;
+				op.second();
+				count[i] = card.APDUCount;
+			}
+			fprintf(out, "apdu %-12s %u, poi %u\n", op.first, (unsigned)count[0], (unsigned)count[1]);
+		}
+	}
+
+	auto cards = insertCards(1, std::chrono::microseconds(0));
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, 1))
+		return 1;
+	CK_SESSION_HANDLE hSession;
+	CK_OBJECT_HANDLE hKey;
+	cards[0]->APDUCount = 0;
+	if (openUserSession(slots[0], hSession, hKey) != CKR_OK) {
+		fprintf(out, "C_Login fallita\n");
+		return 1;
+	}
+	DWORD loginCount = cards[0]->APDUCount;
+	DWORD signCount[2] = { 0, 0 };
+	for (int i = 0; i < signs; i++) {
+		uint8_t data[32] = { 0 };
+		ByteDynArray signature;
+		cards[0]->APDUCount = 0;
+		if (sign(hSession, hKey, VarToByteArray(data), signature) != CKR_OK) {
+			fprintf(out, "C_Sign fallita\n");
+			return 1;
+		}
+		signCount[i == 0 ? 0 : 1] += cards[0]->APDUCount;
+	}
+	fprintf(out, "apdu %-12s %u\n", "C_Login", (unsigned)loginCount);
+	fprintf(out, "apdu %-12s %u, poi %.1f\n", "C_Sign", (unsigned)signCount[0], signs > 1 ? (double)signCount[1] / (signs - 1) : 0.0);
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// N firme con C_Sign una per una e con un solo C_CIE_SignBatch, sullo stesso canale SM
+//		BenchCIE batch [firme] [us per APDU]
+static int benchBatch(int argc, char **argv) {
+	int signs = argc > 0 ? atoi(argv[0]) : 20;
+	auto cards = insertCards(1, std::chrono::microseconds(argc > 1 ? atoi(argv[1]) : 5000));
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, 1))
+		return 1;
+	CK_SESSION_HANDLE hSession;
+	CK_OBJECT_HANDLE hKey;
+	if (openUserSession(slots[0], hSession, hKey) != CKR_OK) {
+		fprintf(out, "C_Login fallita\n");
+		return 1;
+	}
+
+	cards[0]->APDUCount = 0;
+	auto start = Clock::now();
+	for (int i = 0; i < signs; i++) {
+		uint8_t data[4] = { 'C', 'I', 'E', (uint8_t)i };
+		ByteDynArray signature;
+		if (sign(hSession, hKey, VarToByteArray(data), signature) != CKR_OK) {
+			fprintf(out, "C_Sign fallita\n");
+			return 1;
+		}
+	}
+	double signMs = elapsedMs(start);
+	DWORD signApdus = cards[0]->APDUCount;
+
+	std::vector<ByteDynArray> infos, signatures;
+	std::vector<CK_RV> results;
+	cards[0]->APDUCount = 0;
+	start = Clock::now();
+	CK_RV rv = signBatch(hSession, hKey, signs, infos, signatures, results);
+	double batchMs = elapsedMs(start);
+	if (rv != CKR_OK || std::count(results.begin(), results.end(), CKR_OK) != signs) {
+		fprintf(out, "C_CIE_SignBatch fallita\n");
+		return 1;
+	}
+	fprintf(out, "batch %d firme: C_Sign %.1f ms e %u APDU, C_CIE_SignBatch %.1f ms e %u APDU\n", signs,
+		signMs, (unsigned)signApdus, batchMs, (unsigned)cards[0]->APDUCount);
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// estrazione della carta mentre una firma lunga e' in corso sullo stesso slot, e reinserimento:
+// tempo fino al ritorno di C_WaitForSlotEvent
+//		BenchCIE event [eventi] [ms firma]
+static int benchEvent(int argc, char **argv) {
+	int events = argc > 0 ? atoi(argv[0]) : 5;
+	auto signLatency = std::chrono::milliseconds(argc > 1 ? atoi(argv[1]) : 500);
+	auto cards = insertCards(1, std::chrono::microseconds(0));
+	cards[0]->InsLatency[0x88] = signLatency;
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, 1))
+		return 1;
+
+	double removeMs = 0, insertMs = 0, maxRemoveMs = 0;
+	for (int i = 0; i < events; i++) {
+		CK_SESSION_HANDLE hSession;
+		CK_OBJECT_HANDLE hKey;
+		if (openUserSession(slots[0], hSession, hKey) != CKR_OK) {
+			fprintf(out, "C_Login fallita\n");
+			return 1;
+		}
+		// l'esito della firma non conta: la carta sparisce mentre la calcola
+		std::thread signer([&]() {
+			uint8_t data[32] = { 0 };
+			ByteDynArray signature;
+			sign(hSession, hKey, VarToByteArray(data), signature);
+		});
+		std::this_thread::sleep_for(signLatency / 5);
+
+		CK_SLOT_ID slotID;
+		auto start = Clock::now();
+		CVirtualPCSC::Remove("BenchCIE 0");
+		if (p11->C_WaitForSlotEvent(0, &slotID, nullptr) != CKR_OK || slotID != slots[0]) {
+			fprintf(out, "evento di estrazione non ricevuto\n");
+			return 1;
+		}
+		double ms = elapsedMs(start);
+		removeMs += ms;
+		maxRemoveMs = std::max(maxRemoveMs, ms);
+		signer.join();
+
+		start = Clock::now();
+		CVirtualPCSC::Insert("BenchCIE 0", cards[0]);
+		if (p11->C_WaitForSlotEvent(0, &slotID, nullptr) != CKR_OK || slotID != slots[0]) {
+			fprintf(out, "evento di inserimento non ricevuto\n");
+			return 1;
+		}
+		insertMs += elapsedMs(start);
+	}
+	fprintf(out, "event: estrazione durante una firma %.1f ms (max %.1f), inserimento %.1f ms\n",
+		removeMs / events, maxRemoveMs, insertMs / events);
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// scansione degli slot con carte CIE e carte di altro tipo lasciate nei lettori: ad ogni
+// giro C_Initialize, C_GetTokenInfo su ogni slot con carta e C_Finalize. Dal secondo giro
+// le carte non CIE devono essere scartate senza APDU. Con ATR Gemalto a 1 le altre carte
+// hanno l'ATR di una CIE e sono scartate solo dopo la SELECT
+//		BenchCIE scan [CIE] [altre carte] [giri] [us per APDU] [us per chiamata SCard] [ATR Gemalto]
+static int benchScan(int argc, char **argv) {
+	int cieCards = argc > 0 ? atoi(argv[0]) : 2;
+	int foreignCards = argc > 1 ? atoi(argv[1]) : 4;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	auto latency = std::chrono::microseconds(argc > 3 ? atoi(argv[3]) : 2000);
+	CVirtualPCSC::CallLatency = std::chrono::microseconds(argc > 4 ? atoi(argv[4]) : 50);
+	bool gemaltoATR = argc > 5 && atoi(argv[5]) != 0;
+	auto cards = insertCards(cieCards, latency);
+	// ATR di una carta di pagamento EMV
+	uint8_t bankATR[] = { 0x3b, 0x6e, 0x00, 0x00, 0x80, 0x31, 0x80, 0x66, 0xb0, 0x84, 0x12, 0x01, 0x6e, 0x01, 0x83, 0x00, 0x90, 0x00 };
+	for (int i = 0; i < foreignCards; i++) {
+		auto card = std::make_shared<CVirtualCIE>();
+		card->Foreign = true;
+		if (!gemaltoATR)
+			card->ATR = VarToByteArray(bankATR);
+		card->Latency = latency;
+		std::string reader = "BenchCIE " + std::to_string(cieCards + i);
+		CVirtualPCSC::AddReader(reader.c_str());
+		CVirtualPCSC::Insert(reader.c_str(), card);
+		cards.push_back(card);
+	}
+
+	double restMs = 0;
+	DWORD restCIE = 0, restForeign = 0, restCalls = 0;
+	for (int round = 0; round < rounds; round++) {
+		for (auto &card : cards)
+			card->APDUCount = 0;
+		CVirtualPCSC::ResetCounters();
+		auto start = Clock::now();
+		std::vector<CK_SLOT_ID> slots;
+		if (!initSlots(slots, cards.size()))
+			return 1;
+		int recognized = 0;
+		for (auto slot : slots) {
+			CK_TOKEN_INFO info;
+			CK_RV rv = p11->C_GetTokenInfo(slot, &info);
+			if (rv == CKR_OK)
+				recognized++;
+			else if (rv != CKR_TOKEN_NOT_RECOGNIZED) {
+				fprintf(out, "C_GetTokenInfo: %08lx\n", (unsigned long)rv);
+				return 1;
+			}
+		}
+		double ms = elapsedMs(start);
+		DWORD calls = CVirtualPCSC::CallCount;
+		p11->C_Finalize(nullptr);
+		if (recognized != cieCards) {
+			fprintf(out, "riconosciute %d carte CIE su %d\n", recognized, cieCards);
+			return 1;
+		}
+		DWORD apduCIE = 0, apduForeign = 0;
+		for (int i = 0; i < (int)cards.size(); i++)
+			(i < cieCards ? apduCIE : apduForeign) += cards[i]->APDUCount;
+		if (round == 0)
+			fprintf(out, "scan primo giro: %.1f ms, %u chiamate SCard, APDU %u alle CIE e %u alle altre carte\n", ms, calls, apduCIE, apduForeign);
+		else {
+			restMs += ms;
+			restCIE += apduCIE;
+			restForeign += apduForeign;
+			restCalls += calls;
+		}
+	}
+	if (rounds > 1)
+		fprintf(out, "scan giri successivi: %.1f ms, %.1f chiamate SCard, APDU %.1f alle CIE e %.1f alle altre carte\n", restMs / (rounds - 1),
+			(double)restCalls / (rounds - 1), (double)restCIE / (rounds - 1), (double)restForeign / (rounds - 1));
+	removeCards(cards.size());
+	CVirtualPCSC::CallLatency = std::chrono::microseconds(0);
+	return 0;
+}
+
+// C_GetTokenInfo al secondo su piu' lettori, con molte sessioni aperte (meta' RW) in ogni slot
+//		BenchCIE tokeninfo [lettori] [sessioni per lettore] [chiamate]
+static int benchTokenInfo(int argc, char **argv) {
+	int readers = argc > 0 ? atoi(argv[0]) : 4;
+	int sessions = argc > 1 ? atoi(argv[1]) : 64;
+	int calls = argc > 2 ? atoi(argv[2]) : 20000;
+	auto cards = insertCards(readers, std::chrono::microseconds(0));
+	std::vector<CK_SLOT_ID> slots;
+	if (!initSlots(slots, readers))
+		return 1;
+
+	for (int open = 0; open <= sessions; open = open == 0 ? 1 : open * 4) {
+		for (int i = 0; i < readers; i++) {
+			p11->C_CloseAllSessions(slots[i]);
+			for (int j = 0; j < open; j++) {
+				CK_SESSION_HANDLE hSession;
+				CK_FLAGS flags = CKF_SERIAL_SESSION | (j % 2 ? CKF_RW_SESSION : 0);
+				if (p11->C_OpenSession(slots[i], flags, nullptr, nullptr, &hSession) != CKR_OK) {
+					fprintf(out, "C_OpenSession fallita\n");
+					return 1;
+				}
+			}
+		}
+
+		auto start = Clock::now();
+		for (int i = 0; i < calls; i++) {
+			CK_TOKEN_INFO info;
+			if (p11->C_GetTokenInfo(slots[i % readers], &info) != CKR_OK ||
+				info.ulSessionCount != (CK_ULONG)open || info.ulRwSessionCount != (CK_ULONG)(open / 2)) {
+				fprintf(out, "C_GetTokenInfo fallita o contatori errati\n");
+				return 1;
+			}
+		}
+		fprintf(out, "tokeninfo %d lettori, %4d sessioni per lettore: %.0f chiamate/s\n", readers, open, calls * 1000 / elapsedMs(start));
+	}
+
+	p11->C_Finalize(nullptr);
+	removeCards(cards.size());
+	return 0;
+}
+
+// C_GetSlotList(TRUE) e C_GetSlotInfo al secondo con 1..N lettori, ognuno con una carta;
+// ogni chiamata SCard* costa la IPC simulata verso il demone PC/SC
+//		BenchCIE slotlist [lettori] [chiamate] [us per chiamata SCard]
+static int benchSlotList(int argc, char **argv) {
+	int maxReaders = argc > 0 ? atoi(argv[0]) : 16;
+	int calls = argc > 1 ? atoi(argv[1]) : 2000;
+	CVirtualPCSC::CallLatency = std::chrono::microseconds(argc > 2 ? atoi(argv[2]) : 50);
+	for (int readers = 1; readers <= maxReaders; readers *= 2) {
+		auto cards = insertCards(readers, std::chrono::microseconds(0));
+		std::vector<CK_SLOT_ID> slots;
+		if (!initSlots(slots, readers))
+			return 1;
+
+		CVirtualPCSC::ResetCounters();
+		auto start = Clock::now();
+		for (int i = 0; i < calls; i++) {
+			CK_ULONG count = (CK_ULONG)slots.size();
+			if (p11->C_GetSlotList(TRUE, slots.data(), &count) != CKR_OK || count != (CK_ULONG)readers) {
+				fprintf(out, "C_GetSlotList fallita\n");
+				return 1;
+			}
+		}
+		double listMs = elapsedMs(start);
+		DWORD listCalls = CVirtualPCSC::CallCount;
+
+		CVirtualPCSC::ResetCounters();
+		start = Clock::now();
+		for (int i = 0; i < calls; i++) {
+			CK_SLOT_INFO info;
+			if (p11->C_GetSlotInfo(slots[i % slots.size()], &info) != CKR_OK || (info.flags & CKF_TOKEN_PRESENT) == 0) {
+				fprintf(out, "C_GetSlotInfo fallita\n");
+				return 1;
+			}
+		}
+		double infoMs = elapsedMs(start);
+		fprintf(out, "slotlist %2d lettori: C_GetSlotList %.0f/s (%.1f SCard per chiamata), C_GetSlotInfo %.0f/s (%.1f SCard per chiamata)\n", readers,
+			calls * 1000 / listMs, (double)listCalls / calls, calls * 1000 / infoMs, (double)CVirtualPCSC::CallCount / calls);
+
+		p11->C_Finalize(nullptr);
+		removeCards(cards.size());
+	}
+	CVirtualPCSC::CallLatency = std::chrono::microseconds(0);
+	return 0;
+}
+
+// login e firma ripetuti su una carta con ritardo per APDU configurabile
+//		BenchCIE flow [iterazioni] [ritardo APDU in us]
+static int benchFlow(int argc, char **argv) {
+	int iterations = argc > 0 ? atoi(argv[0]) : 10;
+	auto card = std::make_shared<CVirtualCIE>();
+	card->Latency = std::chrono::microseconds(argc > 1 ? atoi(argv[1]) : 0);
+	enableCard(*card);
+	CVirtualPCSC::AddReader("BenchCIE 0");
+	CVirtualPCSC::Insert("BenchCIE 0", card);
+
+	loadP11();
+	p11->C_Initialize(nullptr);
+	CK_SLOT_ID slot;
+	CK_ULONG slotCount = 1;
+	p11->C_GetSlotList(TRUE, &slot, &slotCount);
+
+	double loginMs = 0, signMs = 0;
+	card->APDUCount = 0;
+	for (int i = 0; i < iterations; i++) {
+		CK_SESSION_HANDLE hSession;
+		p11->C_OpenSession(slot, CKF_SERIAL_SESSION, nullptr, nullptr, &hSession);
+		auto start = Clock::now();
+		if (p11->C_Login(hSession, CKU_USER, (CK_UTF8CHAR_PTR)szPIN + 4, 4) != CKR_OK) {
+			fprintf(out, "C_Login fallita\n");
+			return 1;
+		}
+		loginMs += elapsedMs(start);
+		CK_OBJECT_HANDLE hKey = findObject(hSession, CKO_PRIVATE_KEY);
+		uint8_t data[32] = { 0 };
+		ByteDynArray signature;
+		start = Clock::now();
+		if (sign(hSession, hKey, VarToByteArray(data), signature) != CKR_OK) {
+			fprintf(out, "C_Sign fallita\n");
+			return 1;
+		}
+		signMs += elapsedMs(start);
+		p11->C_Logout(hSession);
+		p11->C_CloseSession(hSession);
+	}
+	fprintf(out, "flow: login %.2f ms, firma %.2f ms, %.1f APDU per ciclo\n", loginMs / iterations, signMs / iterations, (double)card->APDUCount / iterations);
+	p11->C_Finalize(nullptr);
+	return 0;
+}
+
+struct Scenario {
+	const char *name;
+	const char *desc;
+	std::function<int(int, char **)> run;
+};
+
+static Scenario scenarios[] = {
+	{ "test", "verifica il flusso IAS e PKCS#11", runTests },
+	{ "flow", "[iterazioni] [us per APDU]: latenza di login e firma", benchFlow },
+	{ "slots", "[lettori] [firme] [us per APDU]: firme/s con piu' lettori in parallelo", benchSlots },
+	{ "software", "[thread] [ms firma]: digest e verifiche/s durante una firma", benchSoftware },
+	{ "log", "[thread] [righe]: righe di log al secondo", benchLog },
+	{ "trace", "[chiamate]: costo di init_func per chiamata", benchTrace },
+	{ "open", "[us per APDU]: sessione e login a freddo e con la cache della carta", benchOpen },
+	{ "login", "[login] [pausa ms] [us per APDU]: latenza di C_Login", benchLogin },
+	{ "dapp", "[autenticazioni]: InitExtAuthKeyParam e DAPP ripetute", benchDapp },
+	{ "rsa", "[operazioni] [bit]: operazione privata RSA sull'host", benchRSA },
+	{ "modexp", "[operazioni] [thread]: esponenziazioni con lo stesso modulo", benchModExp },
+	{ "sm", "[letture]: APDU/s in Secure Messaging", benchSM },
+	{ "mac", "[MB per dimensione]: MAC retail al secondo", benchMac },
+	{ "apdu", "[firme]: APDU per operazione", benchApdu },
+	{ "batch", "[firme] [us per APDU]: C_Sign ripetute e C_CIE_SignBatch", benchBatch },
+	{ "event", "[eventi] [ms firma]: C_WaitForSlotEvent con una firma in corso", benchEvent },
+	{ "scan", "[CIE] [altre carte] [giri] [us per APDU] [us per chiamata SCard] [ATR Gemalto]: scansione degli slot con carte di altro tipo", benchScan },
+	{ "tokeninfo", "[lettori] [sessioni per lettore] [chiamate]: C_GetTokenInfo al secondo con molte sessioni aperte", benchTokenInfo },
+	{ "slotlist", "[lettori] [chiamate] [us per chiamata SCard]: C_GetSlotList e C_GetSlotInfo al secondo", benchSlotList },
+};
+
+int main(int argc, char **argv) {
+	char home[] = "/tmp/BenchCIE.XXXXXX";
+	if (mkdtemp(home) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		argc--;
+		argv++;
+	}
+	else {
+		out = fdopen(dup(STDOUT_FILENO), "w");
+		setvbuf(out, nullptr, _IOLBF, 0);
+		freopen("/dev/null", "w", stdout);
+	}
+
+	int ris = 2;
+	if (argc > 1) {
+		for (auto &s : scenarios) {
+			if (strcmp(s.name, argv[1]) == 0) {
+				ris = s.run(argc - 2, argv + 2);
+				break;
+			}
+		}
+	}
+	if (ris == 2) {
+		fprintf(out, "uso: BenchCIE [-v] <scenario> [parametri]\n");
+		for (auto &s : scenarios)
+			fprintf(out, "  %-12s %s\n", s.name, s.desc);
+	}
+
+	std::string cleanup = std::string("rm -rf ") + home;
+	system(cleanup.c_str());
+	return ris;
+}
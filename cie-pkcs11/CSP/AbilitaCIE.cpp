@@ -40,22 +40,20 @@ extern "C" {
 
 CK_RV CK_ENTRY VerificaCIEAbilitata()
 {
-    DWORD len = MAX_PATH;
-    
     SCARDCONTEXT hSC;
     
-    long nRet = SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &hSC);
+    long nRet = CSharedCardContext::get(hSC);
     if(nRet != SCARD_S_SUCCESS)
         return CKR_DEVICE_ERROR;
     
-    char readers[MAX_PATH];
-    
-    if (SCardListReaders(hSC, nullptr, (char*)&readers, &len) != SCARD_S_SUCCESS) {
+    std::string readers;
+
+    if (CSharedCardContext::listReaders(hSC, readers) != SCARD_S_SUCCESS) {
         return CKR_TOKEN_NOT_PRESENT;
     }
     
-    char *curreader = readers;
-    for (; curreader[0] != 0; curreader += strnlen(curreader, len) + 1)
+    const char *curreader = readers.c_str();
+    for (; curreader[0] != 0; curreader += strnlen(curreader, readers.size()) + 1)
     {
         try
         {
@@ -91,22 +89,20 @@ CK_RV CK_ENTRY VerificaCIEAbilitata()
 
 CK_RV CK_ENTRY DisabilitaCIE()
 {
-    DWORD len = MAX_PATH;
-    
     SCARDCONTEXT hSC;
     
-    long nRet = SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &hSC);
+    long nRet = CSharedCardContext::get(hSC);
     if(nRet != SCARD_S_SUCCESS)
         return CKR_DEVICE_ERROR;
     
-    char readers[MAX_PATH];
-    
-    if (SCardListReaders(hSC, nullptr, (char*)&readers, &len) != SCARD_S_SUCCESS) {
+    std::string readers;
+
+    if (CSharedCardContext::listReaders(hSC, readers) != SCARD_S_SUCCESS) {
         return CKR_TOKEN_NOT_PRESENT;
     }
     
-    char *curreader = readers;
-    for (; curreader[0] != 0; curreader += strnlen(curreader, len) + 1)
+    const char *curreader = readers.c_str();
+    for (; curreader[0] != 0; curreader += strnlen(curreader, readers.size()) + 1)
     {
         try
         {
@@ -151,7 +147,6 @@ CK_RV CK_ENTRY AbilitaCIE(const char*  szPAN, const char*  szPIN, int* attempts,
 		CSHA256 sha256;
 		std::map<uint8_t, ByteDynArray> hashSet;
 		
-		DWORD len = MAX_PATH;
 		ByteDynArray CertCIE;
 		ByteDynArray SOD;
 		ByteDynArray IdServizi;
@@ -160,21 +155,21 @@ CK_RV CK_ENTRY AbilitaCIE(const char*  szPAN, const char*  szPIN, int* attempts,
 
         progressCallBack(1, "Connessione alla CIE");
         
-		long nRet = SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &hSC);
+		long nRet = CSharedCardContext::get(hSC);
         if(nRet != SCARD_S_SUCCESS)
             return CKR_DEVICE_ERROR;
         
-		char readers[MAX_PATH];
-        
-		if (SCardListReaders(hSC, nullptr, (char*)&readers, &len) != SCARD_S_SUCCESS) {
+		std::string readers;
+
+		if (CSharedCardContext::listReaders(hSC, readers) != SCARD_S_SUCCESS) {
             return CKR_TOKEN_NOT_PRESENT;
 		}
 
         progressCallBack(5, "Connessione all CIE eseguita");
         
-		char *curreader = readers;
+		const char *curreader = readers.c_str();
 		bool foundCIE = false;
-		for (; curreader[0] != 0; curreader += strnlen(curreader, len) + 1)
+		for (; curreader[0] != 0; curreader += strnlen(curreader, readers.size()) + 1)
         {
             safeConnection conn(hSC, curreader, SCARD_SHARE_SHARED);
             if (!conn.hCard)
@@ -279,6 +274,14 @@ CK_RV CK_ENTRY AbilitaCIE(const char*  szPAN, const char*  szPIN, int* attempts,
             progressCallBack(85, "Menorizzazione in cache");
             
             ias.SetCache((char*)IdServizi.data(), CertCIE, pinBa);
+            
+            // l'EF.SOD e' appena stato verificato: salvo i dati della carta per le sessioni PKCS#11
+            try {
+                ias.StoreCardData(SOD);
+            }
+            catch (std::exception &ex) {
+                OutputDebugString(ex.what());
+            }
 		}
         
 		if (!foundCIE) {
@@ -7,6 +7,7 @@
 #include "../Crypto/SHA1.h"
 #include "../Crypto/DES3.h"
 #include "../Crypto/MAC.h"
+#include "../Crypto/DHKeyPool.h"
 #include "../Util/ModuleInfo.h"
 
 #include "../Cryptopp/cryptlib.h"
@@ -23,6 +24,13 @@
 #define CIE_PUK_ID 0x82
 #define CIE_KEY_Sign_ID 0x81
 
+// blocchi di READ BINARY: in forma corta, e in forma estesa se carta e lettore la accettano
+#define READ_CHUNK_SHORT 128
+#define READ_CHUNK_EXT_MAX 0x1000
+#define READ_CHUNK_EXT_MIN 0x400
+// blocchi di READ BINARY in SM protetti in anticipo mentre il precedente e' sulla linea
+#define SM_READ_AHEAD 4
+
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -53,6 +61,11 @@ IAS::IAS(CToken::TokenTransmitCallback transmit,ByteArray ATR)
 	
 	ActiveSM = false;
 	ActiveDF = DF_Root;
+	SMSessionReady = false;
+	PINVerified = false;
+	CardDataLoaded = false;
+	pendingSelectIAS = false;
+	readChunk = 0;
 
 	token.setTransmitCallback(transmit, nullptr);
 }
@@ -65,10 +78,28 @@ IAS::~IAS()
 uint8_t defModule[] = { 0xba, 0x28, 0x37, 0xab, 0x4c, 0x6b, 0xb8, 0x27, 0x57, 0x7b, 0xff, 0x4e, 0xb7, 0xb1, 0xe4, 0x9c, 0xdd, 0xe0, 0xf1, 0x66, 0x14, 0xd1, 0xef, 0x24, 0xc1, 0xb7, 0x5c, 0xf7, 0x0f, 0xb1, 0x2c, 0xd1, 0x8f, 0x4d, 0x14, 0xe2, 0x81, 0x4b, 0xa4, 0x87, 0x7e, 0xa8, 0x00, 0xe1, 0x75, 0x90, 0x60, 0x76, 0xb5, 0x62, 0xba, 0x53, 0x59, 0x73, 0xc5, 0xd8, 0xb3, 0x78, 0x05, 0x1d, 0x8a, 0xfc, 0x74, 0x07, 0xa1, 0xd9, 0x19, 0x52, 0x9e, 0x03, 0xc1, 0x06, 0xcd, 0xa1, 0x8d, 0x69, 0x9a, 0xfb, 0x0d, 0x8a, 0xb4, 0xfd, 0xdd, 0x9d, 0xc7, 0x19, 0x15, 0x9a, 0x50, 0xde, 0x94, 0x68, 0xf0, 0x2a, 0xb1, 0x03, 0xe2, 0x82, 0xa5, 0x0e, 0x71, 0x6e, 0xc2, 0x3c, 0xda, 0x5b, 0xfc, 0x4a, 0x23, 0x2b, 0x09, 0xa4, 0xb2, 0xc7, 0x07, 0x45, 0x93, 0x95, 0x49, 0x09, 0x9b, 0x44, 0x83, 0xcb, 0xae, 0x62, 0xd0, 0x09, 0x96, 0x74, 0xdb, 0xf6, 0xf3, 0x9b, 0x72, 0x23, 0xa9, 0x9d, 0x88, 0xe3, 0x3f, 0x1a, 0x0c, 0xde, 0xde, 0xeb, 0xbd, 0xc3, 0x55, 0x17, 0xab, 0xe9, 0x88, 0x0a, 0xab, 0x24, 0x0e, 0x1e, 0xa1, 0x66, 0x28, 0x3a, 0x27, 0x4a, 0x9a, 0xd9, 0x3b, 0x4b, 0x1d, 0x19, 0xf3, 0x67, 0x9f, 0x3e, 0x8b, 0x5f, 0xf6, 0xa1, 0xe0, 0xed, 0x73, 0x6e, 0x84, 0xd5, 0xab, 0xe0, 0x3c, 0x59, 0xe7, 0x34, 0x6b, 0x42, 0x18, 0x75, 0x5d, 0x75, 0x36, 0x6c, 0xbf, 0x41, 0x36, 0xf0, 0xa2, 0x6c, 0x3d, 0xc7, 0x0a, 0x69, 0xab, 0xaa, 0xf6, 0x6e, 0x13, 0xa1, 0xb2, 0xfa, 0xad, 0x05, 0x2c, 0xa6, 0xec, 0x9c, 0x51, 0xe2, 0xae, 0xd1, 0x4d, 0x16, 0xe0, 0x90, 0x25, 0x4d, 0xc3, 0xf6, 0x4e, 0xa2, 0xbd, 0x8a, 0x83, 0x6b, 0xba, 0x99, 0xde, 0xfa, 0xcb, 0xa3, 0xa6, 0x13, 0xae, 0xed, 0xd9, 0x3a, 0x96, 0x15, 0x27, 0x3d };
 uint8_t defPrivExp[] = { 0x47, 0x16, 0xc2, 0xa3, 0x8c, 0xcc, 0x7a, 0x07, 0xb4, 0x15, 0xeb, 0x1a, 0x61, 0x75, 0xf2, 0xaa, 0xa0, 0xe4, 0x9c, 0xea, 0xf1, 0xba, 0x75, 0xcb, 0xa0, 0x9a, 0x68, 0x4b, 0x04, 0xd8, 0x11, 0x18, 0x79, 0xd3, 0xe2, 0xcc, 0xd8, 0xb9, 0x4d, 0x3c, 0x5c, 0xf6, 0xc5, 0x57, 0x53, 0xf0, 0xed, 0x95, 0x87, 0x91, 0x0b, 0x3c, 0x77, 0x25, 0x8a, 0x01, 0x46, 0x0f, 0xe8, 0x4c, 0x2e, 0xde, 0x57, 0x64, 0xee, 0xbe, 0x9c, 0x37, 0xfb, 0x95, 0xcd, 0x69, 0xce, 0xaf, 0x09, 0xf4, 0xb1, 0x35, 0x7c, 0x27, 0x63, 0x14, 0xab, 0x43, 0xec, 0x5b, 0x3c, 0xef, 0xb0, 0x40, 0x3f, 0x86, 0x8f, 0x68, 0x8e, 0x2e, 0xc0, 0x9a, 0x49, 0x73, 0xe9, 0x87, 0x75, 0x6f, 0x8d, 0xa7, 0xa1, 0x01, 0xa2, 0xca, 0x75, 0xa5, 0x4a, 0x8c, 0x4c, 0xcf, 0x9a, 0x1b, 0x61, 0x47, 0xe4, 0xde, 0x56, 0x42, 0x3a, 0xf7, 0x0b, 0x20, 0x67, 0x17, 0x9c, 0x5e, 0xeb, 0x64, 0x68, 0x67, 0x86, 0x34, 0x78, 0xd7, 0x52, 0xc7, 0xf4, 0x12, 0xdb, 0x27, 0x75, 0x41, 0x57, 0x5a, 0xa0, 0x61, 0x9d, 0x30, 0xbc, 0xcc, 0x8d, 0x87, 0xe6, 0x17, 0x0b, 0x33, 0x43, 0x9a, 0x2c, 0x93, 0xf2, 0xd9, 0x7e, 0x18, 0xc0, 0xa8, 0x23, 0x43, 0xa6, 0x01, 0x2a, 0x5b, 0xb1, 0x82, 0x28, 0x08, 0xf0, 0x1b, 0x5c, 0xfd, 0x85, 0x67, 0x3a, 0xc0, 0x96, 0x4c, 0x5f, 0x3c, 0xfd, 0x2d, 0xaf, 0x81, 0x42, 0x35, 0x97, 0x64, 0xa9, 0xad, 0xb9, 0xe3, 0xf7, 0x6d, 0xb6, 0x13, 0x46, 0x1c, 0x1b, 0xc9, 0x13, 0xdc, 0x9a, 0xc0, 0xab, 0x50, 0xd3, 0x65, 0xf7, 0x7c, 0xb9, 0x31, 0x94, 0xc9, 0x8a, 0xa9, 0x66, 0xd8, 0x9c, 0xdd, 0x55, 0x51, 0x25, 0xa5, 0xe5, 0x9e, 0xcf, 0x4f, 0xa3, 0xf0, 0xc3, 0xfd, 0x61, 0x0c, 0xd3, 0xd0, 0x56, 0x43, 0x93, 0x38, 0xfd, 0x81 };
 uint8_t defPubExp[] = { 0x00, 0x01, 0x00, 0x01 };
+// componenti CRT della chiave DAPP (p, q, d mod p-1, d mod q-1, q^-1 mod p)
+uint8_t defP[] = { 0xe9, 0x28, 0x1d, 0x69, 0x6b, 0xcf, 0x26, 0x57, 0x6a, 0xda, 0x44, 0x91, 0xbd, 0xbb, 0x48, 0x05, 0x7c, 0xdd, 0x3e, 0x78, 0xd8, 0x46, 0xd9, 0x61, 0x64, 0x69, 0xe2, 0xb4, 0x81, 0x51, 0x09, 0x8d, 0xb6, 0x88, 0x70, 0x4f, 0x67, 0x6e, 0xb9, 0x3f, 0x7e, 0xd5, 0x0c, 0x7a, 0x72, 0x5b, 0xfd, 0xa2, 0x6b, 0xff, 0x10, 0x63, 0x0a, 0x0a, 0xa9, 0x65, 0x86, 0x84, 0xb8, 0x81, 0xe0, 0x07, 0xf0, 0xf1, 0xa5, 0x32, 0x08, 0xda, 0x67, 0xe2, 0xd6, 0x22, 0x16, 0xb0, 0x19, 0x90, 0xdb, 0xbc, 0x93, 0xcb, 0x28, 0x70, 0xb9, 0x9f, 0x87, 0x74, 0x2f, 0xfa, 0x87, 0xa1, 0x71, 0x29, 0xc9, 0xfa, 0xd5, 0x25, 0xf6, 0xcf, 0x2a, 0xe6, 0xf4, 0x5a, 0x04, 0xc0, 0xfc, 0x07, 0x50, 0xf2, 0xca, 0x4d, 0x5b, 0x4f, 0x54, 0x27, 0x3f, 0xc5, 0x99, 0x3b, 0xa9, 0x65, 0x85, 0x1d, 0x38, 0xef, 0xa9, 0x2c, 0x36, 0xdd };
+uint8_t defQ[] = { 0xcc, 0x65, 0x4a, 0x02, 0x4b, 0xdf, 0x9c, 0x45, 0x0a, 0xf9, 0x3e, 0x9c, 0xdb, 0x0e, 0x08, 0x86, 0x9e, 0x45, 0x71, 0x66, 0xf0, 0x32, 0xd9, 0x61, 0xfa, 0xb5, 0x6a, 0x34, 0x23, 0x0a, 0x95, 0x00, 0x9e, 0xd7, 0x76, 0x2d, 0x25, 0xa0, 0x4c, 0x34, 0xb5, 0x5f, 0xb4, 0x55, 0xce, 0xdf, 0x73, 0x98, 0xdb, 0x58, 0x08, 0x37, 0xe8, 0xdc, 0xc0, 0x70, 0xd7, 0x2b, 0x26, 0x04, 0x27, 0x75, 0x4c, 0x14, 0x6e, 0x76, 0x41, 0x95, 0x0a, 0x78, 0x80, 0xfe, 0x0c, 0xb3, 0xb3, 0x9e, 0xc7, 0xe4, 0xc9, 0x6f, 0xa3, 0x6d, 0xaa, 0xb3, 0xe9, 0x96, 0x30, 0x2e, 0x13, 0xf7, 0x85, 0x03, 0xbb, 0x13, 0x34, 0x25, 0x3d, 0xd2, 0x04, 0x49, 0x65, 0xff, 0x77, 0xfa, 0x04, 0xd8, 0xf7, 0x57, 0x27, 0x29, 0x1d, 0x8c, 0x24, 0x57, 0xf9, 0x10, 0xa3, 0xab, 0x7f, 0x6a, 0x19, 0xed, 0x7d, 0xcf, 0xd0, 0xa4, 0x3b, 0xe1 };
+uint8_t defDP[] = { 0x0d, 0x58, 0x3d, 0x6e, 0xb6, 0x3b, 0xf1, 0xfe, 0xd8, 0xdf, 0xcb, 0x42, 0xe8, 0x30, 0x1a, 0xec, 0x2d, 0x7c, 0x60, 0x41, 0xfc, 0x66, 0xf9, 0xb4, 0x28, 0x52, 0x23, 0x26, 0x9f, 0xac, 0x2a, 0xb6, 0xd0, 0xb6, 0xb8, 0x6e, 0xe3, 0x05, 0xa4, 0x56, 0xad, 0x04, 0xb6, 0xa5, 0x1f, 0x7c, 0x82, 0x64, 0xd4, 0x77, 0x91, 0xd1, 0x89, 0x56, 0x98, 0xe1, 0x75, 0xb4, 0x8c, 0xf6, 0xea, 0x02, 0xaa, 0x58, 0xba, 0x52, 0xc5, 0xcc, 0xf2, 0x5b, 0x3a, 0x54, 0x53, 0x26, 0x1b, 0x20, 0x7e, 0x63, 0x29, 0xb6, 0x5c, 0x07, 0x2f, 0xa8, 0xa0, 0xd1, 0x16, 0x99, 0xe9, 0x3f, 0x65, 0x41, 0xb6, 0x0c, 0xc4, 0x3c, 0x5b, 0x06, 0xfa, 0x76, 0xa3, 0x8f, 0xaf, 0x6b, 0xf8, 0x40, 0xd6, 0xf2, 0x3e, 0x7f, 0xf4, 0xf4, 0xf2, 0x65, 0x18, 0xb2, 0x4f, 0x95, 0xe9, 0x99, 0x24, 0xe8, 0x4a, 0x44, 0xf5, 0x52, 0xd1, 0x85 };
+uint8_t defDQ[] = { 0xbe, 0x7a, 0xca, 0x7c, 0xd7, 0x5e, 0x9d, 0x50, 0x4e, 0x88, 0xb6, 0xcc, 0x10, 0xec, 0xc4, 0x0f, 0x48, 0x62, 0x28, 0xeb, 0xa8, 0x7f, 0x8a, 0xcc, 0x5f, 0x8b, 0x3f, 0x5d, 0x35, 0x26, 0xc0, 0x73, 0x62, 0x94, 0x23, 0x02, 0xb1, 0xe4, 0xef, 0xff, 0xd2, 0xe3, 0x4c, 0xb9, 0x06, 0xe0, 0x80, 0xe6, 0xfb, 0xca, 0xcf, 0x65, 0xe3, 0x32, 0x0e, 0x79, 0x5a, 0x5c, 0x50, 0xc2, 0x60, 0x4f, 0x54, 0xc6, 0x59, 0xa7, 0x05, 0x39, 0x33, 0x17, 0xd8, 0x06, 0x69, 0xa9, 0xf2, 0x83, 0xcf, 0x7f, 0xac, 0x25, 0xc8, 0xe5, 0x03, 0xc7, 0x44, 0xb1, 0x7d, 0x57, 0x03, 0xae, 0x91, 0x1c, 0x47, 0xf3, 0xfe, 0x8d, 0x92, 0x4e, 0x2d, 0x46, 0x85, 0xb2, 0x8d, 0x89, 0xc7, 0x88, 0xb7, 0x00, 0x56, 0x73, 0x5f, 0xa0, 0xe1, 0xa1, 0xc6, 0x6f, 0xb6, 0x47, 0xb5, 0xa7, 0x18, 0x60, 0x95, 0xf5, 0xdc, 0x57, 0xa1, 0xa1 };
+uint8_t defQInv[] = { 0x59, 0xc8, 0xe6, 0x86, 0x33, 0x13, 0x8a, 0xbc, 0x42, 0x2d, 0x19, 0xfe, 0x43, 0x0f, 0x6f, 0xe8, 0xd4, 0x99, 0x2b, 0x19, 0xb9, 0x4c, 0x84, 0x73, 0x5a, 0x41, 0xaf, 0xf9, 0xd5, 0x60, 0x63, 0xec, 0xce, 0x42, 0x22, 0x26, 0x26, 0x9e, 0x1c, 0x0f, 0x23, 0x6a, 0x53, 0xaa, 0xe8, 0x5f, 0x95, 0x8f, 0x58, 0xfa, 0x49, 0x6d, 0x52, 0x8f, 0x52, 0xaa, 0xc2, 0xe6, 0x43, 0xbf, 0xba, 0xe8, 0x82, 0xdb, 0x04, 0x3f, 0x10, 0xa6, 0x82, 0x3f, 0xbd, 0xe2, 0x5b, 0xa8, 0x46, 0x11, 0x92, 0x25, 0x48, 0x90, 0x99, 0xe0, 0xb8, 0x1c, 0xaf, 0xed, 0xcc, 0xac, 0xee, 0xe1, 0x0d, 0x7e, 0x95, 0xa0, 0xb4, 0xdd, 0x10, 0xc6, 0xd1, 0x7c, 0xe5, 0xf9, 0x59, 0x35, 0xc2, 0xae, 0xc2, 0x39, 0xa1, 0x64, 0x10, 0x42, 0xda, 0x89, 0xe9, 0xda, 0x26, 0xfc, 0x67, 0xb9, 0xa2, 0xe4, 0x82, 0x42, 0x32, 0x08, 0x52, 0xd9 };
 
 void IAS::ReadSOD(ByteDynArray &data) {
 	init_func
 	readfile(0x1006,data);
+
+	// se l'EF.SOD non e' quello dei dati in cache la carta e' stata riemessa: li scarto
+	if (!CardDataSOD.isEmpty()) {
+		CSHA256 sha256;
+		if (sha256.Digest(data) != CardDataSOD) {
+			std::string PANStr;
+			dumpHexData(PAN.mid(5, 6), PANStr, false);
+			CacheRemoveCardData(PANStr.c_str());
+			CardDataSOD.clear();
+			CardDataLoaded = false;
+		}
+	}
 	exit_func
 }
 void IAS::ReadDH(ByteDynArray &data) {
@@ -106,10 +137,17 @@ void IAS::Sign(ByteArray &data, ByteDynArray &signedData) {
 	StatusWord sw;
     ByteArray val02Ba = VarToByteArray(val02);
     ByteArray keyIdBa = VarToByteArray(keyId);
-    if ((sw = SendAPDU_SM(VarToByteArray(SetKey), ASN1Tag(0x80, val02Ba).append(ASN1Tag(0x84, keyIdBa)), resp)) != 0x9000)
-		throw scard_error(sw);
-	
+	ByteDynArray seData = ASN1Tag(0x80, val02Ba).append(ASN1Tag(0x84, keyIdBa));
 	uint8_t Sign[] = { 0x00, 0x88, 0x00, 0x00 };
+
+	// la PSO si protegge mentre l'MSE e' sulla linea
+	std::vector<ByteDynArray> apdus;
+	AppendAPDU_SM(apdus, VarToByteArray(SetKey), seData);
+	AppendAPDU_SM(apdus, VarToByteArray(Sign), data);
+	PlanSequence_SM(apdus);
+	// nelle firme successive alla prima la chiave e' gia' selezionata
+	SetSE(VarToByteArray(SetKey), seData, true);
+	
 	if ((sw = SendAPDU_SM(VarToByteArray(Sign), data, signedData)) != 0x9000)
 		throw scard_error(sw);
 }
@@ -125,7 +163,9 @@ StatusWord IAS::VerifyPIN(ByteArray &PIN) {
 	init_func
 	ByteDynArray resp;
 	uint8_t verifyPIN[] = { 0x00, 0x20, 0x00, CIE_PIN_ID };
-	return SendAPDU_SM(VarToByteArray(verifyPIN), PIN, resp);
+	StatusWord sw = SendAPDU_SM(VarToByteArray(verifyPIN), PIN, resp);
+	PINVerified = (sw == 0x9000);
+	return sw;
 	exit_func
 }
 
@@ -161,22 +201,21 @@ void IAS::readfile(uint16_t id, ByteDynArray &content){
 	if (ActiveSM)
 		return readfile_SM(id, content);
 
-	ByteDynArray resp;
-	uint8_t selectFile[] = { 0x00, 0xa4, 0x02, 0x04 };
-	uint8_t fileId[] = { HIBYTE(id), LOBYTE(id) };
+	SelectEF(id, false);
 	StatusWord sw;
-	if ((sw = SendAPDU(VarToByteArray(selectFile), VarToByteArray(fileId), resp)) != 0x9000)
-	throw scard_error(sw);
 
 
 	WORD cnt = 0;
-	uint8_t chunk = 128;
+	DWORD chunk = readChunk;
 	while (true) {
 		ByteDynArray chn;
 		uint8_t readFile[] = { 0x00, 0xb0, HIBYTE(cnt), LOBYTE(cnt) };
-		sw = SendAPDU(VarToByteArray(readFile), ByteArray(), chn, &chunk);
+		if (readChunk == 0)
+			sw = ProbeReadChunk(VarToByteArray(readFile), chn);
+		else
+			sw = SendAPDU(VarToByteArray(readFile), ByteArray(), chn, &chunk);
 		if ((sw >> 8) == 0x6c)  {
-			uint8_t le = sw & 0xff;
+			DWORD le = sw & 0xff;
 			sw = SendAPDU(VarToByteArray(readFile), ByteArray(), chn, &le);
 		}
 		if (sw == 0x9000) {
@@ -185,7 +224,7 @@ void IAS::readfile(uint16_t id, ByteDynArray &content){
 //            WORD chnSize;
 //            if (FAILED(SizeTToWord(chn.size(), &chnSize)) || FAILED(WordAdd(cnt, chnSize, &cnt)))
 //                throw logged_error("File troppo grande");
-			chunk = 128;
+			chunk = readChunk;
 		}
 		else {
 			if (sw == 0x6282)
@@ -201,22 +240,29 @@ void IAS::readfile(uint16_t id, ByteDynArray &content){
 void IAS::readfile_SM(uint16_t id, ByteDynArray &content) {
 	init_func
 
-	ByteDynArray resp;
-	uint8_t selectFile[] = { 0x00, 0xa4, 0x02, 0x04 };
-	uint8_t fileId[] = { HIBYTE(id), LOBYTE(id) };
+	SelectEF(id, true);
 	StatusWord sw;
-	if ((sw = SendAPDU_SM(VarToByteArray(selectFile), VarToByteArray(fileId), resp)) != 0x9000)
-	throw scard_error(sw);
 
 
+	// in SM non faccio tentativi: un errore chiuderebbe il canale. Uso la dimensione
+	// verificata dalle letture in chiaro, se c'e'
 	WORD cnt = 0;
-	uint8_t chunk = 128;
+	DWORD chunk = readChunk != 0 ? readChunk : READ_CHUNK_SHORT;
 	while (true) {
 		ByteDynArray chn;
 		uint8_t readFile[] = { 0x00, 0xb0, HIBYTE(cnt), LOBYTE(cnt) };
+		// i blocchi successivi sono prevedibili finche' la carta li restituisce interi
+		if (smPlanned.empty() && smPrepared.empty()) {
+			std::vector<ByteDynArray> reads;
+			for (DWORD offset = cnt; offset <= 0x7fff && reads.size() < SM_READ_AHEAD; offset += chunk) {
+				uint8_t nextRead[] = { 0x00, 0xb0, HIBYTE(offset), LOBYTE(offset) };
+				AppendAPDU_SM(reads, VarToByteArray(nextRead), ByteArray(), &chunk);
+			}
+			PlanSequence_SM(reads);
+		}
 		sw = SendAPDU_SM(VarToByteArray(readFile), ByteArray(), chn, &chunk);
 		if ((sw >> 8) == 0x6c)  {
-			uint8_t le = sw & 0xff;
+			DWORD le = sw & 0xff;
 			sw = SendAPDU_SM(VarToByteArray(readFile), ByteArray(), chn, &le);
 		}
 		if (sw == 0x9000) {
@@ -225,7 +271,7 @@ void IAS::readfile_SM(uint16_t id, ByteDynArray &content) {
 //            WORD chnSize;
 //            if (FAILED(SizeTToWord(chn.size(), &chnSize)) || FAILED(WordAdd(cnt, chnSize, &cnt)))
 //                throw logged_error("File troppo grande");
-			chunk = 128;
+			chunk = readChunk != 0 ? readChunk : READ_CHUNK_SHORT;
 		}
 		else {
 			if (sw == 0x6282) 
@@ -235,11 +281,93 @@ void IAS::readfile_SM(uint16_t id, ByteDynArray &content) {
 			break;
 		}
 	}
+	// blocchi previsti oltre la fine del file
+	ClearSequence_SM();
+	exit_func
+}
+
+void IAS::SelectEF(uint16_t id, bool SM) {
+	init_func
+	FlushSelect();
+	cardState.Sync(token.getResetCount());
+	if (cardState.IsEF(id))
+		return;
+
+	ByteDynArray resp;
+	uint8_t selectFile[] = { 0x00, 0xa4, 0x02, 0x04 };
+	uint8_t fileId[] = { HIBYTE(id), LOBYTE(id) };
+	StatusWord sw;
+	if (SM)
+		sw = SendAPDU_SM(VarToByteArray(selectFile), VarToByteArray(fileId), resp);
+	else
+		sw = SendAPDU(VarToByteArray(selectFile), VarToByteArray(fileId), resp);
+	if (sw != 0x9000)
+		throw scard_error(sw);
+	cardState.SetEF(id);
+	exit_func
+}
+
+void IAS::SetSE(ByteArray head, ByteArray data, bool SM, DWORD *le) {
+	init_func
+	FlushSelect();
+	cardState.Sync(token.getResetCount());
+	if (cardState.IsSE(head[2], head[3], data))
+		return;
+
+	ByteDynArray resp;
+	StatusWord sw;
+	if (SM)
+		sw = SendAPDU_SM(head, data, resp, le);
+	else
+		sw = SendAPDU(head, data, resp, le);
+	if (sw != 0x9000)
+		throw scard_error(sw);
+	cardState.SetSE(head[2], head[3], data);
+	exit_func
+}
+
+StatusWord IAS::ProbeReadChunk(ByteArray readFile, ByteDynArray &chunk) {
+	init_func
+	// provo il primo blocco con Le estesa, dalla piu' grande alla piu' piccola; se carta
+	// o lettore non la accettano torno alla forma corta
+	DWORD extChunks[] = { READ_CHUNK_EXT_MAX, READ_CHUNK_EXT_MIN };
+	StatusWord sw;
+	for (DWORD le : extChunks) {
+		try {
+			sw = SendAPDU(readFile, ByteArray(), chunk, &le);
+		}
+		catch (...) {
+			// il lettore ha rifiutato l'APDU
+			continue;
+		}
+		if (sw == 0x9000 || sw == 0x6282) {
+			readChunk = le;
+			return sw;
+		}
+		// file vuoto o piu' corto del blocco: la verifica si ripete sul prossimo file
+		if ((sw >> 8) == 0x6c || sw == 0x6b00)
+			return sw;
+	}
+
+	Log.write("APDU estese non supportate, lettura a blocchi di %i byte", READ_CHUNK_SHORT);
+	readChunk = READ_CHUNK_SHORT;
+	DWORD le = readChunk;
+	return SendAPDU(readFile, ByteArray(), chunk, &le);
 	exit_func
 }
 
 void IAS::SelectAID_CIE(bool SM) {
 	init_func
+	if (!SM && !ActiveSM) {
+		cardState.Sync(token.getResetCount());
+		if (cardState.IsDF(DF_CIE)) {
+			// la carta e' gia' nel DF CIE: annullo anche l'eventuale SELECT del DF IAS in sospeso
+			pendingSelectIAS = false;
+			ActiveDF = DF_CIE;
+			return;
+		}
+	}
+
 	ByteDynArray resp;
 	uint8_t selectCIE[] = { 0x00, 0xa4, 0x04, 0x0c };
 	ByteDynArray selectCIEapdu;
@@ -252,7 +380,10 @@ void IAS::SelectAID_CIE(bool SM) {
 	{
 		if ((sw = SendAPDU(VarToByteArray(selectCIE), CIE_AID, resp)) != 0x9000)
 		throw scard_error(sw);
+		// la select in chiaro chiude il canale SM sulla carta
+		CloseSMSession();
 	}
+	cardState.SetDF(DF_CIE);
 	ActiveDF = DF_CIE;
 	ActiveSM = false;
 	exit_func
@@ -266,16 +397,21 @@ ByteArray baNXP_ATR(NXP_ATR, sizeof(NXP_ATR));
 ByteArray baGemalto_ATR(Gemalto_ATR, sizeof(Gemalto_ATR));
 ByteArray baGemalto2_ATR(Gemalto2_ATR, sizeof(Gemalto2_ATR));
 
-void IAS::ReadCIEType() {	
-	init_func
-		size_t position;
+CIE_Type IAS::TypeFromATR(ByteArray &ATR) {
+	size_t position;
 	if (ATR.indexOf(baNXP_ATR,position))
-		type = CIE_Type::CIE_NXP;
+		return CIE_Type::CIE_NXP;
 	else if (ATR.indexOf(baGemalto_ATR, position))
-		type = CIE_Type::CIE_Gemalto;
+		return CIE_Type::CIE_Gemalto;
 	else if (ATR.indexOf(baGemalto2_ATR, position))
-		type = CIE_Type::CIE_Gemalto;
-	else
+		return CIE_Type::CIE_Gemalto;
+	return CIE_Type::CIE_Unknown;
+}
+
+void IAS::ReadCIEType() {	
+	init_func
+	type = TypeFromATR(ATR);
+	if (type == CIE_Type::CIE_Unknown)
 		throw logged_error("CIE non riconosciuta");
 }
 
@@ -285,6 +421,27 @@ void IAS::SelectAID_IAS(bool SM) {
 	if (type == CIE_Type::CIE_Unknown) {
 		ReadCIEType();
 	}
+	if (!SM && !ActiveSM) {
+		cardState.Sync(token.getResetCount());
+		if (cardState.IsDF(DF_IAS) || cardState.IsDF(DF_CIE)) {
+			// dal DF CIE la SELECT serve solo se il prossimo comando non riseleziona il DF CIE
+			pendingSelectIAS = cardState.IsDF(DF_CIE);
+			ActiveDF = DF_IAS;
+			return;
+		}
+	}
+	SelectIAS(SM);
+	exit_func
+}
+
+void IAS::FlushSelect() {
+	if (pendingSelectIAS)
+		SelectIAS(false);
+}
+
+void IAS::SelectIAS(bool SM) {
+	init_func
+	pendingSelectIAS = false;
 	ByteDynArray resp;
 	StatusWord sw;
 	uint8_t selectMF[] = { 0x00, 0xa4, 0x00, 0x00 };
@@ -299,6 +456,9 @@ void IAS::SelectAID_IAS(bool SM) {
 			throw scard_error(sw);
 	}
 
+	if (!SM)
+		CloseSMSession();
+
 	SM = false;
 	if (type != CIE_Type::CIE_NXP)  {
 		uint8_t selectIAS[] = { 0x00, 0xa4, 0x04, 0x0c };
@@ -313,6 +473,7 @@ void IAS::SelectAID_IAS(bool SM) {
 				throw scard_error(sw);
 		}
 	}
+	cardState.SetDF(DF_IAS);
 	ActiveDF = DF_IAS;
 	ActiveSM = false;
 	exit_func
@@ -343,29 +504,17 @@ void IAS::ReadPAN() {
 	exit_func
 }
 
-void IAS::DAPP() {
+ByteDynArray IAS::MakeDappCert() {
 	init_func
-
-	ByteDynArray resp;
-	uint8_t psoVerifyAlgo = 0x41;
-	uint8_t PKdScheme = 0x9B;
 	uint8_t shaOID = 0x04;
 	DWORD shaSize = 32;
 	CSHA256 sha256;
-	uint8_t Val01 = 1;
-
-	if (DappPubKey.isEmpty()) {
-		throw logged_error("La chiave DAPP non e' diponibile");
-	}
 
 	ByteDynArray module = VarToByteArray(defModule);
 	ByteDynArray pubexp = VarToByteArray(defPubExp);
-	ByteDynArray privexp = VarToByteArray(defPrivExp);
 
-	ByteDynArray cert;
 	ByteDynArray CHR, CHA, OID;
 
-
 	uint8_t snIFD[] = { 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 };
 	uint8_t CPI=0x8A;
 	uint8_t baseCHR[] = { 0x00, 0x00, 0x00, 0x00 };
@@ -375,6 +524,7 @@ void IAS::DAPP() {
     
 	CHR.set(&baseCHRBa, &snIFDBa);
 	CHA.set(&CA_AID,01);
+
 	uint8_t baseOID[] = { 0x2A, 0x81, 0x22, 0xF4, 0x2A, 0x02, 0x04, 0x01 };
     
     ByteArray baseOIDBa = VarToByteArray(baseOID);
@@ -391,6 +541,8 @@ void IAS::DAPP() {
     ByteDynArray endEntityCertDigestBa = sha256.Digest(endEntityCert);
     
 	toSign.set(0x6A, &endEntityCertBa, &endEntityCertDigestBa, 0xbc);
+	// la firma si calcola una volta per carta: ricavare i fattori del modulo per il CRT
+	// costerebbe molto piu' di un'esponenziazione con il solo esponente privato
 	CRSA caKey(CA_module, CA_privexp);
     
 	certSign = caKey.RSA_PURE(toSign);
@@ -404,35 +556,103 @@ void IAS::DAPP() {
 	ByteDynArray PkRem;
 	PkRem = endEntityCert.mid(CA_module.size() - shaSize - 2);
 
+	ByteDynArray cert;
     cert.setASN1Tag(0x7F21, ASN1Tag(0x5F37, certSign).append(ASN1Tag(0x5F38, PkRem)).append(ASN1Tag(0x42, CA_CAR)));
+	return cert;
+	exit_func
+}
+
+void IAS::StartDappCert() {
+	// MakeDappCert legge solo i parametri della CA: chi li riscrive (InitExtAuthKeyParam,
+	// LoadCardData) raccoglie prima il risultato con BuildDappCert
+	if (!DappCert.isEmpty() || dappCertJob.valid())
+		return;
+	dappCertJob = std::async(std::launch::async, [this]() { return MakeDappCert(); });
+}
+
+void IAS::BuildDappCert() {
+	init_func
+	if (dappCertJob.valid()) {
+		// rilancia l'eventuale eccezione del calcolo in background
+		ByteDynArray cert = dappCertJob.get();
+		if (DappCert.isEmpty())
+			DappCert = cert;
+	}
+	if (DappCert.isEmpty())
+		DappCert = MakeDappCert();
+	exit_func
+}
+
+void IAS::DAPP() {
+	init_func
+
+	ByteDynArray resp;
+	uint8_t psoVerifyAlgo = 0x41;
+	uint8_t PKdScheme = 0x9B;
+	DWORD shaSize = 32;
+	CSHA256 sha256;
+	uint8_t Val01 = 1;
+
+	if (DappPubKey.isEmpty()) {
+		throw logged_error("La chiave DAPP non e' diponibile");
+	}
+
+	ByteDynArray module = VarToByteArray(defModule);
+	ByteDynArray pubexp = VarToByteArray(defPubExp);
+	ByteDynArray privexp = VarToByteArray(defPrivExp);
+	ByteArray p = VarToByteArray(defP), q = VarToByteArray(defQ);
+	ByteArray dP = VarToByteArray(defDP), dQ = VarToByteArray(defDQ), qInv = VarToByteArray(defQInv);
+
+	ByteDynArray CHR;
+
+	uint8_t snIFD[] = { 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 };
+	uint8_t baseCHR[] = { 0x00, 0x00, 0x00, 0x00 };
+    
+    ByteArray baseCHRBa = VarToByteArray(baseCHR);
+    ByteArray snIFDBa = VarToByteArray(snIFD);
+    
+	CHR.set(&baseCHRBa, &snIFDBa);
+
+	// il certificato firmato dalla CA dipende solo dalla carta: lo calcolo una volta sola,
+	// di solito gia' in background da InitExtAuthKeyParam
+	BuildDappCert();
 
 	uint8_t SelectKey[] = { 0x00, 0x22, 0x81, 0xb6 };
 	uint8_t id = CIE_KEY_ExtAuth_ID;
 	StatusWord sw;
 
-	uint8_t le = 0;
+	DWORD le = 0;
     ByteArray psoVerifyAlgoBa = VarToByteArray(psoVerifyAlgo);
     ByteArray idBa = VarToByteArray(id);
-	if ((sw = SendAPDU_SM(VarToByteArray(SelectKey), ASN1Tag(0x80, psoVerifyAlgoBa).append(ASN1Tag(0x83, idBa)), resp, &le)) != 0x9000)
-		throw scard_error(sw);
-
+	ByteDynArray selectKeyData = ASN1Tag(0x80, psoVerifyAlgoBa).append(ASN1Tag(0x83, idBa));
 	uint8_t VerifyCert[] = { 0x00, 0x2A, 0x00, 0xAE };
-	if ((sw = SendAPDU_SM(VarToByteArray(VerifyCert), cert, resp)) != 0x9000)
-		throw scard_error(sw);
-
 	uint8_t SetCHR[] = { 0x00, 0x22, 0x81, 0xA4 };
-    
-	if ((sw = SendAPDU_SM(VarToByteArray(SetCHR), ASN1Tag(0x83, CHR), resp)) != 0x9000)
+	ByteDynArray setCHRData = ASN1Tag(0x83, CHR);
+	uint8_t GetChallenge[] = { 0x00, 0x84, 0x00, 0x00 };
+	DWORD chLen = 8;
+
+	// fino alla GET CHALLENGE i comandi non dipendono dalle risposte: si proteggono
+	// mentre la prima APDU e' sulla linea
+	std::vector<ByteDynArray> apdus;
+	AppendAPDU_SM(apdus, VarToByteArray(SelectKey), selectKeyData, &le);
+	AppendAPDU_SM(apdus, VarToByteArray(VerifyCert), DappCert);
+	AppendAPDU_SM(apdus, VarToByteArray(SetCHR), setCHRData);
+	AppendAPDU_SM(apdus, VarToByteArray(GetChallenge), ByteArray(), &chLen);
+	PlanSequence_SM(apdus);
+
+	SetSE(VarToByteArray(SelectKey), selectKeyData, true, &le);
+
+	if ((sw = SendAPDU_SM(VarToByteArray(VerifyCert), DappCert, resp)) != 0x9000)
 		throw scard_error(sw);
 
+	SetSE(VarToByteArray(SetCHR), setCHRData, true);
+
 	ByteDynArray challenge;
-	uint8_t GetChallenge[] = { 0x00, 0x84, 0x00, 0x00 };
-	uint8_t chLen = 8;
 
 	if ((sw = SendAPDU_SM(VarToByteArray(GetChallenge), ByteArray(), challenge, &chLen)) != 0x9000)
 	throw scard_error(sw);
 
-	ByteDynArray toHash;
+	ByteDynArray toHash, toSign;
 	size_t padSize = module.size() - shaSize - 2;
 	ByteDynArray PRND(padSize);
 	PRND.random();
@@ -440,7 +660,7 @@ void IAS::DAPP() {
     ByteDynArray toHashBa = sha256.Digest(toHash);
 	toSign.set(0x6a, &PRND, &toHashBa, 0xBC);
 	
-	CRSA certKey(module, privexp);
+	CRSA certKey(module, pubexp, privexp, p, q, dP, dQ, qInv);
     
 	ByteDynArray signResp = certKey.RSA_PURE(toSign);
 	ByteDynArray chResponse;
@@ -457,8 +677,7 @@ void IAS::DAPP() {
     ByteArray Val82Ba = VarToByteArray(Val82);
     ByteArray PKdSchemeBa = VarToByteArray(PKdScheme);
     
-	if ((sw = SendAPDU_SM(VarToByteArray(IntAuth), ASN1Tag(0x84, Val82Ba).append(ASN1Tag(0x80, PKdSchemeBa)), resp)) != 0x9000)
-        throw scard_error(sw);
+	SetSE(VarToByteArray(IntAuth), ASN1Tag(0x84, Val82Ba).append(ASN1Tag(0x80, PKdSchemeBa)), true);
 
 	ByteDynArray rndIFD(8);
 	rndIFD.random();
@@ -488,6 +707,7 @@ void IAS::DAPP() {
     ByteArray rndIFDBa = rndIFD.right(4);
 	sessSSC.set(&challengeBa, &rndIFDBa);
 	ActiveSM = true;
+	SMSessionReady = true;
 	exit_func
 }
 
@@ -495,21 +715,18 @@ void IAS::DHKeyExchange() {
 	init_func
 	CASNParser asn1;
 
-	ByteDynArray dh_prKey, secret, resp,d1;
-	do {
-		dh_prKey.resize(dh_q.size());
-		dh_prKey.random();
-	} while (dh_q[0] < dh_prKey[0]);
+	// un nuovo scambio DH invalida il canale SM precedente
+	CloseSMSession();
 
-	// dh_prKey deve essere dispari
-	dh_prKey.right(1)[0] |= 1;
+	ByteDynArray dh_prKey, secret, resp,d1;
+	// la coppia (x, g^x) arriva di solito gia' pronta dal pool
+	if (CDHKeyPool::Destroyed)
+		CDHKeyPool::GenerateKey(dh_p, dh_g, dh_q, dh_prKey, dh_pubKey);
+	else
+		CDHKeyPool::Instance().GetKey(dh_p, dh_g, dh_q, dh_prKey, dh_pubKey);
 
-	ByteDynArray dhg(dh_g.size());
-	dhg.fill(0);
-	dhg.rightcopy(dh_g);
     CRSA rsa(dh_p, dh_prKey);
-    
-	dh_pubKey = rsa.RSA_PURE(dhg);
+    dh_prKey.fill(0);
 
 //    printf("\n\ndhpubKey: %s", dumpHexData(dh_pubKey).c_str());
     
@@ -545,6 +762,7 @@ void IAS::DHKeyExchange() {
     
 	sessENC = sha256.Digest(ByteDynArray(secret).append(VarToByteArray(diffENC))).left(16);
 	sessMAC = sha256.Digest(ByteDynArray(secret).append(VarToByteArray(diffMAC))).left(16);
+	smContext.Prepare(sessENC, sessMAC);
     
 //    printf("\nsessENC: %s", dumpHexData(sessENC).c_str());
 //    printf("\nsessMAC: %s\n", dumpHexData(sessMAC).c_str());
@@ -569,9 +787,85 @@ void IAS::increment(ByteArray &seq) {
 }
 
 
+void CSMContext::Prepare(ByteArray &keyEnc, ByteArray &keyMac) {
+	if (keyEnc == this->keyEnc && keyMac == this->keyMac)
+		return;
+
+	// IV for APDU encryption and signature should be 0. Please refer to IAS specification §7.1.9 Secure messaging – Command APDU protection
+	ByteDynArray iv(8);
+	iv.fill(0);
+	enc.Init(keyEnc, iv);
+	mac.Init(keyMac, iv);
+	this->keyEnc.fill(0);
+	this->keyMac.fill(0);
+	this->keyEnc = keyEnc;
+	this->keyMac = keyMac;
+}
+
+CCardState::CCardState() {
+	resetCount = 0;
+	Invalidate();
+}
+
+void CCardState::Invalidate() {
+	dfKnown = false;
+	ef = 0;
+	se.clear();
+}
+
+void CCardState::Sync(DWORD resetCount) {
+	if (resetCount != this->resetCount) {
+		Invalidate();
+		this->resetCount = resetCount;
+	}
+}
+
+bool CCardState::IsDF(CIE_DF df) {
+	return dfKnown && this->df == df;
+}
+
+void CCardState::SetDF(CIE_DF df) {
+	// la selezione di un DF azzera l'EF corrente e riporta l'ambiente di sicurezza a quello di default
+	dfKnown = true;
+	this->df = df;
+	ef = 0;
+	se.clear();
+}
+
+bool CCardState::IsEF(uint16_t ef) {
+	return this->ef != 0 && this->ef == ef;
+}
+
+void CCardState::SetEF(uint16_t ef) {
+	this->ef = ef;
+}
+
+bool CCardState::IsSE(uint8_t p1, uint8_t p2, ByteArray &data) {
+	auto it = se.find(p2);
+	if (it == se.end())
+		return false;
+	ByteDynArray crt;
+	crt.set(p1, &data);
+	return it->second == crt;
+}
+
+void CCardState::SetSE(uint8_t p1, uint8_t p2, ByteArray &data) {
+	// un MSE sullo stesso template con un altro P1 sostituisce il precedente
+	ByteDynArray crt;
+	crt.set(p1, &data);
+	se[p2] = crt;
+}
+
 ByteDynArray IAS::SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, ByteArray &seq) {
 	init_func
+	smContext.Prepare(keyEnc, keySig);
+	return SMWrap(smContext, apdu, seq);
+	exit_func
+}
 
+// protezione di una APDU con le chiavi gia' preparate nel contesto: la usa anche il
+// worker delle sequenze in SM, che ha un contesto suo
+ByteDynArray IAS::SMWrap(CSMContext &context, ByteArray &apdu, ByteArray &seq) {
 	std::string dmp;
 	ODS(dumpHexData(seq, dmp).c_str());
 
@@ -584,21 +878,14 @@ ByteDynArray IAS::SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, Byte
 	smHead[0] |= 0x0C;
 //    printf("apdu: %s\n", dumpHexData(smHead).c_str());
     
-	auto calcMac = ISOPad(ByteDynArray(seq).append(smHead));
-    
-//    printf("calcMac: %s\n", dumpHexData(calcMac).c_str());
-    
-	ByteDynArray iv(8);
-	iv.fill(0); // IV for APDU encryption and signature should be 0. Please refer to IAS specification §7.1.9 Secure messaging – Command APDU protection
-    
-//    printf("iv: %s\n", dumpHexData(iv).c_str());
-    
-//    printf("keyEnc: %s\n", dumpHexData(keyEnc).c_str());
-	CDES3 encDes(keyEnc, iv);
-	
-//    printf("keySig: %s\n", dumpHexData(keySig).c_str());
-    
-    CMAC sigMac(keySig, iv);
+	CDES3 &encDes = context.enc;
+	CMAC &sigMac = context.mac;
+
+	// il MAC si calcola a blocchi sui segmenti, senza concatenarli
+	sigMac.Begin();
+	sigMac.Update(seq);
+	sigMac.Update(smHead);
+	sigMac.UpdateISOPad();
     
 	uint8_t Val01 = 1;
 //    uint8_t Val00 = 0;
@@ -615,10 +902,9 @@ ByteDynArray IAS::SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, Byte
 		else
 			doob.setASN1Tag(0x85, enc);
 
-		calcMac.append(doob);
+		sigMac.Update(doob);
 		datafield.append(doob);
         
-//        printf("calcMac 1: %s\n", dumpHexData(calcMac).c_str());
 //        printf("datafield 1: %s\n", dumpHexData(datafield).c_str());
 	}
 	if (apdu[4] == 0 && apdu.size() > 7) {
@@ -629,24 +915,32 @@ ByteDynArray IAS::SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, Byte
 		else
 			doob.setASN1Tag(0x85, enc);
 
-		calcMac.append(doob);
+		sigMac.Update(doob);
 		datafield.append(doob);
         
-//        printf("calcMac 2: %s\n", dumpHexData(calcMac).c_str());
 //        printf("datafield 2: %s\n", dumpHexData(datafield).c_str());
 	}
+	bool extLe = false;
 	if (apdu.size() == 5 || apdu.size() == (apdu[4] + 6)) {
 		uint8_t le = apdu[apdu.size() - 1];
         ByteArray leBa = VarToByteArray(le);
 		doob.setASN1Tag(0x97, leBa);
-		calcMac.append(doob);
+		sigMac.Update(doob);
 		datafield.append(doob);
          
-//        printf("calcMac 3: %s\n", dumpHexData(calcMac).c_str());
 //        printf("datafield 3: %s\n", dumpHexData(datafield).c_str());
 	}
+	else if (apdu[4] == 0 && (apdu.size() == 7 || apdu.size() == (((apdu[5] << 8) | apdu[6]) + 9))) {
+		// Le estesa: la risposta protetta puo' superare i 256 byte
+		ByteArray leBa = apdu.right(2);
+		doob.setASN1Tag(0x97, leBa);
+		sigMac.Update(doob);
+		datafield.append(doob);
+		extLe = true;
+	}
     
-    ByteDynArray macBa = sigMac.Mac(ISOPad(calcMac));
+    sigMac.UpdateISOPad();
+    ByteDynArray macBa = sigMac.Final();
 //    printf("macBa: %s\n", dumpHexData(macBa).c_str());
     
     ByteDynArray tagMacBa = ASN1Tag(0x8e, macBa);
@@ -656,7 +950,7 @@ ByteDynArray IAS::SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, Byte
 //    printf("datafield 4: %s\n", dumpHexData(datafield).c_str());
     
 	ByteDynArray elabResp;
-	if (datafield.size()<0x100)
+	if (datafield.size()<0x100 && !extLe)
 		elabResp.set(&smHead, (uint8_t)datafield.size(), &datafield, (uint8_t)0x00);
 	else {
 		auto len = datafield.size();
@@ -677,18 +971,18 @@ StatusWord IAS::respSM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &resp, By
 	DWORD index, llen, lgn; 
 	StatusWord sw = 0xffff;
 	ByteDynArray encData;
-	ByteDynArray respMac, calcMac;
-	ByteDynArray iv(8);
-	iv.fill(0); // IV for APDU encryption should be 0. Please refer to IAS specification §7.1.9 Secure messaging – Command APDU protection
-	CDES3 encDes(keyEnc, iv);
-	CMAC sigMac(keySig, iv);
+	ByteDynArray respMac;
+	smContext.Prepare(keyEnc, keySig);
+	CDES3 &encDes = smContext.enc;
+	CMAC &sigMac = smContext.mac;
 
-	calcMac = seq;
+	sigMac.Begin();
+	sigMac.Update(seq);
 	index = 0;
 	do {
 
 		if (resp[index] == 0x99) {
-			calcMac.append(resp.mid(index, resp[index + 1] + 2));
+			sigMac.Update(resp.mid(index, resp[index + 1] + 2));
 			sw = resp[index + 2] << 8 | resp[index + 3];
 			index += 4;
 		}
@@ -709,12 +1003,12 @@ StatusWord IAS::respSM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &resp, By
 					else 
 						throw logged_error(stdPrintf("Lunghezza ASN1 non valida: %i", llen));
 				encData = resp.mid(index + llen + 2, lgn);
-				calcMac.append(resp.mid(index, lgn + llen + 2));
+				sigMac.Update(resp.mid(index, lgn + llen + 2));
 				index += llen + lgn + 2;
 			}
 			else {
 				encData = resp.mid(index + 2, resp[index + 1]);
-				calcMac.append(resp.mid(index, resp[index + 1] + 2));
+				sigMac.Update(resp.mid(index, resp[index + 1] + 2));
 				index += resp[index + 1] + 2;
 			}
 		}
@@ -729,12 +1023,12 @@ StatusWord IAS::respSM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &resp, By
 					else
 						throw logged_error(stdPrintf("Lunghezza ASN1 non valida: %i", llen));
 				encData = resp.mid(index + llen + 3, lgn - 1);
-				calcMac.append(resp.mid(index, lgn + llen + 2));
+				sigMac.Update(resp.mid(index, lgn + llen + 2));
 				index += llen + lgn + 2;
 			}
 			else {
 				encData = resp.mid(index + 3, resp[index + 1] - 1);
-				calcMac.append(resp.mid(index, resp[index + 1] + 2));
+				sigMac.Update(resp.mid(index, resp[index + 1] + 2));
 				index += resp[index + 1] + 2;
 			}
 		}
@@ -743,7 +1037,10 @@ StatusWord IAS::respSM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &resp, By
 	} while (index < resp.size());
 
     
-	auto smMac = sigMac.Mac(ISOPad(calcMac));
+	sigMac.UpdateISOPad();
+	auto smMac = sigMac.Final();
+	if (smMac != respMac)
+		CloseSMSession();
 	ER_ASSERT(smMac == respMac,"Errore nel checksum della risposta del chip")
 
 	if (!encData.isEmpty()) {
@@ -817,30 +1114,95 @@ StatusWord IAS::getResp_SM(ByteArray &resp, StatusWord sw, ByteDynArray &elabres
 		}
 		else  if (sw == 0x9000 || sw == 0x6b00 || sw==0x6282)
 			break;
-		else
+		else {
+			// la carta non riconosce piu' le chiavi di sessione
+			if (sw == ERR_CARD_NO_SM_KEY || sw == ERR_CARD_SMKEY_FORMAT)
+				CloseSMSession();
 			return sw;
+		}
 	}
 	return respSM(sessENC, sessMAC, elabresp, sessSSC, elabresp);
 	exit_func
 }
 
 
-StatusWord IAS::SendAPDU_SM(ByteArray head, ByteArray data, ByteDynArray &resp, uint8_t *le) {
-	init_func
-	ByteDynArray smApdu;
-	ByteDynArray s, curresp;
-    ByteArray emptyBa;
-    ByteArray leBa = VarToByteArray(*le);
-    std::string str;
+// APDU in forma estesa (ISO 7816-4): Lc e Le su due byte, preceduti da un byte 00
+static void setExtendedAPDU(ByteDynArray &apdu, ByteArray &head, ByteArray &data, DWORD le) {
+	uint8_t leExt[] = { HIBYTE(le), LOBYTE(le) };
+	ByteArray leBa = VarToByteArray(leExt);
+	if (data.size() != 0) {
+		uint8_t lcExt[] = { HIBYTE(data.size()), LOBYTE(data.size()) };
+		ByteArray lcBa = VarToByteArray(lcExt);
+		apdu.set(&head, (uint8_t)0x00, &lcBa, &data, &leBa);
+	}
+	else
+		apdu.set(&head, (uint8_t)0x00, &leBa);
+}
+
+// status word che non cambiano lo stato della carta: oltre al successo, quelle con cui
+// READ BINARY segnala la fine del file o la lunghezza corretta
+static bool KeepsCardState(StatusWord sw) {
+	return sw == 0x9000 || sw == 0x6282 || sw == 0x6b00 || (sw >> 8) == 0x6c;
+}
+
+// APDU in chiaro come le invia SendAPDU_SM: oltre 0xE7 byte di dati il comando si spezza
+// in chaining e solo l'ultimo blocco porta la Le
+void IAS::AppendAPDU_SM(std::vector<ByteDynArray> &apdus, ByteArray head, ByteArray data, DWORD *le) {
+	ByteDynArray apdu;
+	ByteArray emptyBa;
+	uint8_t leShort = (le == nullptr) ? 0 : LOBYTE(*le);
+	ByteArray leBa = VarToByteArray(leShort);
 
-	StatusWord sw;
 	if (data.size() < 0xE7) {
-        
-		smApdu.set(&head, (uint8_t)data.size(), &data, (le == nullptr) ? &emptyBa : &leBa);
+		if (le != nullptr && *le > 0x100)
+			setExtendedAPDU(apdu, head, data, *le);
+		else
+			apdu.set(&head, (uint8_t)data.size(), &data, (le == nullptr) ? &emptyBa : &leBa);
+		apdus.push_back(apdu);
+		return;
+	}
 
-        
-		ODS(std::string().append("\nClear APDU:").append(dumpHexData(smApdu, str)).append("\n").c_str());
-		smApdu = SM(sessENC, sessMAC, smApdu, sessSSC);
+	ByteDynArray chainHead = head;
+	size_t i = 0;
+	uint8_t cla = head[0];
+	while (i < data.size()) {
+		ByteArray s = data.mid(i, min(0xE7, data.size() - i));
+		i += s.size();
+		if (i != data.size())
+			chainHead[0] = cla | 0x10;
+		else
+			chainHead[0] = cla;
+		apdu.set(&chainHead, (BYTE)s.size(), &s, (le == nullptr || i < data.size()) ? &emptyBa : &leBa);
+		apdus.push_back(apdu);
+	}
+}
+
+StatusWord IAS::SendAPDU_SM(ByteArray head, ByteArray data, ByteDynArray &resp, DWORD *le) {
+	init_func
+	FlushSelect();
+	cardState.Sync(token.getResetCount());
+	ByteDynArray smApdu, curresp;
+    std::string str;
+
+	// attenzione:
+	// in alcuni casi la carta ritorna 61xx fra un comando e l'altro in chaining. Questo è un grosso problema, perchè
+	// la get response sembra che faccia saltare il chaining. Forse è una questione di driver del lettore?
+	// Per daesso l'ho osservato solo su una virtual machine Win7 con il lettore in sharing con l'host
+	std::vector<ByteDynArray> apdus;
+	AppendAPDU_SM(apdus, head, data, le);
+	// i blocchi di un comando in chaining sono gia' una sequenza nota, se il chiamante
+	// non ne ha prevista una che li comprende
+	if (apdus.size() > 1 && smPlanned.empty() && smPrepared.empty())
+		PlanSequence_SM(apdus);
+
+	StatusWord sw = 0;
+	for (ByteDynArray &apdu : apdus) {
+		ODS(std::string().append("\nClear APDU:").append(dumpHexData(apdu, str)).append("\n").c_str());
+		if (!TakePrepared_SM(apdu, smApdu)) {
+			smApdu = SM(sessENC, sessMAC, apdu, sessSSC);
+			// se la APDU apre una sequenza prevista, le successive si proteggono mentre e' sulla linea
+			StartSequence_SM(apdu);
+		}
         
 //        ODS(std::string().append("\nAPDU:").append(dumpHexData(smApdu)).append("\n").c_str());
         
@@ -850,58 +1212,110 @@ StatusWord IAS::SendAPDU_SM(ByteArray head, ByteArray data, ByteDynArray &resp,
         
 		sw = getResp_SM(curresp, sw, resp);
 
-
 		ODS(std::string().append("Clear RESP:").append(dumpHexData(resp, str)).append(HexByte(sw >> 8)).append(HexByte(sw & 0xff)).append("\n").c_str());
-		return sw;
 	}
-	else {
-		// attenzione:
-		// in alcuni casi la carta ritorna 61xx fra un comando e l'altro in chaining. Questo è un grosso problema, perchè
-		// la get response sembra che faccia saltare il chaining. Forse è una questione di driver del lettore?
-		// Per daesso l'ho osservato solo su una virtual machine Win7 con il lettore in sharing con l'host
-		
+	if (!KeepsCardState(sw))
+		cardState.Invalidate();
+	return sw;
+	exit_func
+}
 
-		size_t ds = data.size();
-		size_t i = 0;
-		uint8_t cla = head[0];
-		while (true) {
-			s = data.mid(i, min(0xE7, data.size() - i));
-			i += s.size();
-			if (i != data.size())
-				head[0] = cla | 0x10;
-			else
-				head[0] = cla;
-			if (s.size() != 0)
-				smApdu.set(&head, (BYTE)s.size(), &s, (le == nullptr || i < data.size()) ? &emptyBa : &leBa);
-			else
-				smApdu.set(&head, (le == nullptr || i < data.size()) ? &emptyBa : &leBa);
+void IAS::PlanSequence_SM(std::vector<ByteDynArray> &apdus) {
+	ClearSequence_SM();
+	smPlanned = apdus;
+}
 
-			ODS(std::string("Clear APDU:").append(dumpHexData(smApdu, str)).append("\n").c_str());
-			smApdu = SM(sessENC, sessMAC, smApdu, sessSSC);
-            
-//            ODS(std::string().append("\nAPDU:").append(dumpHexData(smApdu)).append("\n").c_str());
-            
-			sw = token.Transmit(smApdu, &curresp);
-            
-//            ODS(std::string().append("\nRESP:").append(dumpHexData(curresp)).append("\n").c_str());
-            
-			sw = getResp_SM(curresp, sw, resp);
+void IAS::StartSequence_SM(ByteArray &apdu) {
+	if (smPlanned.empty())
+		return;
+	if (smPlanned[0] != apdu || smPlanned.size() == 1) {
+		// alla carta va un comando diverso da quello previsto: la sequenza non vale piu'
+		ClearSequence_SM();
+		return;
+	}
 
-			ODS(std::string("Clear RESP:").append(dumpHexData(resp, str)).append(HexByte(sw >> 8)).append(HexByte(sw & 0xff)).append("\n").c_str());
-			if (i == data.size())
-				return sw;
+	// SSC dei comandi successivi: ogni risposta in SM e ogni comando lo incrementano di uno
+	std::vector<ByteDynArray> apdus(smPlanned.begin() + 1, smPlanned.end());
+	std::vector<ByteDynArray> sscs;
+	auto results = std::make_shared<std::vector<std::promise<ByteDynArray>>>(apdus.size());
+	ByteDynArray ssc = sessSSC;
+	for (size_t i = 0; i < apdus.size(); i++) {
+		CSMPrepared prepared;
+		prepared.apdu = apdus[i];
+		increment(ssc);
+		prepared.sscIn = ssc;
+		increment(ssc);
+		prepared.sscOut = ssc;
+		prepared.smApdu = (*results)[i].get_future();
+		sscs.push_back(prepared.sscIn);
+		smPrepared.push_back(std::move(prepared));
+	}
+	smPlanned.clear();
+
+	// il worker lavora solo su copie: il canale resta al thread che invia le APDU
+	auto stop = std::make_shared<std::atomic<bool>>(false);
+	smPipelineStop = stop;
+	ByteDynArray keyEnc = sessENC, keyMac = sessMAC;
+	smPipelineJob = std::async(std::launch::async, [apdus, sscs, keyEnc, keyMac, results, stop]() mutable {
+		CSMContext context;
+		context.Prepare(keyEnc, keyMac);
+		for (size_t i = 0; i < apdus.size() && !*stop; i++) {
+			try {
+				(*results)[i].set_value(SMWrap(context, apdus[i], sscs[i]));
+			}
+			catch (...) {
+				(*results)[i].set_exception(std::current_exception());
+				break;
+			}
 		}
+		keyEnc.fill(0);
+		keyMac.fill(0);
+		context.Prepare(keyEnc, keyMac);
+	});
+}
 
+bool IAS::TakePrepared_SM(ByteArray &apdu, ByteDynArray &smApdu) {
+	if (smPrepared.empty())
+		return false;
+	CSMPrepared &prepared = smPrepared.front();
+	// una APDU diversa da quella prevista, o una risposta arrivata senza SM (status word
+	// di errore, eccezione sulla linea) che non ha fatto avanzare l'SSC: si torna al
+	// calcolo in linea
+	if (prepared.apdu != apdu || prepared.sscIn != sessSSC) {
+		ClearSequence_SM();
+		return false;
 	}
-	exit_func
+	try {
+		smApdu = prepared.smApdu.get();
+	}
+	catch (...) {
+		ClearSequence_SM();
+		return false;
+	}
+	sessSSC = prepared.sscOut;
+	smPrepared.pop_front();
+	return true;
+}
+
+void IAS::ClearSequence_SM() {
+	smPlanned.clear();
+	if (smPipelineStop)
+		*smPipelineStop = true;
+	if (smPipelineJob.valid())
+		smPipelineJob.wait();
+	smPipelineJob = std::future<void>();
+	smPrepared.clear();
 }
 
 
-StatusWord IAS::SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, uint8_t *le) {
+StatusWord IAS::SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, DWORD *le) {
 	init_func
+	FlushSelect();
+	cardState.Sync(token.getResetCount());
 
     ByteArray emptyBa;
-    ByteArray leBa = VarToByteArray(*le);
+	uint8_t leShort = (le == nullptr) ? 0 : LOBYTE(*le);
+    ByteArray leBa = VarToByteArray(leShort);
     std::string str;
 
 	ByteDynArray apdu, curresp;
@@ -923,13 +1337,17 @@ StatusWord IAS::SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, uin
 			StatusWord sw=token.Transmit(apdu, &curresp);
 			if (i == data.size()) {
 				sw = getResp(curresp, sw, resp);
+				if (!KeepsCardState(sw))
+					cardState.Invalidate();
 
 				return sw;
 			}
 		}
 	}
 	else {
-		if (data.size()!=0)
+		if (le != nullptr && *le > 0x100)
+			setExtendedAPDU(apdu, head, data, *le);
+		else if (data.size()!=0)
 			apdu.set(&head, (BYTE)data.size(), &data, le == nullptr ? &emptyBa : &leBa);
 		else
 			apdu.set(&head, le == nullptr ? &emptyBa : &leBa);
@@ -941,6 +1359,8 @@ StatusWord IAS::SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, uin
 //        ODS(std::string().append("RESP:").append(dumpHexData(curresp)).append("\n").c_str());
         
 		sw=getResp(curresp, sw, resp);
+		if (!KeepsCardState(sw))
+			cardState.Invalidate();
 
 		return sw;
 	}
@@ -950,6 +1370,10 @@ StatusWord IAS::SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, uin
 
 void IAS::InitDHParam() {
 	init_func
+	// i parametri DH non cambiano: restano validi fra un login e l'altro o vengono dalla cache
+	if (!dh_g.isEmpty())
+		return;
+
 	ByteDynArray resp;
 
 	CASNParser parser;
@@ -992,6 +1416,7 @@ void IAS::InitDHParam() {
 	else 
 		throw logged_error("CIE non riconosciuta");
 
+	PrimeDHKeyPool();
 
 	exit_func
 }
@@ -1006,35 +1431,61 @@ CASNTag *GetTag(CASNTagArray &tags, DWORD id) {
 
 void IAS::InitExtAuthKeyParam() {
 	init_func
-	ByteDynArray resp;
-
-	uint8_t getKeyDoup[] = { 00, 0xcb, 0x3f, 0xff };
-	uint8_t getKeyDuopData[] = { 0x4d, 0x0C, 0x70, 0x0A, 0xBF, 0xA0, CIE_KEY_ExtAuth_ID & 0x7f, 0x06, 0x7F, 0x49, 0x03, 0x5F, 0x20, 0x80 };
-	StatusWord sw;
-	if ((sw = SendAPDU(VarToByteArray(getKeyDoup), VarToByteArray(getKeyDuopData), resp)) != 0x9000)
-	throw scard_error(sw);
+	// come per i parametri DH, la chiave di extauth si legge una volta sola (o viene dalla cache)
+	if (dappCertJob.valid())
+		BuildDappCert();
+	if (CA_module.isEmpty()) {
+		ByteDynArray resp;
+
+		uint8_t getKeyDoup[] = { 00, 0xcb, 0x3f, 0xff };
+		uint8_t getKeyDuopData[] = { 0x4d, 0x0C, 0x70, 0x0A, 0xBF, 0xA0, CIE_KEY_ExtAuth_ID & 0x7f, 0x06, 0x7F, 0x49, 0x03, 0x5F, 0x20, 0x80 };
+		StatusWord sw;
+		if ((sw = SendAPDU(VarToByteArray(getKeyDoup), VarToByteArray(getKeyDuopData), resp)) != 0x9000)
+		throw scard_error(sw);
 
-	CASNParser parser;
-	parser.Parse(resp);
+		CASNParser parser;
+		parser.Parse(resp);
 
-	CA_module = GetTag(parser.tags[0]->tags[0]->tags[0]->tags,0x81)->content;
-	CA_pubexp = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x82)->content;	
+		CA_module = GetTag(parser.tags[0]->tags[0]->tags[0]->tags,0x81)->content;
+		CA_pubexp = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x82)->content;	
+		CA_CHR = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x5F20)->content;
+		CA_CHA = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x5F4C)->content;
+		DappCert.clear();
+	}
 	CA_privexp = baExtAuth_PrivExp;
-	CA_CHR = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x5F20)->content;
-	CA_CHA = GetTag(parser.tags[0]->tags[0]->tags[0]->tags, 0x5F4C)->content;
 	CA_CAR = CA_CHR.mid(4);
 	CA_AID = CA_CHA.left(6);
+	StartDappCert();
 }
 
 void IAS::SetCardContext(void* pCardData) {
 	token.setTransmitCallbackData(pCardData);
+	// fra un'operazione e l'altra la carta puo' essere stata usata da altre applicazioni:
+	// lo stato resta valido solo col canale SM aperto, perche' un loro comando in chiaro
+	// lo chiuderebbe e il primo comando in SM fallirebbe, invalidandolo
+	if (!SMSessionReady)
+		cardState.Invalidate();
 }
 
 void IAS::Deauthenticate() {
 	init_func
+		CloseSMSession();
+		sessENC.fill(0);
+		sessMAC.fill(0);
+		// sovrascrive anche le key schedule espanse
+		smContext.Prepare(sessENC, sessMAC);
 		token.Reset(true);
 }
 
+void IAS::CloseSMSession() {
+	// le chiavi restano in memoria fino al prossimo DHKeyExchange, ma il canale
+	// non viene piu' riutilizzato fra un'operazione e l'altra
+	SMSessionReady = false;
+	PINVerified = false;
+	cardState.Invalidate();
+	ClearSequence_SM();
+}
+
 extern uint8_t encMod[];
 extern uint8_t encPriv[];
 extern uint8_t encPub[];
@@ -1049,16 +1500,13 @@ void IAS::InitEncKey() {
 	uint8_t mseSetData[] = { 0x80, 0x01, 0x02, 0x84, 0x01, 0x83 };
 	ByteDynArray resp;
 	StatusWord sw;
+	SetSE(VarToByteArray(mseSet), VarToByteArray(mseSetData), !sessSSC.isEmpty());
 	if (sessSSC.isEmpty()) {
-		if ((sw = SendAPDU(VarToByteArray(mseSet), VarToByteArray(mseSetData), resp)) != 0x9000)
-		throw scard_error(sw);
 		uint8_t intAuth[] = { 0x00, 0x88, 0x00, 0x00 };
 		if ((sw = SendAPDU(VarToByteArray(intAuth), ByteArray((BYTE*)strPAN.c_str(), strPAN.length()), resp)) != 0x9000)
 		throw scard_error(sw);
 	}
 	else {
-		if ((sw = SendAPDU_SM(VarToByteArray(mseSet), VarToByteArray(mseSetData), resp)) != 0x9000)
-		throw scard_error(sw);
 		uint8_t intAuth[] = { 0x00, 0x88, 0x00, 0x00 };
 		if ((sw = SendAPDU_SM(VarToByteArray(intAuth), ByteArray((BYTE*)strPAN.c_str(), strPAN.length()), resp)) != 0x9000)
 		throw scard_error(sw);
@@ -1070,6 +1518,106 @@ void IAS::InitEncKey() {
 	CardEncIv= cardSeed.mid(32).left(16);
 }
 
+#define CARD_DATA_VERSION 2
+
+bool IAS::LoadCardData() {
+	// i dati sono cifrati con la chiave ricavata dall'INTERNAL AUTHENTICATE del PAN:
+	// solo la carta che li ha scritti puo' renderli leggibili
+	init_func
+	std::string PANStr;
+	dumpHexData(PAN.mid(5, 6), PANStr, false);
+
+	std::vector<uint8_t> data;
+	if (!CacheGetCardData(PANStr.c_str(), data))
+		return false;
+	// i parametri della CA stanno per essere riscritti: il certificato in calcolo li sta leggendo
+	if (dappCertJob.valid())
+		dappCertJob.wait();
+
+	try {
+		ER_ASSERT((data.size() % AES_BLOCK_SIZE) == 0, "Dimensione dei dati della carta non valida");
+		CAES enc(CardEncKey, CardEncIv);
+		ByteDynArray clear = enc.Decode(ByteArray(data.data(), data.size()));
+		ER_ASSERT(clear.size() > SHA256_DIGEST_LENGTH, "Dimensione dei dati della carta non valida");
+
+		ByteArray content = clear.left(clear.size() - SHA256_DIGEST_LENGTH);
+		CSHA256 sha256;
+		ER_ASSERT(sha256.Digest(content) == clear.right(SHA256_DIGEST_LENGTH), "Dati della carta non validi");
+
+		CASNParser parser;
+		parser.Parse(content);
+		auto &tags = parser.tags[0]->tags;
+		ER_ASSERT(tags.size() == 12 && tags[0]->content.size() == 1 && tags[0]->content[0] == CARD_DATA_VERSION, "Versione dei dati della carta non supportata");
+
+		CardDataSOD = tags[1]->content;
+		DappModule = tags[2]->content;
+		DappPubKey = tags[3]->content;
+		dh_g = tags[4]->content;
+		dh_p = tags[5]->content;
+		dh_q = tags[6]->content;
+		CA_module = tags[7]->content;
+		CA_pubexp = tags[8]->content;
+		CA_CHR = tags[9]->content;
+		CA_CHA = tags[10]->content;
+		DappCert = tags[11]->content;
+	}
+	catch (std::exception &ex) {
+		Log.write("Dati della carta in cache scartati: %s", ex.what());
+		CacheRemoveCardData(PANStr.c_str());
+		return false;
+	}
+
+	CardDataLoaded = true;
+	PrimeDHKeyPool();
+	return true;
+	exit_func
+}
+
+void IAS::PrimeDHKeyPool() {
+	// le chiavi DH per il prossimo login si calcolano mentre l'applicazione fa altro
+	if (!CDHKeyPool::Destroyed)
+		CDHKeyPool::Instance().Prime(dh_p, dh_g, dh_q);
+}
+
+void IAS::StoreCardData(ByteArray &SOD) {
+	init_func
+	ER_ASSERT(!DappModule.isEmpty() && !DappPubKey.isEmpty() && !dh_g.isEmpty() && !CA_module.isEmpty(), "Dati della carta incompleti");
+	BuildDappCert();
+
+	CSHA256 sha256;
+	ByteDynArray sodHash = sha256.Digest(SOD);
+
+	uint8_t version = CARD_DATA_VERSION;
+	ByteArray versionBa = VarToByteArray(version);
+	ByteDynArray content;
+	content.setASN1Tag(0x30, ASN1Tag(0x02, versionBa)
+		.append(ASN1Tag(0x04, sodHash))
+		.append(ASN1Tag(0x04, DappModule))
+		.append(ASN1Tag(0x04, DappPubKey))
+		.append(ASN1Tag(0x04, dh_g))
+		.append(ASN1Tag(0x04, dh_p))
+		.append(ASN1Tag(0x04, dh_q))
+		.append(ASN1Tag(0x04, CA_module))
+		.append(ASN1Tag(0x04, CA_pubexp))
+		.append(ASN1Tag(0x04, CA_CHR))
+		.append(ASN1Tag(0x04, CA_CHA))
+		.append(ASN1Tag(0x04, DappCert)));
+
+	ByteDynArray clear = content;
+	clear.append(sha256.Digest(content));
+
+	CAES enc(CardEncKey, CardEncIv);
+	ByteDynArray encData = enc.Encode(clear);
+
+	std::string PANStr;
+	dumpHexData(PAN.mid(5, 6), PANStr, false);
+	CacheSetCardData(PANStr.c_str(), encData.data(), (int)encData.size());
+
+	CardDataSOD = sodHash;
+	CardDataLoaded = true;
+	exit_func
+}
+
 void IAS::SetCache(const char *PAN, ByteArray &certificate, ByteArray &FirstPIN) {
 	init_func
 	ByteDynArray encCert, encPIN;
@@ -1,7 +1,14 @@
 #pragma once
 #include "../PCSC/Token.h"
+#include "../Crypto/DES3.h"
+#include "../Crypto/MAC.h"
 
 #include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <future>
 
 #define DirCIE				"CIE"
 
@@ -37,30 +44,118 @@ enum CIE_RequestedSM {
 	CIE_AnySM
 };
 
+// chiavi del Secure Messaging con le key schedule 3DES gia' espanse: si prepara quando
+// cambiano le chiavi di sessione (scambio DH) e si riusa per tutte le APDU del canale
+class CSMContext
+{
+	ByteDynArray keyEnc, keyMac;
+public:
+	CDES3 enc;
+	CMAC mac;
+
+	void Prepare(ByteArray &keyEnc, ByteArray &keyMac);
+};
+
+// APDU di una sequenza nota, protetta in SM in anticipo: vale solo se al momento
+// dell'invio la APDU in chiaro e l'SSC corrente sono quelli previsti
+struct CSMPrepared
+{
+	ByteDynArray apdu;
+	// SSC prima e dopo la protezione del comando
+	ByteDynArray sscIn, sscOut;
+	std::future<ByteDynArray> smApdu;
+};
+
+// stato della carta come lo conosce il middleware: DF ed EF correnti e contenuto dei
+// template dell'ambiente di sicurezza impostati con MSE SET (compresa la chiave scelta
+// per la PSO). Permette di non ripetere SELECT e MSE che non cambierebbero niente;
+// un reset, una status word di errore o la chiusura del canale SM lo rendono sconosciuto
+class CCardState
+{
+	DWORD resetCount;
+	bool dfKnown;
+	CIE_DF df;
+	// 0 = nessun EF selezionato noto
+	uint16_t ef;
+	// P1 e dati dell'ultimo MSE SET per template (P2)
+	std::map<uint8_t, ByteDynArray> se;
+public:
+	CCardState();
+
+	void Invalidate();
+	// confronta il numero di reset della carta con quello a cui si riferisce lo stato
+	void Sync(DWORD resetCount);
+
+	bool IsDF(CIE_DF df);
+	void SetDF(CIE_DF df);
+	bool IsEF(uint16_t ef);
+	void SetEF(uint16_t ef);
+	bool IsSE(uint8_t p1, uint8_t p2, ByteArray &data);
+	void SetSE(uint8_t p1, uint8_t p2, ByteArray &data);
+};
+
 class IAS
 {
 	CIE_Type type = CIE_Type::CIE_Unknown;
 	ByteDynArray dh_g,dh_p,dh_q;
 	ByteDynArray sessENC, sessMAC, sessSSC;
+	CSMContext smContext;
+	// sequenza di APDU in SM prevista dal chiamante (READ BINARY a blocchi, MSE + PSO,
+	// comandi in chaining): mentre la prima e' sulla linea un worker protegge le successive
+	// con gli SSC che avranno se ogni risposta arriva in SM. Se una risposta rompe la
+	// progressione degli SSC la sequenza si scarta e si torna al calcolo in linea
+	std::vector<ByteDynArray> smPlanned;
+	std::deque<CSMPrepared> smPrepared;
+	std::shared_ptr<std::atomic<bool>> smPipelineStop;
+	std::future<void> smPipelineJob;
+	CCardState cardState;
+	// SELECT del DF IAS rimandata al prossimo comando: se e' la SELECT del DF CIE in cui
+	// la carta si trova gia', non serve nessuna delle due
+	bool pendingSelectIAS;
 	ByteDynArray dh_pubKey, dh_ICCpubKey;
 	ByteDynArray CA_module, CA_pubexp, CA_privexp, CA_CHR, CA_CHA, CA_CAR, CA_AID;
+	// certificato IFD firmato con la chiave della CA, presentato alla carta nella DAPP
+	ByteDynArray DappCert;
+	// calcolo del certificato avviato appena noti i parametri della CA: la firma RSA si
+	// sovrappone alle APDU che precedono la DAPP (lettura dell'EF.SOD, scambio DH)
+	std::future<ByteDynArray> dappCertJob;
 	ByteDynArray IAS_AID;
 	ByteDynArray CIE_AID;
 	ByteDynArray ATR;
 	ByteDynArray Certificate;
 	ByteDynArray CardEncKey, CardEncIv;
-	StatusWord SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, uint8_t *le = NULL);
-	StatusWord SendAPDU_SM(ByteArray head, ByteArray data, ByteDynArray &resp, uint8_t *le = NULL);
+	// hash dell'EF.SOD a cui si riferiscono i dati della carta in cache
+	ByteDynArray CardDataSOD;
+	// dimensione del blocco di READ BINARY accettata da carta e lettore (0 = non ancora verificata)
+	DWORD readChunk;
+	StatusWord SendAPDU(ByteArray head, ByteArray data, ByteDynArray &resp, DWORD *le = NULL);
+	StatusWord SendAPDU_SM(ByteArray head, ByteArray data, ByteDynArray &resp, DWORD *le = NULL);
 	StatusWord getResp(ByteDynArray &Cardresp, StatusWord sw, ByteDynArray &resp);
 	StatusWord getResp_SM(ByteArray &Cardresp, StatusWord sw, ByteDynArray &resp);
 
 	ByteDynArray SM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, ByteArray &seq);
+	static ByteDynArray SMWrap(CSMContext &context, ByteArray &apdu, ByteArray &seq);
+	// APDU in chiaro che SendAPDU_SM costruisce per un comando (piu' di una in chaining)
+	static void AppendAPDU_SM(std::vector<ByteDynArray> &apdus, ByteArray head, ByteArray data, DWORD *le = NULL);
+	void PlanSequence_SM(std::vector<ByteDynArray> &apdus);
+	void StartSequence_SM(ByteArray &apdu);
+	bool TakePrepared_SM(ByteArray &apdu, ByteDynArray &smApdu);
+	void ClearSequence_SM();
 	StatusWord respSM(ByteArray &keyEnc, ByteArray &keySig, ByteArray &apdu, ByteArray &seq, ByteDynArray &elabResp);
 
 	void readfile_SM(uint16_t id, ByteDynArray &content);
 	void readfile(uint16_t id, ByteDynArray &content);
-
-	void increment(ByteArray &seq);
+	StatusWord ProbeReadChunk(ByteArray readFile, ByteDynArray &chunk);
+	void SelectEF(uint16_t id, bool SM);
+	void SetSE(ByteArray head, ByteArray data, bool SM, DWORD *le = NULL);
+	void SelectIAS(bool SM);
+	void FlushSelect();
+
+	static void increment(ByteArray &seq);
+	void PrimeDHKeyPool();
+	ByteDynArray MakeDappCert();
+	void StartDappCert();
+	void BuildDappCert();
 	void ReadCIEType();
 
 public:
@@ -69,6 +164,9 @@ public:
 	IAS(CToken::TokenTransmitCallback transmit,ByteArray ATR);
 	~IAS();
 
+	// tipo di CIE riconosciuto dall'ATR, CIE_Unknown se l'ATR non e' di una CIE
+	static CIE_Type TypeFromATR(ByteArray &ATR);
+
 	void SetCardContext(void *);
 	void SelectAID_IAS(bool SM = false);
 	void SelectAID_CIE(bool SM = false);
@@ -88,6 +186,10 @@ public:
 	void ReadIdServizi(ByteDynArray &data);
 
 	void InitEncKey();
+	// cache su disco di chiave DAPP, parametri DH e di extauth, cifrata con CardEncKey (richiede InitEncKey)
+	bool CardDataLoaded;
+	bool LoadCardData();
+	void StoreCardData(ByteArray &SOD);
 	void InitDHParam();
 	void InitExtAuthKeyParam();
 	void DHKeyExchange();
@@ -117,6 +219,13 @@ public:
 	bool ActiveSM;
 	CIE_DF ActiveDF;
 
+	// canale SM autenticato (DH + DAPP) ancora aperto sulla carta e riutilizzabile
+	// fra piu' operazioni; CloseSMSession lo invalida
+	bool SMSessionReady;
+	// PIN utente gia' verificato nel canale SM corrente
+	bool PINVerified;
+	void CloseSMSession();
+
 	
 };
 
@@ -34,28 +34,26 @@ CK_RV CK_ENTRY CambioPIN(const char*  szCurrentPIN, const char*  szNewPIN, int*
 {
     try
     {
-        DWORD len = MAX_PATH;
-        
         SCARDCONTEXT hSC;
         
         progressCallBack(1, "Connessione alla CIE");
         
-        long nRet = SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &hSC);
+        long nRet = CSharedCardContext::get(hSC);
         if(nRet != SCARD_S_SUCCESS)
             return CKR_DEVICE_ERROR;
         
-        char readers[MAX_PATH];
-        
-        if (SCardListReaders(hSC, nullptr, (char*)&readers, &len) != SCARD_S_SUCCESS) {
+        std::string readers;
+
+        if (CSharedCardContext::listReaders(hSC, readers) != SCARD_S_SUCCESS) {
             return CKR_TOKEN_NOT_PRESENT;
         }
         
         progressCallBack(5, "Connessione all CIE eseguita");
         
-        char *curreader = readers;
+        const char *curreader = readers.c_str();
         bool foundCIE = false;
         
-        for (; curreader[0] != 0; curreader += strnlen(curreader, len) + 1)
+        for (; curreader[0] != 0; curreader += strnlen(curreader, readers.size()) + 1)
         {
             safeConnection conn(hSC, curreader, SCARD_SHARE_SHARED);
             if (!conn.hCard)
@@ -163,28 +161,26 @@ CK_RV CK_ENTRY SbloccoPIN(const char*  szPUK, const char*  szNewPIN, int* pAttem
 {
     try
     {
-        DWORD len = MAX_PATH;
-        
         SCARDCONTEXT hSC;
         
         progressCallBack(1, "Connessione alla CIE");
         
-        long nRet = SCardEstablishContext(SCARD_SCOPE_USER, nullptr, nullptr, &hSC);
+        long nRet = CSharedCardContext::get(hSC);
         if(nRet != SCARD_S_SUCCESS)
             return CKR_DEVICE_ERROR;
         
-        char readers[MAX_PATH];
-        
-        if (SCardListReaders(hSC, nullptr, (char*)&readers, &len) != SCARD_S_SUCCESS) {
+        std::string readers;
+
+        if (CSharedCardContext::listReaders(hSC, readers) != SCARD_S_SUCCESS) {
             return CKR_TOKEN_NOT_PRESENT;
         }
         
         progressCallBack(5, "Connessione all CIE eseguita");
         
-        char *curreader = readers;
+        const char *curreader = readers.c_str();
         bool foundCIE = false;
        
-        for (; curreader[0] != 0; curreader += strnlen(curreader, len) + 1)
+        for (; curreader[0] != 0; curreader += strnlen(curreader, readers.size()) + 1)
         {
             safeConnection conn(hSC, curreader, SCARD_SHARE_SHARED);
             if (!conn.hCard)
@@ -0,0 +1,167 @@
+#include "DHKeyPool.h"
+#include "../Util/util.h"
+#include <openssl/bn.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+extern CLog Log;
+
+// chiavi pronte per dominio e numero massimo di domini (uno per tipo di carta)
+const size_t DHPoolSize = 4;
+const size_t DHPoolDomains = 4;
+
+std::atomic<bool> CDHKeyPool::Destroyed(false);
+
+CDHKeyPool::CDHKeyPool() : stop(false) {
+}
+
+CDHKeyPool::~CDHKeyPool() {
+	Destroyed = true;
+	Stop();
+}
+
+void CDHKeyPool::Stop() {
+	std::thread worker;
+	{
+		std::unique_lock<std::mutex> lock(poolMutex);
+		stop = true;
+		worker = std::move(thread);
+	}
+	wake.notify_all();
+	if (worker.joinable())
+		worker.join();
+
+	std::unique_lock<std::mutex> lock(poolMutex);
+	// ~DHKey azzera le chiavi private
+	domains.clear();
+	stop = false;
+}
+
+CDHKeyPool &CDHKeyPool::Instance() {
+	static CDHKeyPool pool;
+	return pool;
+}
+
+// x casuale e g^x mod p solo con OpenSSL, senza log ne' la cache dei moduli di CRSA: il worker
+// puo' essere ancora in calcolo quando all'uscita del processo quegli oggetti sono distrutti
+static bool ComputeKey(ByteArray &p, ByteArray &g, ByteArray &q, ByteDynArray &prKey, ByteDynArray &pubKey) {
+	do {
+		prKey.resize(q.size());
+		prKey.random();
+	} while (q[0] < prKey[0]);
+
+	// la chiave privata deve essere dispari
+	prKey.right(1)[0] |= 1;
+
+	BN_CTX *ctx = BN_CTX_new();
+	BIGNUM *bnP = BN_bin2bn(p.data(), (int)p.size(), nullptr);
+	BIGNUM *bnG = BN_bin2bn(g.data(), (int)g.size(), nullptr);
+	BIGNUM *bnX = BN_bin2bn(prKey.data(), (int)prKey.size(), nullptr);
+	BIGNUM *bnY = BN_new();
+	bool ok = ctx != nullptr && bnP != nullptr && bnG != nullptr && bnX != nullptr && bnY != nullptr &&
+		BN_cmp(bnG, bnP) < 0 && BN_mod_exp_mont_consttime(bnY, bnG, bnX, bnP, ctx, nullptr);
+	if (ok) {
+		pubKey.resize(p.size());
+		pubKey.fill(0);
+		BN_bn2bin(bnY, pubKey.data() + (p.size() - BN_num_bytes(bnY)));
+	}
+	BN_clear_free(bnX);
+	BN_free(bnY);
+	BN_free(bnG);
+	BN_free(bnP);
+	BN_CTX_free(ctx);
+	return ok;
+}
+
+void CDHKeyPool::GenerateKey(ByteArray &p, ByteArray &g, ByteArray &q, ByteDynArray &prKey, ByteDynArray &pubKey) {
+	init_func
+	if (!ComputeKey(p, g, q, prKey, pubKey))
+		throw logged_error("Errore nel calcolo della chiave DH");
+	exit_func
+}
+
+CDHKeyPool::Domain *CDHKeyPool::toFill() {
+	for (auto &d : domains) {
+		if (d.second.keys.size() < DHPoolSize)
+			return &d.second;
+	}
+	return nullptr;
+}
+
+void CDHKeyPool::run() {
+#ifdef WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(__APPLE__)
+	pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#endif
+	std::unique_lock<std::mutex> lock(poolMutex);
+	while (!stop) {
+		Domain *d = toFill();
+		if (d == nullptr) {
+			wake.wait(lock);
+			continue;
+		}
+
+		// l'esponenziazione si fa senza lock: il dominio puo' sparire nel frattempo
+		ByteDynArray key = ByteDynArray(d->p).append(d->g);
+		ByteDynArray p = d->p, g = d->g, q = d->q;
+		lock.unlock();
+		DHKey k;
+		bool ok = ComputeKey(p, g, q, k.prKey, k.pubKey);
+		lock.lock();
+		if (!ok) {
+			// GetKey ricalcolera' la chiave nel thread del chiamante, che registra l'errore
+			domains.erase(key);
+			continue;
+		}
+
+		auto it = domains.find(key);
+		if (it != domains.end() && it->second.keys.size() < DHPoolSize)
+			it->second.keys.push_back(std::move(k));
+	}
+}
+
+void CDHKeyPool::Prime(ByteArray &p, ByteArray &g, ByteArray &q) {
+	init_func
+	ByteDynArray key = ByteDynArray(p).append(g);
+	{
+		std::unique_lock<std::mutex> lock(poolMutex);
+		if (domains.find(key) == domains.end()) {
+			if (domains.size() >= DHPoolDomains)
+				domains.erase(domains.begin());
+			Domain &d = domains[key];
+			d.p = p;
+			d.g = g;
+			d.q = q;
+		}
+		if (!thread.joinable() && !stop)
+			thread = std::thread(&CDHKeyPool::run, this);
+	}
+	wake.notify_one();
+	exit_func
+}
+
+void CDHKeyPool::GetKey(ByteArray &p, ByteArray &g, ByteArray &q, ByteDynArray &prKey, ByteDynArray &pubKey) {
+	init_func
+	ByteDynArray key = ByteDynArray(p).append(g);
+	bool found = false;
+	{
+		std::unique_lock<std::mutex> lock(poolMutex);
+		auto it = domains.find(key);
+		if (it != domains.end() && !it->second.keys.empty()) {
+			DHKey &k = it->second.keys.front();
+			prKey = std::move(k.prKey);
+			pubKey = std::move(k.pubKey);
+			it->second.keys.pop_front();
+			found = true;
+		}
+	}
+
+	if (!found)
+		GenerateKey(p, g, q, prKey, pubKey);
+
+	// rimpiazzo la chiave consumata
+	Prime(p, g, q);
+	exit_func
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../Util/Array.h"
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+// Pool di chiavi DH effimere (x, g^x mod p) calcolate in anticipo da un thread a bassa priorita'.
+// I parametri di dominio sono fissi per tipo di carta: Prime li registra appena noti, GetKey
+// consuma una coppia pronta e, se il pool e' vuoto, la calcola al momento.
+class CDHKeyPool
+{
+	struct DHKey {
+		ByteDynArray prKey, pubKey;
+		DHKey() {}
+		DHKey(DHKey &&src) : prKey(std::move(src.prKey)), pubKey(std::move(src.pubKey)) {}
+		~DHKey() { prKey.fill(0); }
+	};
+	struct Domain {
+		ByteDynArray p, g, q;
+		std::deque<DHKey> keys;
+	};
+	// domini per p||g
+	std::map<ByteDynArray, Domain> domains;
+
+	std::mutex poolMutex;
+	std::condition_variable wake;
+	bool stop;
+	std::thread thread;
+
+	Domain *toFill();
+	void run();
+
+public:
+	static std::atomic<bool> Destroyed;
+
+	CDHKeyPool();
+	~CDHKeyPool();
+	static CDHKeyPool &Instance();
+	// ferma il worker e cancella le chiavi pronte; il pool riparte alla prossima Prime
+	void Stop();
+
+	static void GenerateKey(ByteArray &p, ByteArray &g, ByteArray &q, ByteDynArray &prKey, ByteDynArray &pubKey);
+
+	void Prime(ByteArray &p, ByteArray &g, ByteArray &q);
+	void GetKey(ByteArray &p, ByteArray &g, ByteArray &q, ByteDynArray &prKey, ByteDynArray &pubKey);
+};
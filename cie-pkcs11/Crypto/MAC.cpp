@@ -108,26 +108,63 @@ CMAC::~CMAC(void)
 ByteDynArray CMAC::Mac(const ByteArray &data)
 {
 	init_func
-
-    ByteDynArray resp(8);
-    
-	des_cblock iv;
-    CryptoPP::memcpy_s(iv, sizeof(des_cblock), initVec, sizeof(initVec));
 
-	size_t ANSILen = ANSIPadLen(data.size());
-	if (data.size()>8) {
-		ByteDynArray baOutTmp(ANSILen - 8);
-		des_ncbc_encrypt(data.data(), baOutTmp.data(), (long)ANSILen - 8, k1, &iv, DES_ENCRYPT);
-	}
-	uint8_t dest[8];
-	DES_ede3_cbc_encrypt(data.mid(ANSILen - 8).data(), dest, (long)(data.size() - ANSILen) + 8, &k1, &k2, &k3, &iv, DES_ENCRYPT);
-	resp.copy(ByteArray(dest, 8));
-
-    return resp;
+	Begin();
+	Update(data);
+    return Final();
     
 	exit_func    
 }
 
+void CMAC::Begin()
+{
+    CryptoPP::memcpy_s(chain, sizeof(des_cblock), initVec, sizeof(initVec));
+	blockLen = 0;
+	totalLen = 0;
+}
+
+void CMAC::Update(const ByteArray &data)
+{
+	const uint8_t *src = data.data();
+	size_t len = data.size();
+	totalLen += len;
+	while (len > 0) {
+		// il blocco pieno si cifra solo quando si sa che non e' l'ultimo
+		if (blockLen == 8) {
+			for (int i = 0; i < 8; i++)
+				chain[i] ^= block[i];
+			DES_ecb_encrypt(&chain, &chain, &k1, DES_ENCRYPT);
+			blockLen = 0;
+		}
+		size_t n = (len < 8 - blockLen) ? len : 8 - blockLen;
+		memcpy(block + blockLen, src, n);
+		blockLen += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void CMAC::UpdateISOPad()
+{
+	static const uint8_t pad[8] = { 0x80, 0, 0, 0, 0, 0, 0, 0 };
+	Update(ByteArray((uint8_t*)pad, 8 - (totalLen & 7)));
+}
+
+ByteDynArray CMAC::Final()
+{
+	// come nel padding ANSI l'ultimo blocco incompleto e' completato con zeri
+	for (size_t i = blockLen; i < 8; i++)
+		block[i] = 0;
+	for (int i = 0; i < 8; i++)
+		chain[i] ^= block[i];
+	DES_ecb3_encrypt(&chain, &chain, &k1, &k2, &k3, DES_ENCRYPT);
+
+	ByteDynArray resp(8);
+	resp.copy(ByteArray(chain, 8));
+	Begin();
+    return resp;
+}
+
 CMAC::CMAC() {
 }
 #endif
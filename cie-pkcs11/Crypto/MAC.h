@@ -17,7 +17,13 @@ class CMAC
 
 #else
 	des_key_schedule k1,k2,k3;
-	des_cblock initVec;
+	des_cblock initVec;
+	// stato del calcolo incrementale: catena CBC e ultimo blocco non ancora cifrato,
+	// che va trattenuto perche' l'ultimo passo usa il 3DES
+	des_cblock chain;
+	uint8_t block[8];
+	size_t blockLen;
+	size_t totalLen;
 #endif
 public:
 	CMAC();
@@ -26,4 +32,11 @@ public:
 
 	void Init(const ByteArray &key, const ByteArray &iv);
     ByteDynArray Mac(const ByteArray &data);
+
+	// MAC retail ISO 9797-1 a blocchi: Begin, Update (anche con segmenti non allineati),
+	// UpdateISOPad per il padding del messaggio fin qui, Final
+	void Begin();
+	void Update(const ByteArray &data);
+	void UpdateISOPad();
+	ByteDynArray Final();
 };
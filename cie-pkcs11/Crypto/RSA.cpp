@@ -7,6 +7,11 @@ extern CLog Log;
 
 static char *szCompiledFile=__FILE__;
 
+CRSA::CRSA(ByteArray &mod, ByteArray &pubexp, ByteArray &privexp, ByteArray &p, ByteArray &q, ByteArray &dP, ByteArray &dQ, ByteArray &qInv)
+{
+	InitCRT(mod, pubexp, privexp, p, q, dP, dQ, qInv);
+}
+
 #ifdef WIN32
 
 class init_rsa {
@@ -23,6 +28,7 @@ public:
 
 CRSA::CRSA(ByteArray &mod, ByteArray &exp)
 {
+	isPrivate = false;
 	KeySize = mod.size();
 	ByteDynArray KeyData(sizeof(BCRYPT_RSAKEY_BLOB) + mod.size() + exp.size());
 	BCRYPT_RSAKEY_BLOB *rsaImpKey = (BCRYPT_RSAKEY_BLOB *)KeyData.data();
@@ -41,6 +47,39 @@ CRSA::CRSA(ByteArray &mod, ByteArray &exp)
 		throw logged_error("Errore nella creazione della chiave RSA");
 }
 
+void CRSA::InitCRT(ByteArray &mod, ByteArray &pubexp, ByteArray &privexp, ByteArray &p, ByteArray &q, ByteArray &dP, ByteArray &dQ, ByteArray &qInv)
+{
+	isPrivate = true;
+	KeySize = mod.size();
+	size_t primeSize = p.size();
+	// BCRYPT_RSAFULLPRIVATE_BLOB: e, n, p, q, dP, dQ, qInv, d
+	ByteDynArray KeyData(sizeof(BCRYPT_RSAKEY_BLOB) + pubexp.size() + KeySize * 2 + primeSize * 5);
+	KeyData.fill(0);
+	BCRYPT_RSAKEY_BLOB *rsaImpKey = (BCRYPT_RSAKEY_BLOB *)KeyData.data();
+	rsaImpKey->Magic = BCRYPT_RSAFULLPRIVATE_MAGIC;
+	rsaImpKey->BitLength = (ULONG)(KeySize << 3);
+	rsaImpKey->cbModulus = (ULONG)KeySize;
+	rsaImpKey->cbPublicExp = (ULONG)pubexp.size();
+	rsaImpKey->cbPrime1 = (ULONG)primeSize;
+	rsaImpKey->cbPrime2 = (ULONG)primeSize;
+
+	ByteArray blob = KeyData.mid(sizeof(BCRYPT_RSAKEY_BLOB));
+	blob.copy(pubexp); blob = blob.mid(pubexp.size());
+	blob.left(KeySize).rightcopy(mod); blob = blob.mid(KeySize);
+	blob.left(primeSize).rightcopy(p); blob = blob.mid(primeSize);
+	blob.left(primeSize).rightcopy(q); blob = blob.mid(primeSize);
+	blob.left(primeSize).rightcopy(dP); blob = blob.mid(primeSize);
+	blob.left(primeSize).rightcopy(dQ); blob = blob.mid(primeSize);
+	blob.left(primeSize).rightcopy(qInv); blob = blob.mid(primeSize);
+	blob.rightcopy(privexp);
+
+	this->key = nullptr;
+	NTSTATUS ris = BCryptImportKeyPair(algo_rsa.algo, nullptr, BCRYPT_RSAFULLPRIVATE_BLOB, &this->key, KeyData.data(), (ULONG)KeyData.size(), BCRYPT_NO_KEY_VALIDATION);
+	KeyData.fill(0);
+	if (ris != 0)
+		throw logged_error("Errore nella creazione della chiave RSA");
+}
+
 void CRSA::GenerateKey(DWORD size, ByteDynArray &module, ByteDynArray &pubexp, ByteDynArray &privexp)
 {
 	init_func
@@ -56,6 +95,19 @@ CRSA::~CRSA(void)
 ByteDynArray CRSA::RSA_PURE(ByteArray &data)
 {
 	ULONG size = 0;
+	if (isPrivate) {
+		// la decifratura senza padding e' l'operazione privata; CNG applica CRT e blinding
+		if (BCryptDecrypt(key, data.data(), (ULONG)data.size(), nullptr, nullptr, 0, nullptr, 0, &size, BCRYPT_PAD_NONE) != 0)
+			throw logged_error("Errore nella cifratura RSA");
+		ByteDynArray resp(size);
+		if (BCryptDecrypt(key, data.data(), (ULONG)data.size(), nullptr, nullptr, 0, resp.data(), (ULONG)resp.size(), &size, BCRYPT_PAD_NONE) != 0)
+			throw logged_error("Errore nella cifratura RSA");
+		resp.resize(size, true);
+		ByteDynArray padded(KeySize);
+		padded.fill(0);
+		padded.rightcopy(resp);
+		return padded;
+	}
 	if (BCryptEncrypt(key, data.data(), (ULONG)data.size(), nullptr, nullptr, 0, nullptr, 0, &size, 0) != 0)
 		throw logged_error("Errore nella cifratura RSA");
 	ByteDynArray resp(size);
@@ -69,8 +121,73 @@ ByteDynArray CRSA::RSA_PURE(ByteArray &data)
 #else
 
 #include "../Cryptopp/rsa.h"
+#include <list>
+#include <mutex>
 
 CryptoPP::RSA::PublicKey publicKey;
+
+// I moduli usati dal middleware sono pochi e ricorrono di continuo (primo DH, chiavi DAPP
+// e della CA, firmatario del SOD): il modulo convertito e il suo contesto di Montgomery
+// si preparano una volta e si condividono fra le istanze di CRSA
+struct CModContext {
+	BIGNUM *n;
+	BN_MONT_CTX *mont;
+	// il contesto di Montgomery non e' garantito thread-safe: chi lo usa tiene il lock per
+	// tutta l'esponenziazione, le istanze su moduli diversi restano indipendenti
+	std::mutex montMutex;
+
+	CModContext(ByteArray &mod) {
+		n = BN_bin2bn(mod.data(), (int)mod.size(), nullptr);
+		mont = BN_MONT_CTX_new();
+		BN_CTX *ctx = BN_CTX_new();
+		int ok = BN_MONT_CTX_set(mont, n, ctx);
+		BN_CTX_free(ctx);
+		if (!ok) {
+			BN_MONT_CTX_free(mont);
+			BN_free(n);
+			throw logged_error("Errore nella preparazione del modulo RSA");
+		}
+	}
+	~CModContext() {
+		BN_MONT_CTX_free(mont);
+		BN_free(n);
+	}
+};
+
+const size_t ModContextCacheSize = 8;
+
+class CModContextCache {
+	std::mutex cacheMutex;
+	// in testa il modulo usato piu' di recente
+	std::list<std::pair<ByteDynArray, std::shared_ptr<CModContext>>> lru;
+
+public:
+	static CModContextCache &Instance() {
+		static CModContextCache cache;
+		return cache;
+	}
+
+	std::shared_ptr<CModContext> get(ByteArray &mod) {
+		{
+			std::unique_lock<std::mutex> lock(cacheMutex);
+			for (auto it = lru.begin(); it != lru.end(); it++) {
+				if (it->first == mod) {
+					lru.splice(lru.begin(), lru, it);
+					return it->second;
+				}
+			}
+		}
+
+		// la precomputazione si fa fuori dal lock; le istanze in uso tengono vivo il contesto
+		// anche dopo che e' uscito dalla cache
+		auto ctx = std::make_shared<CModContext>(mod);
+		std::unique_lock<std::mutex> lock(cacheMutex);
+		lru.emplace_front(ByteDynArray(mod), ctx);
+		if (lru.size() > ModContextCacheSize)
+			lru.pop_back();
+		return ctx;
+	}
+};
 
 DWORD CRSA::GenerateKey(DWORD size, ByteDynArray &module, ByteDynArray &pubexp, ByteDynArray &privexp) 
 {
@@ -91,14 +208,8 @@ DWORD CRSA::GenerateKey(DWORD size, ByteDynArray &module, ByteDynArray &pubexp,
     return(-1);
 }
 
-ByteArray modulusBa;
-ByteArray exponentBa;
-
 CRSA::CRSA(ByteArray &mod,ByteArray &exp)
-{
-    modulusBa = mod;
-    exponentBa = exp;
-    
+{
 //    ByteDynArray modBa(mod.size() + 1);
 //    modBa.fill(0);
 //    modBa.rightcopy(mod);
@@ -108,25 +219,73 @@ CRSA::CRSA(ByteArray &mod,ByteArray &exp)
 //    expBa.rightcopy(exp);
     
     
+	isPrivate = false;
+	KeySize = mod.size();
+	keyPriv = nullptr;
+	modCtx = CModContextCache::Instance().get(mod);
+	exponent = BN_bin2bn(exp.data(), (int)exp.size(), nullptr);
+	// un esponente lungo puo' essere segreto (chiave DH effimera, esponente privato della CA);
+	// quelli pubblici sono corti e con la finestra costante costerebbero il doppio
+	if (BN_num_bits(exponent) > 64)
+		BN_set_flags(exponent, BN_FLG_CONSTTIME);
+}
+
+void CRSA::InitCRT(ByteArray &mod, ByteArray &pubexp, ByteArray &privexp, ByteArray &p, ByteArray &q, ByteArray &dP, ByteArray &dQ, ByteArray &qInv)
+{
+	isPrivate = true;
 	KeySize = mod.size();
+	exponent = nullptr;
 	keyPriv = RSA_new();
-	keyPriv->n = BN_bin2bn(mod.data(), (int)mod.size(), keyPriv->n);
-	keyPriv->d = BN_new(); 
-	keyPriv->e = BN_bin2bn(exp.data(), (int)exp.size(), keyPriv->e);
+	keyPriv->n = BN_bin2bn(mod.data(), (int)mod.size(), nullptr);
+	keyPriv->e = BN_bin2bn(pubexp.data(), (int)pubexp.size(), nullptr);
+	keyPriv->d = BN_bin2bn(privexp.data(), (int)privexp.size(), nullptr);
+	keyPriv->p = BN_bin2bn(p.data(), (int)p.size(), nullptr);
+	keyPriv->q = BN_bin2bn(q.data(), (int)q.size(), nullptr);
+	keyPriv->dmp1 = BN_bin2bn(dP.data(), (int)dP.size(), nullptr);
+	keyPriv->dmq1 = BN_bin2bn(dQ.data(), (int)dQ.size(), nullptr);
+	keyPriv->iqmp = BN_bin2bn(qInv.data(), (int)qInv.size(), nullptr);
+	// il blinding e' attivo di default, lo rendo esplicito
+	RSA_blinding_on(keyPriv, nullptr);
 }
 
 CRSA::~CRSA(void)
 {
 	if (keyPriv!=nullptr)
 		RSA_free(keyPriv);
+	if (exponent != nullptr)
+		BN_clear_free(exponent);
 }
 
 ByteDynArray CRSA::RSA_PURE(ByteArray &data)
 {
-    ByteDynArray resp(RSA_size(keyPriv));
-    int SignSize = RSA_public_encrypt((int)data.size(), data.data(), resp.data(), keyPriv, RSA_NO_PADDING);
+    if (isPrivate) {
+        // con p, q, dP, dQ, qInv OpenSSL usa il CRT
+        ByteDynArray resp(RSA_size(keyPriv));
+        int SignSize = RSA_private_encrypt((int)data.size(), data.data(), resp.data(), keyPriv, RSA_NO_PADDING);
+        ER_ASSERT(SignSize == KeySize, "Errore nella lunghezza dei dati per operazione RSA")
+        return resp;
+    }
+
+    ER_ASSERT(data.size() <= KeySize, "Errore nella lunghezza dei dati per operazione RSA")
+    BN_CTX *ctx = BN_CTX_new();
+    BN_CTX_start(ctx);
+    BIGNUM *in = BN_bin2bn(data.data(), (int)data.size(), BN_CTX_get(ctx));
+    BIGNUM *out = BN_CTX_get(ctx);
+    bool ok = BN_cmp(in, modCtx->n) < 0;
+    if (ok) {
+        std::unique_lock<std::mutex> lock(modCtx->montMutex);
+        ok = BN_mod_exp_mont(out, in, exponent, modCtx->n, ctx, modCtx->mont) != 0;
+    }
+
+    ByteDynArray resp(KeySize);
+    resp.fill(0);
+    if (ok)
+        BN_bn2bin(out, resp.data() + (KeySize - BN_num_bytes(out)));
+    BN_clear(out);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
 
-    ER_ASSERT(SignSize == KeySize, "Errore nella lunghezza dei dati per operazione RSA")
+    ER_ASSERT(ok, "Errore nella lunghezza dei dati per operazione RSA")
 
 //    printf("\nRSA resp1: %s\n", dumpHexData(resp).c_str());  // DEBUG
     
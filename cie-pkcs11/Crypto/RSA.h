@@ -7,6 +7,7 @@
 #endif
 #include "../PKCS11/wintypes.h"
 #include "../Util/Array.h"
+#include <memory>
 
 class CRSA
 {
@@ -16,10 +17,18 @@ class CRSA
 #else
 	RSA* keyPriv;
     DWORD GenerateKey(DWORD size, ByteDynArray &module, ByteDynArray &pubexp, ByteDynArray &privexp);
+	// operazione pubblica: contesto di Montgomery condiviso per modulo ed esponente gia' convertito
+	std::shared_ptr<struct CModContext> modCtx;
+	BIGNUM *exponent;
 #endif
+	bool isPrivate;
+
+	void InitCRT(ByteArray &mod, ByteArray &pubexp, ByteArray &privexp, ByteArray &p, ByteArray &q, ByteArray &dP, ByteArray &dQ, ByteArray &qInv);
 
 public:
 	CRSA(ByteArray &mod, ByteArray &exp);
+	// chiave privata completa: RSA_PURE usa il teorema cinese del resto, con blinding
+	CRSA(ByteArray &mod, ByteArray &pubexp, ByteArray &privexp, ByteArray &p, ByteArray &q, ByteArray &dP, ByteArray &dQ, ByteArray &qInv);
 	~CRSA(void);
 
 	ByteDynArray RSA_PURE(ByteArray &data);
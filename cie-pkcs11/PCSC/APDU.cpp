@@ -16,21 +16,27 @@ APDU::APDU(BYTE CLA,BYTE INS,BYTE P1,BYTE P2,BYTE LC,BYTE *pData,BYTE LE)  {
 	init_func
 	if (LC>250) throw;
 	btINS=INS;btCLA=CLA;btP1=P1;btP2=P2;btLC=LC;pbtData=pData;btLE=LE;
-	bLC=true;bLE=true;
+	bLC=true;bLE=true;bExtended=false;
 	exit_func
 }
 APDU::APDU(BYTE CLA,BYTE INS,BYTE P1,BYTE P2,BYTE LC,BYTE *pData)   {
 	if (LC>251) throw;
 	btINS=INS;btCLA=CLA;btP1=P1;btP2=P2;btLC=LC;pbtData=pData;btLE=0;
-	bLC=true;bLE=false;
+	bLC=true;bLE=false;bExtended=false;
 }
 APDU::APDU(BYTE CLA,BYTE INS,BYTE P1,BYTE P2,BYTE LE)   {
 	btINS=INS;btCLA=CLA;btP1=P1;btP2=P2;btLE=LE;btLC=0;
-	bLC=false;bLE=true;
+	bLC=false;bLE=true;bExtended=false;
 }
 APDU::APDU(BYTE CLA,BYTE INS,BYTE P1,BYTE P2)   {
 	btINS=INS;btCLA=CLA;btP1=P1;btP2=P2;btLE=0;btLC=0;
-	bLC=false;bLE=false;
+	bLC=false;bLE=false;bExtended=false;
+}
+APDU::APDU(BYTE CLA,BYTE INS,BYTE P1,BYTE P2,WORD LC,BYTE *pData,DWORD LE,bool extended)   {
+	if (LE>65536) throw;
+	btINS=INS;btCLA=CLA;btP1=P1;btP2=P2;btLC=0;btLE=0;
+	wLC=LC;pbtData=pData;dwLE=LE;
+	bLC=(LC!=0);bLE=(LE!=0);bExtended=extended;
 }
 
 APDU::~APDU()
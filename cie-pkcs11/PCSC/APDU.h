@@ -10,6 +10,7 @@ public:
 	APDU(uint8_t CLA,uint8_t INS,uint8_t P1,uint8_t P2,uint8_t LC,uint8_t *pData);
 	APDU(uint8_t CLA,uint8_t INS,uint8_t P1,uint8_t P2,uint8_t LE);
 	APDU(uint8_t CLA,uint8_t INS,uint8_t P1,uint8_t P2);
+	APDU(uint8_t CLA,uint8_t INS,uint8_t P1,uint8_t P2,WORD LC,uint8_t *pData,DWORD LE,bool extended);
 	~APDU();
 
 	uint8_t btINS;	//INS dell'APDU
@@ -21,4 +22,7 @@ public:
 	uint8_t *pbtData;	//campo dati dell'APDU
 	uint8_t btLE;	//flag: LE  da includere? (caso 2 e 4)
 	bool bLE;	//LE dell'APDU
+	bool bExtended;	//flag: Lc e Le in forma estesa (su due byte)
+	WORD wLC;	//LC dell'APDU in forma estesa
+	DWORD dwLE;	//LE dell'APDU in forma estesa (65536 = 0000)
 };
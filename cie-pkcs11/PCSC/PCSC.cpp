@@ -58,18 +58,28 @@ safeTransaction::~safeTransaction() {
 
 safeConnection::safeConnection(SCARDHANDLE hCard) {
 	this->hCard = hCard;
+	dwDisposition = SCARD_RESET_CARD;
+	bOwned = false;
 }
 
 safeConnection::safeConnection(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode) {
 	DWORD dwProtocol;
 	this->hContext = hContext;
+	dwDisposition = SCARD_RESET_CARD;
+	bOwned = true;
 	if (SCardConnect(hContext, szReader, dwShareMode, SCARD_PROTOCOL_T1, &hCard, &dwProtocol) != SCARD_S_SUCCESS)
 		hCard = NULL;
 }
 
 safeConnection::~safeConnection() {
 	if (hCard) {
-		SCardDisconnect(hCard, SCARD_RESET_CARD);
+		if (bOwned)
+			SCardDisconnect(hCard, dwDisposition);
+		else if (dwDisposition != SCARD_LEAVE_CARD) {
+			// la connessione dello slot resta aperta: resetto la carta sullo stesso handle
+			DWORD dwProtocol;
+			SCardReconnect(hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, dwDisposition, &dwProtocol);
+		}
 	}
 }
 safeConnection::operator SCARDHANDLE() {
@@ -16,6 +16,9 @@ class safeConnection {
 public:
 	SCARDCONTEXT hContext;
 	SCARDHANDLE hCard;
+	DWORD dwDisposition; // disposizione della carta alla disconnessione (default: reset)
+	bool bOwned;		 // false: la connessione e' dello slot e resta aperta, la disposizione
+						 // si applica con una SCardReconnect sullo stesso handle
 	safeConnection(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode);
 	safeConnection(SCARDHANDLE hCard);
 	~safeConnection();
@@ -9,10 +9,14 @@ extern CLog Log;
 
 static char *szCompiledFile=__FILE__;
 
+// risposta massima di un'APDU in forma estesa: 65536 byte di dati + SW
+#define EXT_RESP_SIZE 0x10002
+
 CToken::CToken()
 {
 	transmitCallback=NULL;
 	transmitCallbackData=NULL;
+	resetCount=0;
 }
 
 CToken::~CToken()
@@ -25,6 +29,7 @@ void CToken::Reset(bool unpower) {
 	ER_ASSERT(transmitCallback!=nullptr, "Carta non Connessa")
 
 	WORD reset = unpower ? 0xfffe : 0xffff;
+	resetCount++;
 	StatusWord sw;
 	if ((sw = Transmit(VarToByteArray(reset), NULL)) != 0x9000)
         printf("transmit error: %x", sw);
@@ -61,8 +66,17 @@ ByteDynArray CToken::BinaryRead(WORD start,BYTE size) {
 StatusWord CToken::Transmit(ByteArray apdu, ByteDynArray *resp)
 {
 	init_func
-	BYTE pbtResp[3000];
+	BYTE pbtShortResp[3000];
+	BYTE *pbtResp = pbtShortResp;
 	DWORD dwResp = 3000;
+
+	// un'APDU in forma estesa (Lc o Le preceduti da 00) puo' avere una risposta piu' lunga
+	std::vector<BYTE> extResp;
+	if (apdu.size() > 5 && apdu[4] == 0) {
+		extResp.resize(EXT_RESP_SIZE);
+		pbtResp = extResp.data();
+		dwResp = EXT_RESP_SIZE;
+	}
 	HRESULT res = transmitCallback(transmitCallbackData, apdu.data(), apdu.size(), pbtResp, &dwResp);
 	ByteArray scResp(pbtResp, dwResp);
 
@@ -87,6 +101,19 @@ StatusWord CToken::Transmit(APDU &apdu, ByteDynArray *resp)
 	BYTE pbtResp[3000];
 
 	ByteDynArray baSMData;
+
+	if (apdu.bExtended) {
+		// forma estesa: 00 Lc(2) dati Le(2)
+		uint8_t head[] = { apdu.btCLA, apdu.btINS, apdu.btP1, apdu.btP2, 0x00 };
+		ByteDynArray extAPDU(VarToByteArray(head));
+		if (apdu.bLC) {
+			extAPDU.push(HIBYTE(apdu.wLC)).push(LOBYTE(apdu.wLC));
+			extAPDU.append(ByteArray(apdu.pbtData, apdu.wLC));
+		}
+		if (apdu.bLE)
+			extAPDU.push(HIBYTE(apdu.dwLE)).push(LOBYTE(apdu.dwLE));
+		return Transmit(extAPDU, resp);
+	}
 	
 	int iAPDUSize = 0;
 	pbtAPDU[0] = apdu.btCLA;
@@ -146,3 +173,8 @@ void *CToken::getTransmitCallbackData()
 {
 	return transmitCallbackData;
 }
+
+DWORD CToken::getResetCount()
+{
+	return resetCount;
+}
@@ -26,6 +26,9 @@ public:
 private:
 	TokenTransmitCallback transmitCallback;
 	void *transmitCallbackData;
+	// numero di reset inviati alla carta: chi tiene traccia del suo stato lo confronta
+	// per accorgersi che e' tornata allo stato iniziale
+	DWORD resetCount;
 public:
 	CToken();
 	~CToken();
@@ -37,6 +40,7 @@ public:
 	void setTransmitCallback(TokenTransmitCallback func,void *data);
 	void setTransmitCallbackData(void *data);
 	void* getTransmitCallbackData();
+	DWORD getResetCount();
 	StatusWord Transmit(APDU &apdu, ByteDynArray *resp);
 	StatusWord Transmit(ByteArray apdu, ByteDynArray *resp);
 };
@@ -126,15 +126,20 @@ void CIEtemplateInitSession(void *pTemplateData){
 		cie->slot.Connect();
 		{
 			safeConnection faseConn(cie->slot.hCard);
+			// solo letture di dati pubblici: nessuno stato di sicurezza da annullare
+			faseConn.dwDisposition = SCARD_LEAVE_CARD;
 			CCardLocker lockCard(cie->slot.hCard);
 			cie->ias.SetCardContext(&cie->slot);
 			cie->ias.SelectAID_IAS();
 			cie->ias.ReadPAN();
 			
-			ByteDynArray resp;
 			cie->ias.SelectAID_CIE();
-			cie->ias.ReadDappPubKey(resp);
 			cie->ias.InitEncKey();
+			// la chiave DAPP serve solo al login: se la carta e' gia' nota la prendo dalla cache
+			if (!cie->ias.LoadCardData()) {
+				ByteDynArray resp;
+				cie->ias.ReadDappPubKey(resp);
+			}
 			cie->ias.GetCertificate(certRaw, true);
 		}
 
@@ -297,11 +302,17 @@ bool CIEtemplateMatchCard(CSlot &pSlot){
 	init_func
 	CToken token;
 
+	// un ATR che non e' di una CIE scarta la carta senza collegarsi: il rifiuto e' definitivo
+	// e GetTemplate lo ricorda per quell'ATR
+	ByteArray ATR;
+	pSlot.GetATR(ATR);
+	if (IAS::TypeFromATR(ATR) == CIE_Type::CIE_Unknown)
+		return false;
+
 	pSlot.Connect();
 	{
 		safeConnection faseConn(pSlot.hCard);
-		ByteArray ATR;
-		pSlot.GetATR(ATR);
+		faseConn.dwDisposition = SCARD_LEAVE_CARD;
 		token.setTransmitCallback((CToken::TokenTransmitCallback)TokenTransmitCallback, &pSlot);
 		IAS ias((CToken::TokenTransmitCallback)TokenTransmitCallback, ATR);
 		ias.SetCardContext(&pSlot);
@@ -321,6 +332,7 @@ ByteDynArray  CIEtemplateGetSerial(CSlot &pSlot) {
 	pSlot.Connect();
 	{
 		safeConnection faseConn(pSlot.hCard);
+		faseConn.dwDisposition = SCARD_LEAVE_CARD;
 		CCardLocker lockCard(pSlot.hCard);
 		ByteArray ATR;
 		pSlot.GetATR(ATR);
@@ -354,6 +366,10 @@ void CIEtemplateLogin(void *pTemplateData, CK_USER_TYPE userType, ByteArray &Pin
 	{
 		safeConnection safeConn(cie->slot.hCard);
 		CCardLocker lockCard(cie->slot.hCard);
+		auto closeSM = scopeExit([&]() noexcept {
+			if (safeConn.dwDisposition != SCARD_LEAVE_CARD)
+				cie->ias.CloseSMSession();
+		});
 
 		cie->ias.SelectAID_IAS();
 		cie->ias.SelectAID_CIE();
@@ -365,6 +381,18 @@ void CIEtemplateLogin(void *pTemplateData, CK_USER_TYPE userType, ByteArray &Pin
 		}
 
 		cie->ias.InitExtAuthKeyParam();
+
+		if (!cie->ias.CardDataLoaded) {
+			// prima sessione con questa carta: salvo chiave DAPP, parametri DH e di extauth per le successive
+			try {
+				ByteDynArray SOD;
+				cie->ias.ReadSOD(SOD);
+				cie->ias.StoreCardData(SOD);
+			}
+			catch (std::exception &ex) {
+				Log.write("Impossibile salvare i dati della carta: %s", ex.what());
+			}
+		}
 		// faccio lo scambio di chiavi DH	
 		if (cie->ias.Callback != nullptr)
 			cie->ias.Callback(1, "DiffieHellman", cie->ias.CallbackData);
@@ -409,40 +437,182 @@ void CIEtemplateLogin(void *pTemplateData, CK_USER_TYPE userType, ByteArray &Pin
         
 		cie->SessionPIN = cie->aesKey.Encode(Pin);
 		cie->userType = userType;
+
+		// il canale SM con il PIN verificato resta aperto per le firme successive
+		if (userType == CKU_USER)
+			safeConn.dwDisposition = SCARD_LEAVE_CARD;
 	}
 }
 void CIEtemplateLogout(void *pTemplateData, CK_USER_TYPE userType){
 	CIEData* cie = (CIEData*)pTemplateData;
+	if (cie->ias.SMSessionReady) {
+		// chiudo il canale SM e lo stato di PIN verificato sulla carta
+		// (la disconnessione con reset annulla lo stato di sicurezza)
+		cie->ias.CloseSMSession();
+		try {
+			cie->slot.Connect();
+			safeConnection safeConn(cie->slot.hCard);
+		}
+		catch (...) {}
+	}
 	cie->userType = -1;
 	cie->SessionPIN.clear();
 }
 void CIEtemplateReadObjectAttributes(void *pCardTemplateData, CP11Object *pObject){
 }
+// apre il canale SM (DH + DAPP) e verifica il PIN utente della sessione; va chiamata
+// con la carta appena resettata e bloccata. Il canale resta aperto per le firme successive
+static void CIEVerifySessionPIN(CIEData *cie) {
+	ByteDynArray Pin = cie->aesKey.Decode(cie->SessionPIN);
+	cie->ias.SelectAID_IAS();
+	cie->ias.SelectAID_CIE();
+	cie->ias.DHKeyExchange();
+	cie->ias.DAPP();
+
+	ByteDynArray FullPIN;
+	cie->ias.GetFirstPIN(FullPIN);
+	FullPIN.append(Pin);
+	if (cie->ias.VerifyPIN(FullPIN) != 0x9000)
+		throw p11_error(CKR_PIN_INCORRECT);
+}
+
+// da chiamare in un catch dopo un errore sul canale SM gia' aperto: vero se il canale non
+// c'e' piu' e va ricostruito con una nuova autenticazione. Succede se un'altra applicazione
+// ha resettato la carta, o se IAS lo ha chiuso per un MAC errato nella risposta o per le
+// status word 6987/6988 (chiavi di sessione sconosciute alla carta). Gli altri errori
+// (dati, chiave, PIN bloccato) non si risolvono ripetendo l'autenticazione
+static bool SMChannelLost(CIEData *cie) {
+	try {
+		throw;
+	}
+	catch (windows_error &err) {
+		return err.getErrorCode() == SCARD_W_RESET_CARD;
+	}
+	catch (...) {
+		return !cie->ias.SMSessionReady;
+	}
+}
+
 void CIEtemplateSign(void *pCardTemplateData, CP11PrivateKey *pPrivKey, ByteArray &baSignBuffer, ByteDynArray &baSignature, CK_MECHANISM_TYPE mechanism, bool bSilent){
 	init_func
 	CToken token;
 	CIEData* cie = (CIEData*)pCardTemplateData;
 	if (cie->userType == CKU_USER) {
-		ByteDynArray Pin;
+		if (cie->ias.SMSessionReady && cie->ias.PINVerified) {
+			// il canale SM aperto al login (o alla firma precedente) e' ancora valido:
+			// basta MSE SET + PSO
+			try {
+				cie->slot.Connect();
+				cie->ias.SetCardContext(&cie->slot);
+				safeConnection safeConn(cie->slot.hCard);
+				CCardLocker lockCard(cie->slot.hCard);
+				try {
+					cie->ias.Sign(baSignBuffer, baSignature);
+				}
+				catch (...) {
+					// un errore che non ha chiuso il canale (dati, chiave) lo lascia aperto
+					if (cie->ias.SMSessionReady)
+						safeConn.dwDisposition = SCARD_LEAVE_CARD;
+					throw;
+				}
+				safeConn.dwDisposition = SCARD_LEAVE_CARD;
+				return;
+			}
+			catch (...) {
+				if (!SMChannelLost(cie))
+					throw;
+				// la carta e' stata resettata da un'altra applicazione o il canale SM
+				// e' in errore: lo ricostruisco da capo
+				Log.write("Canale SM non piu' valido, ripeto l'autenticazione");
+				cie->ias.CloseSMSession();
+			}
+		}
+
 		cie->slot.Connect();
 		cie->ias.SetCardContext(&cie->slot);
 		cie->ias.token.Reset();
 		{
 			safeConnection safeConn(cie->slot.hCard);
-			CCardLocker lockCard(cie->slot.hCard);
+			CCardLocker lockCard(cie->slot.hCard);
+			auto closeSM = scopeExit([&]() noexcept {
+				if (safeConn.dwDisposition != SCARD_LEAVE_CARD)
+					cie->ias.CloseSMSession();
+			});
             
-			Pin = cie->aesKey.Decode(cie->SessionPIN);
-			cie->ias.SelectAID_IAS();
-			cie->ias.SelectAID_CIE();
-			cie->ias.DHKeyExchange();
-			cie->ias.DAPP();
-
-			ByteDynArray FullPIN;
-			cie->ias.GetFirstPIN(FullPIN);
-			FullPIN.append(Pin);
-			if (cie->ias.VerifyPIN(FullPIN) != 0x9000)
-				throw p11_error(CKR_PIN_INCORRECT);
+			CIEVerifySessionPIN(cie);
 			cie->ias.Sign(baSignBuffer, baSignature);
+			safeConn.dwDisposition = SCARD_LEAVE_CARD;
+		}
+	}
+}
+
+void CIEtemplateSignBatch(void *pCardTemplateData, CP11PrivateKey *pPrivKey, std::vector<ByteDynArray> &baSignBuffers, std::vector<ByteDynArray> &baSignatures, std::vector<CK_RV> &results, CK_MECHANISM_TYPE mechanism, bool bSilent) {
+	init_func
+	CIEData* cie = (CIEData*)pCardTemplateData;
+	if (cie->userType != CKU_USER)
+		throw p11_error(CKR_USER_NOT_LOGGED_IN);
+
+	// una sola autenticazione per tutto il lotto: il canale SM resta aperto fra una firma
+	// e l'altra e si ricostruisce, al piu' una volta, solo se la carta lo chiude
+	size_t next = 0;
+	bool reauthenticated = false;
+	while (next < baSignBuffers.size()) {
+		bool authenticate = !(cie->ias.SMSessionReady && cie->ias.PINVerified);
+		// vero quando l'errore arriva da un canale SM gia' aperto
+		bool channelOpen = false;
+		try {
+			cie->slot.Connect();
+			cie->ias.SetCardContext(&cie->slot);
+			if (authenticate)
+				cie->ias.token.Reset();
+			safeConnection safeConn(cie->slot.hCard);
+			CCardLocker lockCard(cie->slot.hCard);
+			auto closeSM = scopeExit([&]() noexcept {
+				if (safeConn.dwDisposition != SCARD_LEAVE_CARD)
+					cie->ias.CloseSMSession();
+			});
+
+			if (authenticate)
+				CIEVerifySessionPIN(cie);
+			channelOpen = true;
+			for (; next < baSignBuffers.size(); next++) {
+				try {
+					cie->ias.Sign(baSignBuffers[next], baSignatures[next]);
+					results[next] = CKR_OK;
+				}
+				catch (std::exception &ex) {
+					if (SMChannelLost(cie))
+						throw;
+					// errore sul singolo dato: il canale e' ancora buono per i successivi
+					Log.write("Errore nella firma %i del lotto: %s", (int)next, ex.what());
+					results[next] = CKR_DEVICE_ERROR;
+				}
+			}
+			safeConn.dwDisposition = SCARD_LEAVE_CARD;
+		}
+		catch (...) {
+			if (channelOpen && !reauthenticated && SMChannelLost(cie)) {
+				Log.write("Canale SM non piu' valido, ripeto l'autenticazione");
+				cie->ias.CloseSMSession();
+				reauthenticated = true;
+				continue;
+			}
+			// autenticazione fallita o canale perso una seconda volta: le firme gia' fatte
+			// restano valide, l'elemento corrente e i successivi falliscono
+			CK_RV rv = CKR_DEVICE_ERROR;
+			try {
+				throw;
+			}
+			catch (p11_error &err) {
+				rv = err.getP11ErrorCode();
+			}
+			catch (std::exception &ex) {
+				Log.write("Firma del lotto interrotta all'elemento %i: %s", (int)next, ex.what());
+			}
+			catch (...) {}
+			cie->ias.CloseSMSession();
+			for (; next < baSignBuffers.size(); next++)
+				results[next] = rv;
 		}
 	}
 }
@@ -459,7 +629,8 @@ void CIEtemplateInitPIN(void *pCardTemplateData, ByteArray &baPin){
 		cie->ias.token.Reset();
 		{
 			safeConnection safeConn(cie->slot.hCard);
-			CCardLocker lockCard(cie->slot.hCard);
+			CCardLocker lockCard(cie->slot.hCard);
+			auto closeSM = scopeExit([&]() noexcept { cie->ias.CloseSMSession(); });
             
 			Pin = cie->aesKey.Decode(cie->SessionPIN);
 			cie->ias.SelectAID_IAS();
@@ -499,6 +670,7 @@ void CIEtemplateSetPIN(void *pCardTemplateData, ByteArray &baOldPin, ByteArray &
 		{
 			safeConnection safeConn(cie->slot.hCard);
 			CCardLocker lockCard(cie->slot.hCard);
+			auto closeSM = scopeExit([&]() noexcept { cie->ias.CloseSMSession(); });
 			cie->ias.SelectAID_IAS();
 			if (cie->userType != CKU_USER)
 				cie->ias.InitDHParam();
@@ -18,6 +18,7 @@ void CIEtemplateLogin(void *pTemplateData, CK_USER_TYPE userType, ByteArray &Pin
 void CIEtemplateLogout(void *pTemplateData, CK_USER_TYPE userType);
 void CIEtemplateReadObjectAttributes(void *pCardTemplateData, CP11Object *pObject);
 void CIEtemplateSign(void *pCardTemplateData, CP11PrivateKey *pPrivKey, ByteArray &baSignBuffer, ByteDynArray &baSignature, CK_MECHANISM_TYPE mechanism, bool bSilent);
+void CIEtemplateSignBatch(void *pCardTemplateData, CP11PrivateKey *pPrivKey, std::vector<ByteDynArray> &baSignBuffers, std::vector<ByteDynArray> &baSignatures, std::vector<CK_RV> &results, CK_MECHANISM_TYPE mechanism, bool bSilent);
 void CIEtemplateSignRecover(void *pCardTemplateData, CP11PrivateKey *pPrivKey, ByteArray &baSignBuffer, ByteDynArray &baSignature, CK_MECHANISM_TYPE mechanism, bool bSilent);
 void CIEtemplateDecrypt(void *pCardTemplateData, CP11PrivateKey *pPrivKey, ByteArray &baEncryptedData, ByteDynArray &baData, CK_MECHANISM_TYPE mechanism, bool bSilent);
 void CIEtemplateGenerateRandom(void *pCardTemplateData, ByteArray &baRandomData);
@@ -70,3 +70,56 @@ void CCardContext::renew() {
 	getContext();
 
 }
+
+std::mutex CSharedCardContext::contextMutex;
+SCARDCONTEXT CSharedCardContext::hSharedContext = NULL;
+
+LONG CSharedCardContext::get(SCARDCONTEXT &hContext) {
+	std::unique_lock<std::mutex> lock(contextMutex);
+	if (hSharedContext == NULL) {
+		LONG ris = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hSharedContext);
+		if (ris != SCARD_S_SUCCESS) {
+			hSharedContext = NULL;
+			return ris;
+		}
+	}
+	hContext = hSharedContext;
+	return SCARD_S_SUCCESS;
+}
+
+bool CSharedCardContext::failed(SCARDCONTEXT hContext, LONG ris) {
+	if (ris != SCARD_E_INVALID_HANDLE && ris != ERROR_INVALID_HANDLE &&
+		ris != SCARD_E_SERVICE_STOPPED && ris != SCARD_E_NO_SERVICE)
+		return false;
+
+	std::unique_lock<std::mutex> lock(contextMutex);
+	// un altro thread puo' averlo gia' ricreato
+	if (hSharedContext == hContext) {
+		Log.write("Context PC/SC non piu' valido - %08X", ris);
+		SCardReleaseContext(hSharedContext);
+		hSharedContext = NULL;
+	}
+	return true;
+}
+
+LONG CSharedCardContext::listReaders(SCARDCONTEXT &hContext, std::string &readers) {
+	LONG ris = SCARD_S_SUCCESS;
+	for (int i = 0; i < 3; i++) {
+		DWORD len = 0;
+		ris = SCardListReaders(hContext, NULL, NULL, &len);
+		if (ris == SCARD_S_SUCCESS) {
+			// un carattere in piu' garantisce il doppio zero finale
+			readers.assign(len + 1, 0);
+			ris = SCardListReaders(hContext, NULL, &readers[0], &len);
+			if (ris == SCARD_S_SUCCESS)
+				return ris;
+			// lettore aggiunto fra le due chiamate: ripeto
+			if (ris == SCARD_E_INSUFFICIENT_BUFFER)
+				continue;
+		}
+		if (!failed(hContext, ris) || get(hContext) != SCARD_S_SUCCESS)
+			break;
+	}
+	readers.clear();
+	return ris;
+}
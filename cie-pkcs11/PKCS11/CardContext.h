@@ -1,6 +1,8 @@
 #pragma once
 
 #include <PCSC/winscard.h>
+#include <mutex>
+#include <string>
 
 class CCardContext
 {
@@ -18,3 +20,23 @@ private:
 	void getContext();
 
 };
+
+// context PC/SC condiviso da tutto il processo per le operazioni brevi (elenco dei lettori,
+// funzioni di abilitazione e gestione PIN). Si stabilisce alla prima richiesta e si ricrea
+// solo quando una chiamata fallisce con un errore di context, senza SCardIsValidContext
+// ad ogni uso. Chi resta bloccato in SCardGetStatusChange (monitor degli eventi) e gli slot,
+// che fanno I/O in parallelo, mantengono un context proprio: pcsc-lite serializza le
+// chiamate sullo stesso context
+class CSharedCardContext
+{
+public:
+	static LONG get(SCARDCONTEXT &hContext);
+	// scarta hContext se ris e' un errore di context; restituisce true se va ritentato
+	static bool failed(SCARDCONTEXT hContext, LONG ris);
+	// multi-stringa dei lettori; hContext e' aggiornato se il context e' stato ricreato
+	static LONG listReaders(SCARDCONTEXT &hContext, std::string &readers);
+
+private:
+	static std::mutex contextMutex;
+	static SCARDCONTEXT hSharedContext;
+};
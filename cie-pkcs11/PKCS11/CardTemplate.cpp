@@ -19,6 +19,8 @@ namespace p11 {
 
 static const char *szTemplateFuncListName = "TemplateGetFunctionList";
 TemplateVector CCardTemplate::g_mCardTemplates;
+std::map<std::string, std::string> CCardTemplate::g_mATRMatchCache;
+std::mutex CCardTemplate::matchCacheMutex;
 
 CCardTemplate::CCardTemplate(void)
 {
@@ -64,6 +66,7 @@ void CCardTemplate::InitTemplateList()
 	pTemplate->FunctionList.templateLogout = CIEtemplateLogout;
 	pTemplate->FunctionList.templateReadObjectAttributes = CIEtemplateReadObjectAttributes;
 	pTemplate->FunctionList.templateSign = CIEtemplateSign;
+	pTemplate->FunctionList.templateSignBatch = CIEtemplateSignBatch;
 	pTemplate->FunctionList.templateSignRecover = CIEtemplateSignRecover;
 	pTemplate->FunctionList.templateDecrypt = CIEtemplateDecrypt;
 	pTemplate->FunctionList.templateGenerateRandom = CIEtemplateGenerateRandom;
@@ -81,17 +84,69 @@ void CCardTemplate::InitTemplateList()
 	AddTemplate(std::move(pTemplate));
 }
 
+void CCardTemplate::SetATRMatch(const std::string &atrKey, const std::string &templateName)
+{
+	std::unique_lock<std::mutex> lock(matchCacheMutex);
+	g_mATRMatchCache[atrKey] = templateName;
+}
+
 std::shared_ptr<CCardTemplate> CCardTemplate::GetTemplate(CSlot &pSlot)
 {
 	init_func
+	// una carta con un ATR gi scartato da tutti i template (carte bancarie, tessere
+	// sanitarie...) si rifiuta senza mandare APDU; per un ATR gi riconosciuto provo solo
+	// il template corrispondente, che fa comunque il suo controllo sulla carta
+	ByteArray ATR;
+	pSlot.GetATR(ATR);
+	std::string atrKey((char*)ATR.data(), ATR.size());
+	if (!atrKey.empty()) {
+		bool bCached = false;
+		std::string cachedName;
+		{
+			std::unique_lock<std::mutex> lock(matchCacheMutex);
+			auto it = g_mATRMatchCache.find(atrKey);
+			if (it != g_mATRMatchCache.end()) {
+				bCached = true;
+				cachedName = it->second;
+			}
+		}
+		if (bCached) {
+			if (cachedName.empty())
+				return nullptr;
+			for (DWORD i = 0; i < g_mCardTemplates.size(); i++) {
+				if (g_mCardTemplates[i]->szName != cachedName)
+					continue;
+				try {
+					if (g_mCardTemplates[i]->FunctionList.templateMatchCard(pSlot))
+						return g_mCardTemplates[i];
+				}
+				catch (...) {}
+			}
+			// l'ATR da solo non basta: rifaccio la ricerca completa
+			std::unique_lock<std::mutex> lock(matchCacheMutex);
+			g_mATRMatchCache.erase(atrKey);
+		}
+	}
+
+	// il rifiuto  definitivo solo se tutti i template hanno escluso la carta dal solo ATR
+	// (templateMatchCard restituisce false). Un errore della carta alla SELECT non basta: carte
+	// diverse possono avere lo stesso ATR, e una carta estratta o un lettore occupato non
+	// dicono nulla sull'ATR
+	bool bDefinitive = true;
 	for (DWORD i=0;i<g_mCardTemplates.size();i++) {
 		try {
 			if (g_mCardTemplates[i]->FunctionList.templateMatchCard(pSlot)) {
+				if (!atrKey.empty())
+					SetATRMatch(atrKey, g_mCardTemplates[i]->szName);
 				return g_mCardTemplates[i];
 			}
 		}
-		catch(...) { }
+		catch(...) {
+			bDefinitive = false;
+		}
 	}
+	if (bDefinitive && !atrKey.empty())
+		SetATRMatch(atrKey, "");
 	return nullptr;
 }
 
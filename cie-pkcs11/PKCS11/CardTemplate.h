@@ -3,6 +3,8 @@
 #include "../PCSC/Token.h"
 #include "session.h"
 #include <memory>
+#include <map>
+#include <mutex>
 
 
 namespace p11 {
@@ -22,6 +24,7 @@ typedef void (*templateLoginFunc)(void *pTemplateData,CK_USER_TYPE userType, Byt
 typedef void (*templateLogoutFunc)(void *pTemplateData,CK_USER_TYPE userType);
 typedef void (*templateReadObjectAttributesFunc)(void *pCardTemplateData,CP11Object *pObject);
 typedef void (*templateSignFunc)(void *pCardTemplateData,CP11PrivateKey *pPrivKey,ByteArray &baSignBuffer,ByteDynArray &baSignature,CK_MECHANISM_TYPE mechanism,bool bSilent);
+typedef void (*templateSignBatchFunc)(void *pCardTemplateData,CP11PrivateKey *pPrivKey,std::vector<ByteDynArray> &baSignBuffers,std::vector<ByteDynArray> &baSignatures,std::vector<CK_RV> &results,CK_MECHANISM_TYPE mechanism,bool bSilent);
 typedef void (*templateSignRecoverFunc)(void *pCardTemplateData,CP11PrivateKey *pPrivKey,ByteArray &baSignBuffer,ByteDynArray &baSignature,CK_MECHANISM_TYPE mechanism,bool bSilent);
 typedef void (*templateDecryptFunc)(void *pCardTemplateData,CP11PrivateKey *pPrivKey,ByteArray &baEncryptedData,ByteDynArray &baData,CK_MECHANISM_TYPE mechanism,bool bSilent);
 typedef void (*templateGenerateRandomFunc)(void *pCardTemplateData,ByteArray &baRandomData);
@@ -49,6 +52,7 @@ public:
 	templateLogoutFunc					templateLogout;
 	templateReadObjectAttributesFunc	templateReadObjectAttributes;
 	templateSignFunc					templateSign;
+	templateSignBatchFunc				templateSignBatch;
 	templateSignRecoverFunc				templateSignRecover;
 	templateDecryptFunc					templateDecrypt;
 	templateGenerateRandomFunc			templateGenerateRandom;
@@ -82,6 +86,15 @@ public:
 
 	static std::shared_ptr<CCardTemplate> GetTemplate(CSlot &pSlot);
 
+private:
+	// esito del riconoscimento per ATR completo: nome del template, oppure stringa vuota
+	// se nessun template riconosce le carte con quell'ATR. Vale per tutto il processo
+	static std::map<std::string, std::string> g_mATRMatchCache;
+	static std::mutex matchCacheMutex;
+	static void SetATRMatch(const std::string &atrKey, const std::string &templateName);
+
+public:
+
 	void InitLibrary(const char *szPath,void *templateData);
 #ifdef WIN32
 	HMODULE hLibrary;
@@ -18,6 +18,7 @@
 #include "../Util/ModuleInfo.h"
 #include "../Util/util.h"
 #include "../Util/SyncroEvent.h"
+#include "../Crypto/DHKeyPool.h"
 #include <mutex>
 
 #include "../Cryptopp/misc.h"
@@ -35,9 +36,72 @@ using namespace p11;
 
 // Function list P11
 static CK_FUNCTION_LIST m_FunctionList;
+// ordine dei lock: p11Mutex (operazioni globali), poi slotMutex (corsia dello slot),
+// poi sessionMutex (corsia della sessione), poi p11TableMutex e objMutex (solo per il
+// tempo di accesso alle mappe di slot, sessioni e oggetti).
+// Le funzioni che lavorano su una sessione o su uno slot non prendono p11Mutex,
+// cosi' le operazioni su lettori diversi procedono in parallelo; quelle solo software
+// (digest, verifica, cifratura con chiave pubblica) non prendono neanche slotMutex
 std::mutex p11Mutex;
+std::mutex p11TableMutex;
 auto_reset_event p11slotEvent/*("CardOS_P11_Event")*/;
 
+// lock di una funzione su sessione; la sessione e' dichiarata per prima
+// perche' deve sopravvivere al rilascio dei lock
+struct SessionLock {
+	std::shared_ptr<CSession> pSession;
+	std::unique_lock<std::mutex> slot;
+	std::unique_lock<std::mutex> session;
+};
+
+// cerca la sessione e blocca la corsia del suo slot e quella della sessione
+static std::shared_ptr<CSession> LockSession(CK_SESSION_HANDLE hSession, SessionLock &lock)
+{
+	lock.pSession = CSession::GetSessionFromID(hSession);
+	if (lock.pSession == nullptr)
+		return nullptr;
+
+	lock.slot = std::unique_lock<std::mutex>(lock.pSession->pSlot->slotMutex);
+	lock.pSession->pSlot->SyncEvents();
+	lock.session = std::unique_lock<std::mutex>(lock.pSession->sessionMutex);
+	// mentre aspettavo la sessione potrebbe essere stata chiusa, anche dall'estrazione della carta
+	if (CSession::GetSessionFromID(hSession) == nullptr)
+		return nullptr;
+	return lock.pSession;
+}
+
+// come LockSession, ma per i meccanismi software: blocca solo la corsia della
+// sessione, senza aspettare le operazioni in corso sulla carta
+static std::shared_ptr<CSession> LockHostSession(CK_SESSION_HANDLE hSession, SessionLock &lock)
+{
+	lock.pSession = CSession::GetSessionFromID(hSession);
+	if (lock.pSession == nullptr)
+		return nullptr;
+
+	// un'estrazione non ancora applicata chiude la sessione: passo dalla corsia dello slot
+	// solo in quel caso
+	if (lock.pSession->pSlot->RemovePending()) {
+		std::unique_lock<std::mutex> slotLock(lock.pSession->pSlot->slotMutex);
+		lock.pSession->pSlot->SyncEvents();
+	}
+	lock.session = std::unique_lock<std::mutex>(lock.pSession->sessionMutex);
+	if (CSession::GetSessionFromID(hSession) == nullptr)
+		return nullptr;
+	return lock.pSession;
+}
+
+// cerca lo slot e ne blocca la corsia
+static std::shared_ptr<CSlot> LockSlot(CK_SLOT_ID slotID, std::unique_lock<std::mutex> &lock)
+{
+	std::shared_ptr<CSlot> pSlot = CSlot::GetSlotFromID(slotID);
+	if (pSlot == nullptr)
+		return nullptr;
+
+	lock = std::unique_lock<std::mutex>(pSlot->slotMutex);
+	pSlot->SyncEvents();
+	return pSlot;
+}
+
 // meccanismi supportati
 
 
@@ -380,20 +444,22 @@ CK_RV CK_ENTRY C_Finalize(CK_VOID_PTR pReserved)
 
 	// TODO verificare thread "vuoto"
 	if (CSlot::Thread.joinable()) {
-		CCardContext *tc = CSlot::ThreadContext;
-		if (tc != nullptr) {
-			SCARDCONTEXT hC = tc->hContext;
-			if (hC != NULL)
-				SCardCancel(hC);
-		}
+		CSlot::CancelMonitor();
 		p11Mutex.unlock();
 		CSlot::Thread.join();
 		p11Mutex.lock();
 	}
+	// il monitor non accoda piu' nulla: fermo il prefetch prima di chiudere le sessioni
+	CSlot::StopPrefetch();
+	// le chiavi DH calcolate in anticipo non sopravvivono al C_Finalize
+	CDHKeyPool::Instance().Stop();
 
 
 	for(SlotMap::const_iterator it=CSlot::g_mSlots.begin();it!=CSlot::g_mSlots.end();it++) {
+		std::unique_lock<std::mutex> slotLock(it->second->slotMutex);
+		it->second->SyncEvents();
 		it->second->CloseAllSessions();
+		it->second->Disconnect();
 	}
 
 	return CKR_OK;
@@ -404,7 +470,7 @@ CK_RV CK_ENTRY C_Finalize(CK_VOID_PTR pReserved)
 CK_RV CK_ENTRY C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY notify, CK_SESSION_HANDLE_PTR phSession)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	std::unique_lock<std::mutex> lock;
 
 //	checkOutPtr(phSession)
 
@@ -423,7 +489,7 @@ CK_RV CK_ENTRY C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApp
 	if (!(flags & CKF_SERIAL_SESSION))
 		throw p11_error(CKR_SESSION_PARALLEL_NOT_SUPPORTED);
 
-	std::shared_ptr<CSlot> pSlot = CSlot::GetSlotFromID(slotID);
+	std::shared_ptr<CSlot> pSlot = LockSlot(slotID, lock);
 	if (pSlot == nullptr)
 		throw p11_error(CKR_SLOT_ID_INVALID);
 	
@@ -464,7 +530,7 @@ CK_RV CK_ENTRY C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApp
 CK_RV CK_ENTRY C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	std::unique_lock<std::mutex> lock;
 
 //	checkOutPtr(pInfo)
 
@@ -474,7 +540,7 @@ CK_RV CK_ENTRY C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSlot> pSlot = CSlot::GetSlotFromID(slotID);
+			std::shared_ptr<CSlot> pSlot = LockSlot(slotID, lock);
 
 			if (pSlot == nullptr)
 				throw p11_error(CKR_SLOT_ID_INVALID);
@@ -495,14 +561,14 @@ CK_RV CK_ENTRY C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 CK_RV CK_ENTRY C_CloseSession(CK_SESSION_HANDLE hSession)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 	logParam(hSession)
 
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+			std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -517,14 +583,14 @@ CK_RV CK_ENTRY C_CloseSession(CK_SESSION_HANDLE hSession)
 CK_RV CK_ENTRY C_CloseAllSessions(CK_SLOT_ID slotID)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	std::unique_lock<std::mutex> lock;
 
 	logParam(slotID)
 
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSlot> pSlot = CSlot::GetSlotFromID(slotID);
+	std::shared_ptr<CSlot> pSlot = LockSlot(slotID, lock);
 
 	if (pSlot==nullptr)
 		throw p11_error(CKR_SLOT_ID_INVALID);
@@ -540,7 +606,7 @@ CK_RV CK_ENTRY C_CloseAllSessions(CK_SLOT_ID slotID)
 CK_RV CK_ENTRY C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	std::unique_lock<std::mutex> lock;
 
 //	checkOutPtr(pInfo)
 
@@ -550,7 +616,7 @@ CK_RV CK_ENTRY C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSlot> pSlot = CSlot::GetSlotFromID(slotID);
+	std::shared_ptr<CSlot> pSlot = LockSlot(slotID, lock);
 	if (pSlot==NULL)
 		throw p11_error(CKR_SLOT_ID_INVALID);
 
@@ -661,10 +727,29 @@ CK_RV CK_ENTRY C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
     return CKR_GENERAL_ERROR;
 }
 
+CK_RV CK_ENTRY C_CIE_GetFunctionListExt(CK_CIE_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	init_p11_func
+
+	logParam(ppFunctionList)
+
+	if (ppFunctionList == NULL)
+		throw p11_error(CKR_ARGUMENTS_BAD);
+
+	static CK_CIE_FUNCTION_LIST functionList = { { 1, 0 },
+		C_CIE_SignBatch };
+
+	*ppFunctionList = &functionList;
+
+	return CKR_OK;
+	exit_p11_func
+	return CKR_GENERAL_ERROR;
+}
+
 CK_RV CK_ENTRY C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 	
 
 //	checkOutPtr(phObject)
@@ -679,7 +764,7 @@ CK_RV CK_ENTRY C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemp
 	if (!bP11Initialized)
 		throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 
 	if (pSession==nullptr) 
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -694,7 +779,7 @@ CK_RV CK_ENTRY C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemp
 CK_RV CK_ENTRY C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey)
 {
 	init_p11_func
-		std::unique_lock<std::mutex> lock(p11Mutex);
+		SessionLock lock;
 
 //	checkInPtr(pMechanism)
 //		checkOutPtr(phKey)
@@ -710,7 +795,7 @@ CK_RV CK_ENTRY C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -725,7 +810,7 @@ CK_RV CK_ENTRY C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 CK_RV CK_ENTRY C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 	
 //	checkInPtr(pMechanism)
 //		checkOutPtr(phPublicKey)
@@ -744,7 +829,7 @@ CK_RV CK_ENTRY C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pM
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -759,7 +844,7 @@ CK_RV CK_ENTRY C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pM
 CK_RV CK_ENTRY C_DestroyObject(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE hObject)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 	
 	logParam(hSession)
 		logParam(hObject)
@@ -768,7 +853,7 @@ CK_RV CK_ENTRY C_DestroyObject(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE hObje
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+			std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 
 			if (pSession == nullptr)
 				throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -783,7 +868,7 @@ CK_RV CK_ENTRY C_DestroyObject(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE hObje
 CK_RV CK_ENTRY C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism) 
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -793,7 +878,7 @@ CK_RV CK_ENTRY C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechan
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -809,7 +894,7 @@ CK_RV CK_ENTRY C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechan
 CK_RV CK_ENTRY C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) 
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 //		checkOutArray(pDigest, pulDigestLen)
@@ -821,7 +906,7 @@ CK_RV CK_ENTRY C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -839,7 +924,7 @@ CK_RV CK_ENTRY C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 CK_RV CK_ENTRY C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) 
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pDigest, pulDigestLen)
 
@@ -849,7 +934,7 @@ CK_RV CK_ENTRY C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -866,7 +951,7 @@ CK_RV CK_ENTRY C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK
 CK_RV CK_ENTRY C_DigestUpdate (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pPart, ulPartLen)
 
@@ -876,7 +961,7 @@ CK_RV CK_ENTRY C_DigestUpdate (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
     
@@ -890,7 +975,7 @@ CK_RV CK_ENTRY C_DigestUpdate (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK
 CK_RV CK_ENTRY C_FindObjects(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE_PTR phObject,CK_ULONG ulMaxObjectCount,CK_ULONG_PTR pulObjectCount)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutBuffer(phObject, sizeof(CK_OBJECT_HANDLE)*ulMaxObjectCount)
 
@@ -902,7 +987,7 @@ CK_RV CK_ENTRY C_FindObjects(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE_PTR phO
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession == nullptr) 
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -921,14 +1006,14 @@ CK_RV CK_ENTRY C_FindObjects(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE_PTR phO
 CK_RV CK_ENTRY C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 	logParam(hSession)
 
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -940,7 +1025,7 @@ CK_RV CK_ENTRY C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 CK_RV CK_ENTRY C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInArray(pTemplate,ulCount)
 
@@ -960,7 +1045,7 @@ CK_RV CK_ENTRY C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pT
 	if (!bP11Initialized)
 		throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession == nullptr) 
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -977,7 +1062,7 @@ CK_RV CK_ENTRY C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pT
 CK_RV CK_ENTRY C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount )
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInArray(pTemplate, ulCount)
 
@@ -989,7 +1074,7 @@ CK_RV CK_ENTRY C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession==nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -1112,7 +1197,7 @@ CK_RV CK_ENTRY C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_
 CK_RV CK_ENTRY C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutPtr(pInfo)
 
@@ -1122,7 +1207,7 @@ CK_RV CK_ENTRY C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+			std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 			if (pSession == nullptr)
 				throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -1162,7 +1247,7 @@ CK_RV CK_ENTRY C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR
 CK_RV CK_ENTRY C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pPin, ulPinLen)
 
@@ -1173,7 +1258,7 @@ CK_RV CK_ENTRY C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_CHA
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -1190,14 +1275,14 @@ CK_RV CK_ENTRY C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_CHA
 CK_RV CK_ENTRY C_Logout(CK_SESSION_HANDLE hSession)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 	logParam(hSession)
 
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+			std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
 
@@ -1213,7 +1298,7 @@ CK_RV CK_ENTRY C_Logout(CK_SESSION_HANDLE hSession)
 CK_RV CK_ENTRY C_SetAttributeValue(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE hObject,CK_ATTRIBUTE_PTR pTemplate,CK_ULONG ulCount)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 	logParam(hSession)
 		logParam(hObject)
@@ -1223,7 +1308,7 @@ CK_RV CK_ENTRY C_SetAttributeValue(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE h
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1238,7 +1323,7 @@ CK_RV CK_ENTRY C_SetAttributeValue(CK_SESSION_HANDLE hSession,CK_OBJECT_HANDLE h
 CK_RV CK_ENTRY C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 //		checkOutArray(pSignature, pulSignatureLen)
@@ -1252,7 +1337,7 @@ CK_RV CK_ENTRY C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ul
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1266,10 +1351,51 @@ CK_RV CK_ENTRY C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ul
 	return CKR_GENERAL_ERROR;	
 	}
 
+CK_RV CK_ENTRY C_CIE_SignBatch(CK_SESSION_HANDLE hSession, CK_ULONG ulCount, CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen, CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen, CK_RV *pRv)
+{
+	init_p11_func
+	SessionLock lock;
+
+	logParam(hSession)
+	logParam(ulCount)
+
+	if (!bP11Initialized)
+		throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
+
+	if (ppData == NULL || pulDataLen == NULL || pulSignatureLen == NULL || pRv == NULL)
+		throw p11_error(CKR_ARGUMENTS_BAD);
+	for (CK_ULONG i = 0; i < ulCount; i++) {
+		if ((ppData[i] == NULL && pulDataLen[i] != 0) || (ppSignature != NULL && ppSignature[i] == NULL))
+			throw p11_error(CKR_ARGUMENTS_BAD);
+	}
+
+	std::shared_ptr<CSession> pSession = LockSession(hSession, lock);
+	if (pSession == nullptr)
+		throw p11_error(CKR_SESSION_HANDLE_INVALID);
+
+	std::vector<ByteArray> Data, Signatures;
+	for (CK_ULONG i = 0; i < ulCount; i++) {
+		Data.push_back(ByteArray(ppData[i], pulDataLen[i]));
+		if (ppSignature != NULL)
+			Signatures.push_back(ByteArray(ppSignature[i], pulSignatureLen[i]));
+	}
+
+	std::vector<CK_ULONG> SignatureLen;
+	std::vector<CK_RV> Results;
+	pSession->SignBatch(Data, Signatures, SignatureLen, Results);
+	for (CK_ULONG i = 0; i < ulCount; i++) {
+		pulSignatureLen[i] = SignatureLen[i];
+		pRv[i] = Results[i];
+	}
+	return CKR_OK;
+	exit_p11_func
+	return CKR_GENERAL_ERROR;
+}
+
 CK_RV CK_ENTRY C_SignFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pSignature,CK_ULONG_PTR pulSignatureLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pSignature, pulSignatureLen)
 
@@ -1279,7 +1405,7 @@ CK_RV CK_ENTRY C_SignFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pSignature,CK_
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1299,7 +1425,7 @@ CK_RV CK_ENTRY C_SignFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pSignature,CK_
 CK_RV CK_ENTRY C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1310,7 +1436,7 @@ CK_RV CK_ENTRY C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanis
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1328,7 +1454,7 @@ CK_RV CK_ENTRY C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanis
 CK_RV CK_ENTRY C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pPart, ulPartLen)
 
@@ -1338,7 +1464,7 @@ CK_RV CK_ENTRY C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_UL
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1357,7 +1483,7 @@ CK_RV CK_ENTRY C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_UL
 CK_RV CK_ENTRY C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1368,7 +1494,7 @@ CK_RV CK_ENTRY C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pM
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1386,7 +1512,7 @@ CK_RV CK_ENTRY C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pM
 CK_RV CK_ENTRY C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 //		checkOutArray(pSignature, pulSignatureLen)
@@ -1398,7 +1524,7 @@ CK_RV CK_ENTRY C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_U
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1416,7 +1542,7 @@ CK_RV CK_ENTRY C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_U
 CK_RV CK_ENTRY C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1427,7 +1553,7 @@ CK_RV CK_ENTRY C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1446,7 +1572,7 @@ CK_RV CK_ENTRY C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR
 CK_RV CK_ENTRY C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pData, pulDataLen)
 //		checkInBuffer(pSignature, ulSignatureLen)
@@ -1458,7 +1584,7 @@ CK_RV CK_ENTRY C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignatur
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1476,7 +1602,7 @@ CK_RV CK_ENTRY C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignatur
 CK_RV CK_ENTRY C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1487,7 +1613,7 @@ CK_RV CK_ENTRY C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechan
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1505,7 +1631,7 @@ CK_RV CK_ENTRY C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechan
 CK_RV CK_ENTRY C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 //		checkInBuffer(pSignature, ulSignatureLen)
@@ -1517,7 +1643,7 @@ CK_RV CK_ENTRY C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1534,7 +1660,7 @@ CK_RV CK_ENTRY C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 CK_RV CK_ENTRY C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 
@@ -1544,7 +1670,7 @@ CK_RV CK_ENTRY C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1563,7 +1689,7 @@ CK_RV CK_ENTRY C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_
 CK_RV CK_ENTRY C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pSignature, ulSignatureLen)
 
@@ -1573,7 +1699,7 @@ CK_RV CK_ENTRY C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1592,7 +1718,7 @@ CK_RV CK_ENTRY C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
 CK_RV CK_ENTRY C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pData, ulDataLen)
 //		checkOutArray(pEncryptedData, pulEncryptedDataLen)
@@ -1604,7 +1730,7 @@ CK_RV CK_ENTRY C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-			std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+			std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr) 
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1622,7 +1748,7 @@ CK_RV CK_ENTRY C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG
 CK_RV CK_ENTRY C_EncryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pEncryptedData,CK_ULONG_PTR pulEncryptedDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pEncryptedData, pulEncryptedDataLen)
 
@@ -1632,7 +1758,7 @@ CK_RV CK_ENTRY C_EncryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pEncryptedD
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession = CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession = LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr) 
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1652,7 +1778,7 @@ CK_RV CK_ENTRY C_EncryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pEncryptedD
 CK_RV CK_ENTRY C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1663,7 +1789,7 @@ CK_RV CK_ENTRY C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1681,7 +1807,7 @@ CK_RV CK_ENTRY C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 CK_RV CK_ENTRY C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pPart, ulPartLen)
 //		checkOutArray(pEncryptedPart, pulEncryptedPartLen)
@@ -1693,7 +1819,7 @@ CK_RV CK_ENTRY C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockHostSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1714,7 +1840,7 @@ CK_RV CK_ENTRY C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK
 CK_RV CK_ENTRY C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pEncryptedData, ulEncryptedDataLen)
 //		checkOutArray(pData, pulDataLen)
@@ -1726,7 +1852,7 @@ CK_RV CK_ENTRY C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData,
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1744,7 +1870,7 @@ CK_RV CK_ENTRY C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData,
 CK_RV CK_ENTRY C_DecryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pData,CK_ULONG_PTR pulDataLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pData, pulDataLen)
 
@@ -1754,7 +1880,7 @@ CK_RV CK_ENTRY C_DecryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pData,CK_UL
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1774,7 +1900,7 @@ CK_RV CK_ENTRY C_DecryptFinal(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pData,CK_UL
 CK_RV CK_ENTRY C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInPtr(pMechanism)
 
@@ -1785,7 +1911,7 @@ CK_RV CK_ENTRY C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1804,7 +1930,7 @@ CK_RV CK_ENTRY C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMecha
 CK_RV CK_ENTRY C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pEncryptedPart, ulEncryptedPartLen)
 //		checkOutArray(pPart, pulPartLen)
@@ -1816,7 +1942,7 @@ CK_RV CK_ENTRY C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncrypte
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1854,13 +1980,13 @@ CK_RV CK_ENTRY C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_
 		throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
 	if (flags & CKF_DONT_BLOCK) {
-		std::unique_lock<std::mutex> lock(p11Mutex);
+		// il monitor non prende p11Mutex: basta la tabella per scorrere gli slot
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		//CSyncroLocker lock(p11EventMutex);
 		SlotMap::iterator it=CSlot::g_mSlots.begin();
 		while (it!=CSlot::g_mSlots.end()) {
-			if (it->second->lastEvent!=SE_NoEvent) {
+			if (it->second->lastEvent.exchange(SE_NoEvent)!=SE_NoEvent) {
 				*pSlot=it->second->hSlot;
-				it->second->lastEvent=SE_NoEvent;
 				return CKR_OK;
 			}
 			it++;
@@ -1875,11 +2001,11 @@ CK_RV CK_ENTRY C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_
 			*pSlot=0;
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 		}
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		SlotMap::iterator it=CSlot::g_mSlots.begin();
 		while (it!=CSlot::g_mSlots.end()) {
-			if (it->second->lastEvent!=SE_NoEvent) {
+			if (it->second->lastEvent.exchange(SE_NoEvent)!=SE_NoEvent) {
 				*pSlot=it->second->hSlot;
-				it->second->lastEvent=SE_NoEvent;
 				return CKR_OK;
 			}
 			it++;
@@ -1905,7 +2031,7 @@ CK_RV CK_ENTRY C_SeedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_UL
 CK_RV CK_ENTRY C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutBuffer(RandomData, ulRandomLen)
 
@@ -1915,7 +2041,7 @@ CK_RV CK_ENTRY C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomDa
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1931,7 +2057,7 @@ CK_RV CK_ENTRY C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomDa
 CK_RV CK_ENTRY C_InitPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pPin,CK_ULONG ulPinLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pPin,ulPinLen);
 
@@ -1941,7 +2067,7 @@ CK_RV CK_ENTRY C_InitPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pPin,CK_ULONG ul
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1957,7 +2083,7 @@ CK_RV CK_ENTRY C_InitPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pPin,CK_ULONG ul
 CK_RV CK_ENTRY C_SetPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pOldPin,CK_ULONG ulOldLen,CK_CHAR_PTR pNewPin,CK_ULONG ulNewLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pOldPin,ulOldLen);
 //	checkInBuffer(pNewPin,ulNewLen);
@@ -1969,7 +2095,7 @@ CK_RV CK_ENTRY C_SetPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pOldPin,CK_ULONG
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -1986,7 +2112,7 @@ CK_RV CK_ENTRY C_SetPIN(CK_SESSION_HANDLE hSession,CK_CHAR_PTR pOldPin,CK_ULONG
 CK_RV CK_ENTRY C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,CK_ULONG_PTR pulSize) 
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutPtr(pulSize);
 
@@ -1997,7 +2123,7 @@ CK_RV CK_ENTRY C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObj
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -2012,7 +2138,7 @@ CK_RV CK_ENTRY C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObj
 CK_RV CK_ENTRY C_GetOperationState(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pOperationState,CK_ULONG_PTR pulOperationStateLen)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkOutArray(pOperationState, pulOperationStateLen)
 
@@ -2022,7 +2148,7 @@ CK_RV CK_ENTRY C_GetOperationState(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pOpera
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -2039,7 +2165,7 @@ CK_RV CK_ENTRY C_GetOperationState(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pOpera
 CK_RV CK_ENTRY C_SetOperationState(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pOperationState,CK_ULONG ulOperationStateLen,CK_OBJECT_HANDLE hEncryptionKey,CK_OBJECT_HANDLE hAuthenticationKey)
 {
 	init_p11_func
-	std::unique_lock<std::mutex> lock(p11Mutex);
+	SessionLock lock;
 
 //	checkInBuffer(pOperationState, ulOperationStateLen)
 
@@ -2051,7 +2177,7 @@ CK_RV CK_ENTRY C_SetOperationState(CK_SESSION_HANDLE hSession,CK_BYTE_PTR pOpera
 		if (!bP11Initialized)
 			throw p11_error(CKR_CRYPTOKI_NOT_INITIALIZED);
 
-	std::shared_ptr<CSession> pSession	=CSession::GetSessionFromID(hSession);
+	std::shared_ptr<CSession> pSession	=LockSession(hSession, lock);
 		
 	if (pSession == nullptr)
 		throw p11_error(CKR_SESSION_HANDLE_INVALID);
@@ -69,6 +69,23 @@ catch (...) { Log.write("CKR_GENERAL_ERROR"); return CKR_GENERAL_ERROR; }
 
 #endif
         
+// estensioni CIE, ottenibili con C_CIE_GetFunctionListExt.
+// C_CIE_SignBatch firma ulCount dati (digest o DigestInfo, secondo il meccanismo di C_SignInit)
+// con una sola autenticazione della carta. pulSignatureLen e' in ingresso la dimensione dei
+// buffer e in uscita quella delle firme; pRv riporta l'esito di ogni elemento. Come C_Sign
+// termina l'operazione di firma, salvo quando ppSignature e' NULL (solo dimensioni)
+typedef CK_RV (*CK_C_CIE_SignBatch)(CK_SESSION_HANDLE hSession, CK_ULONG ulCount, CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen, CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen, CK_RV *pRv);
+
+typedef struct CK_CIE_FUNCTION_LIST {
+	CK_VERSION version;
+	CK_C_CIE_SignBatch C_CIE_SignBatch;
+} CK_CIE_FUNCTION_LIST;
+
+typedef CK_CIE_FUNCTION_LIST * CK_CIE_FUNCTION_LIST_PTR;
+typedef CK_CIE_FUNCTION_LIST_PTR * CK_CIE_FUNCTION_LIST_PTR_PTR;
+
 extern "C" {
 	CK_RV CK_ENTRY C_UpdateSlotList();
+	CK_RV CK_ENTRY C_CIE_GetFunctionListExt(CK_CIE_FUNCTION_LIST_PTR_PTR ppFunctionList);
+	CK_RV CK_ENTRY C_CIE_SignBatch(CK_SESSION_HANDLE hSession, CK_ULONG ulCount, CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen, CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen, CK_RV *pRv);
 }
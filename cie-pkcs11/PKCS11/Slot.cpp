@@ -7,6 +7,9 @@
 #include "../Util/util.h"
 #include "../Util/SyncroEvent.h"
 #include <mutex>
+#include <chrono>
+#include <deque>
+#include <condition_variable>
 #include "../Cryptopp/misc.h"
 
 extern CLog Log;
@@ -14,6 +17,7 @@ extern CLog Log;
 static char *szCompiledFile = __FILE__;
 //extern CSyncroMutex p11EventMutex;
 extern std::mutex p11Mutex;
+extern std::mutex p11TableMutex;
 extern auto_reset_event p11slotEvent;
 extern bool bP11Terminate;
 extern bool bP11Initialized;
@@ -32,7 +36,10 @@ namespace p11 {
 	SlotMap CSlot::g_mSlots;
 	std::thread CSlot::Thread;
 	CCardContext *CSlot::ThreadContext = NULL;
-	bool CSlot::bMonitorUpdate = false;
+	std::mutex CSlot::MonitorMutex;
+	std::atomic<bool> CSlot::MonitorRunning(false);
+	std::atomic<DWORD> CSlot::MonitorWakeups(0);
+	std::atomic<bool> CSlot::bMonitorUpdate(false);
 
 	CSlot::CSlot(const char *szReader) {
 		szName = szReader;
@@ -41,6 +48,10 @@ namespace p11 {
 		User = CKU_NOBODY;
 		dwP11ObjCnt = 0;
 		dwSessionCount = 0;
+		dwRWSessionCount = 0;
+		dwInsertCount = 0;
+		dwRemoveCount = 0;
+		dwRemoveSynced = 0;
 		pTemplate = NULL;
 		//slotMutex.Create(mutexName(szReader));
 		pSerialTemplate = NULL;
@@ -56,112 +67,224 @@ namespace p11 {
             return ++dwSlotCnt;
     }
 
+	static const char szPnPNotification[] = "\\\\?PnP?\\Notification";
+
 	static DWORD slotMonitor(SlotMap *pSlotMap)
 	{
+		// il monitor resta bloccato in una sola SCardGetStatusChange senza timeout su tutti i
+		// lettori e sullo pseudo-lettore PnP; si sveglia solo per un evento, per la SCardCancel
+		// di CancelMonitor o per un errore del servizio. Non prende lo slotMutex: pubblica l'evento
+		// e lascia la Final alla prossima operazione sullo slot (SyncEvents), cosi' una firma
+		// in corso su un lettore non ritarda gli eventi degli altri
+		auto stopped = scopeExit([]() noexcept { CSlot::MonitorRunning = false; });
+
+		// ultimo stato noto di ogni lettore: sopravvive alla rilettura della mappa, cos un
+		// evento avvenuto nel frattempo non si perde
+		std::map<std::string, DWORD> lastState;
 		while (true) {
 			CCardContext Context;
-			CSlot::ThreadContext = &Context;
-			size_t dwSlotNum = pSlotMap->size();
-			std::vector<SCARD_READERSTATE> state(dwSlotNum);
-			std::vector<std::shared_ptr<CSlot>> slot(dwSlotNum);
-			size_t i = 0;
-			DWORD ris;
 			{
-				std::unique_lock<std::mutex> lock(p11Mutex);
-				for (SlotMap::const_iterator it = pSlotMap->begin(); it != pSlotMap->end(); it++, i++) {
-					if (!bP11Initialized) {
-						CSlot::ThreadContext = NULL;
-						return 0;
-					}
-
-					state[i].szReader = it->second->szName.c_str();
-					slot[i] = it->second;
-					if ((ris = SCardGetStatusChange(Context, 0, &state[i], 1)) != S_OK) {
-						if (ris != SCARD_E_TIMEOUT) {
-							Log.write("Errore nella SCardGetStatusChange - %08X", ris);
-							// non uso la ExitThread!!!
-							// altrimenti non chiamo i distruttori, e mi rimane tutto appeso
-							// SOPRATTUTTO il p11Mutex
-							CSlot::ThreadContext = NULL;
-							return 1;
-						}
-					}
-					state[i].dwCurrentState = state[i].dwEventState & (~SCARD_STATE_CHANGED);
-				}
+				std::unique_lock<std::mutex> lock(CSlot::MonitorMutex);
+				CSlot::ThreadContext = &Context;
 			}
+			auto clearContext = scopeExit([]() noexcept {
+				std::unique_lock<std::mutex> lock(CSlot::MonitorMutex);
+				CSlot::ThreadContext = NULL;
+			});
 			CSlot::bMonitorUpdate = false;
+
+			std::vector<std::shared_ptr<CSlot>> slot;
+			{
+				std::unique_lock<std::mutex> lock(p11TableMutex);
+				for (SlotMap::const_iterator it = pSlotMap->begin(); it != pSlotMap->end(); it++)
+					slot.push_back(it->second);
+			}
+			size_t dwSlotNum = slot.size();
+			// l'ultimo elemento  lo pseudo-lettore che segnala l'aggiunta o la rimozione di un lettore;
+			// un lettore mai visto parte da SCARD_STATE_UNAWARE: la prima attesa ne restituisce subito
+			// lo stato senza generare eventi
+			std::vector<SCARD_READERSTATE> state(dwSlotNum + 1);
+			for (size_t i = 0; i <= dwSlotNum; i++) {
+				state[i].szReader = i < dwSlotNum ? slot[i]->szName.c_str() : szPnPNotification;
+				auto known = lastState.find(state[i].szReader);
+				state[i].dwCurrentState = known != lastState.end() ? known->second : SCARD_STATE_UNAWARE;
+			}
+
 			while (true) {
-				Context.validate();
-				ris = SCardGetStatusChange(Context, 1000, state.data(), (DWORD)dwSlotNum);
+				if (CSlot::bMonitorUpdate)
+					break;
+				if (bP11Terminate || !bP11Initialized) {
+					Log.write("Terminate");
+					p11slotEvent.set();
+					// no exitThread: altrimenti non chiamo i distruttori
+					return 0;
+				}
+
+				DWORD ris = SCardGetStatusChange(Context, INFINITE, state.data(), (DWORD)state.size());
+				CSlot::MonitorWakeups++;
 				if (ris != S_OK) {
-					if (CSlot::bMonitorUpdate || ris == SCARD_E_SYSTEM_CANCELLED || ris == SCARD_E_SERVICE_STOPPED || ris == SCARD_E_INVALID_HANDLE || ris == ERROR_INVALID_HANDLE) {
-						Log.write("Monitor Update");
-						break;
-					}
-					if (ris == SCARD_E_CANCELLED || bP11Terminate || !bP11Initialized) {
+					if (ris == SCARD_E_CANCELLED && (bP11Terminate || !bP11Initialized)) {
 						Log.write("Terminate");
 						p11slotEvent.set();
-						CSlot::ThreadContext = NULL;
-						// no exitThread, vedi sopra;
 						return 0;
 					}
-					if (ris != SCARD_E_TIMEOUT && ris != SCARD_E_NO_READERS_AVAILABLE) {
-						Log.write("Errore nella SCardGetStatusChange - %08X", ris);
-						p11slotEvent.set();
-						CSlot::ThreadContext = NULL;
-						// no exitThread, vedi sopra;
-						return 1;
+					if (ris == SCARD_E_CANCELLED || ris == SCARD_E_SYSTEM_CANCELLED || ris == SCARD_E_SERVICE_STOPPED || ris == SCARD_E_INVALID_HANDLE || ris == ERROR_INVALID_HANDLE) {
+						// aggiornamento della lista o servizio riavviato: ricreo il context
+						// e rileggo la mappa
+						Log.write("Monitor Update");
+						break;
 					}
 					if (ris == SCARD_E_NO_READERS_AVAILABLE) {
 						Log.write("Nessun lettore connesso - %08X", ris);
-						CSlot::ThreadContext = NULL;
-						// no exitThread, vedi sopra;
 						return 1;
 					}
-				}
-				if (bP11Terminate || !bP11Initialized) {
-					Log.write("Terminate");
+					Log.write("Errore nella SCardGetStatusChange - %08X", ris);
 					p11slotEvent.set();
-					CSlot::ThreadContext = NULL;
-					// no exitThread, vedi sopra;
-					return 0;
+					return 1;
 				}
 
 				for (size_t i = 0; i < dwSlotNum; i++) {
+					// pubblico lo stato prima di segnalare l'evento: chi si sveglia in
+					// C_WaitForSlotEvent e chiede C_GetSlotList vede gi il nuovo stato
+					if ((state[i].dwEventState & SCARD_STATE_CHANGED) || slot[i]->GetReaderState() == nullptr) {
+						auto readerState = std::make_shared<CSlotReaderState>();
+						readerState->dwState = state[i].dwEventState & (~SCARD_STATE_CHANGED);
+						if (readerState->dwState & SCARD_STATE_PRESENT)
+							readerState->ATR = ByteArray(state[i].rgbAtr, state[i].cbAtr);
+						slot[i]->SetReaderState(std::move(readerState));
+					}
+
 					if ((state[i].dwCurrentState & SCARD_STATE_PRESENT) &&
 						((state[i].dwEventState & SCARD_STATE_EMPTY) ||
 						(state[i].dwEventState & SCARD_STATE_UNAVAILABLE))) {
 						// una carta  stata estratta!!
-						// sincronizzo sul mutex principale p11
 						// le funzioni attualmente in esecuzione che vanno sulla
 						// carta falliranno miseramente, ma se levi la carta
 						// mentre sto firmado mica  colpa mia!
 
-						std::unique_lock<std::mutex> lock(p11Mutex);
-
+						// la Final la fa la prossima operazione che entra nella corsia dello slot
+						slot[i]->dwRemoveCount++;
 						slot[i]->lastEvent = SE_Removed;
-						slot[i]->Final();
-						slot[i]->baATR.clear();
 						p11slotEvent.set();
 					}
 					if (((state[i].dwCurrentState & SCARD_STATE_UNAVAILABLE) ||
 						(state[i].dwCurrentState & SCARD_STATE_EMPTY)) &&
 						(state[i].dwEventState & SCARD_STATE_PRESENT)) {
 						// una carta  stata inserita!!
-						std::unique_lock<std::mutex> lock(p11Mutex);
-
+						slot[i]->dwInsertCount++;
 						slot[i]->lastEvent = SE_Inserted;
-						ByteArray ba;
-						slot[i]->GetATR(ba);
+						CSlot::QueuePrefetch(slot[i]);
 						p11slotEvent.set();
 					}
+				}
+				bool bReadersChanged = (state[dwSlotNum].dwEventState & SCARD_STATE_CHANGED) != 0;
+				for (size_t i = 0; i <= dwSlotNum; i++) {
 					state[i].dwCurrentState = state[i].dwEventState & (~SCARD_STATE_CHANGED);
+					lastState[state[i].szReader] = state[i].dwCurrentState;
 				}
+				if (bReadersChanged)
+					break;
+			}
+		}
+	}
+
+	// prefetch della carta appena inserita: un solo thread legge PAN, certificato e dati del
+	// token prima della prima C_OpenSession, che li trova gi in memoria. Lavora sotto lo
+	// slotMutex come qualsiasi operazione sulla carta; se la carta viene estratta durante la
+	// lettura le APDU falliscono, il prefetch si abbandona e lo stato parziale lo pulisce la
+	// Final del monitor. Una C_OpenSession successiva rif le letture mancanti
+	static std::thread prefetchThread;
+	static std::mutex prefetchMutex;
+	static std::condition_variable prefetchWake;
+	static std::deque<std::pair<std::shared_ptr<CSlot>, DWORD>> prefetchQueue;
+	static std::atomic<bool> bPrefetchStop(false);
+
+	static void slotPrefetch()
+	{
+		while (true) {
+			std::shared_ptr<CSlot> pSlot;
+			DWORD dwInsertCount;
+			{
+				std::unique_lock<std::mutex> lock(prefetchMutex);
+				prefetchWake.wait(lock, []() { return bPrefetchStop || !prefetchQueue.empty(); });
+				if (bPrefetchStop)
+					return;
+				pSlot = std::move(prefetchQueue.front().first);
+				dwInsertCount = prefetchQueue.front().second;
+				prefetchQueue.pop_front();
+			}
+
+			std::unique_lock<std::mutex> slotLock(pSlot->slotMutex);
+			pSlot->SyncEvents();
+			// carta estratta o reinserita mentre la richiesta era in coda
+			if (bPrefetchStop || pSlot->dwInsertCount != dwInsertCount)
+				continue;
+			auto readerState = pSlot->GetReaderState();
+			if (readerState == nullptr || (readerState->dwState & SCARD_STATE_PRESENT) == 0)
+				continue;
+
+			try {
+				pSlot->Init();
+				pSlot->pTemplate->FunctionList.templateInitSession(pSlot->pTemplateData);
+				CK_TOKEN_INFO tokenInfo;
+				pSlot->GetTokenInfo(&tokenInfo);
+			}
+			catch (...) {
+				Log.write("Prefetch della carta nello slot %i non completato", (int)pSlot->hSlot);
 			}
-			CSlot::ThreadContext = NULL;
 		}
-		// no exitThread, vedi sopra;
-		return 0;
+	}
+
+	void CSlot::QueuePrefetch(std::shared_ptr<CSlot> pSlot)
+	{
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			DWORD dwInsertCount = pSlot->dwInsertCount;
+			prefetchQueue.emplace_back(std::move(pSlot), dwInsertCount);
+			if (!prefetchThread.joinable())
+				prefetchThread = std::thread(slotPrefetch);
+		}
+		prefetchWake.notify_one();
+	}
+
+	void CSlot::StopPrefetch()
+	{
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			bPrefetchStop = true;
+		}
+		prefetchWake.notify_one();
+		if (prefetchThread.joinable())
+			prefetchThread.join();
+
+		std::unique_lock<std::mutex> lock(prefetchMutex);
+		prefetchQueue.clear();
+		bPrefetchStop = false;
+	}
+
+	void CSlot::CancelMonitor()
+	{
+		// SCardCancel interrompe solo un'attesa gi iniziata: se il monitor non  ancora entrato
+		// nella SCardGetStatusChange la richiesta andrebbe persa e l'attesa, senza timeout, non
+		// finirebbe pi. Ripeto finch il monitor non si  svegliato almeno una volta; i flag
+		// (bMonitorUpdate, bP11Initialized) vanno impostati prima della chiamata
+		DWORD wakeups = MonitorWakeups;
+		while (MonitorRunning && MonitorWakeups == wakeups) {
+			{
+				std::unique_lock<std::mutex> lock(MonitorMutex);
+				if (ThreadContext != nullptr && ThreadContext->hContext != NULL)
+					SCardCancel(ThreadContext->hContext);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void CSlot::Disconnect() {
+		if (hCard != NULL) {
+			// il reset annulla lo stato di sicurezza (PIN verificato) lasciato sulla carta
+			SCardDisconnect(hCard, SCARD_RESET_CARD);
+			hCard = NULL;
+		}
 	}
 
 	CK_SLOT_ID CSlot::AddSlot(std::shared_ptr<CSlot> pSlot)
@@ -169,6 +292,7 @@ namespace p11 {
 		init_func
         pSlot->hSlot = (CK_SLOT_ID)pSlot->GetNewSlotID();
 		auto id = pSlot->hSlot;
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		g_mSlots.insert(std::make_pair(pSlot->hSlot, std::move(pSlot)));
 		return id;
 	}
@@ -181,6 +305,7 @@ namespace p11 {
 		if (!pSlot)
 			throw p11_error(CKR_SLOT_ID_INVALID);
 
+		std::unique_lock<std::mutex> slotLock(pSlot->slotMutex);
 		pSlot->CloseAllSessions();
 
 //        try {
@@ -195,6 +320,7 @@ namespace p11 {
 	std::shared_ptr<CSlot> CSlot::GetSlotFromReaderName(const char *name)
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 			for (SlotMap::iterator it = g_mSlots.begin(); it != g_mSlots.end(); it++) {
 				if (strcmp(it->second->szName.c_str(), name) == 0) {
 					return it->second;
@@ -206,6 +332,7 @@ namespace p11 {
 	std::shared_ptr<CSlot> CSlot::GetSlotFromID(CK_SLOT_ID hSlotId)
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 			SlotMap::const_iterator pPair;
 		pPair = g_mSlots.find(hSlotId);
 		if (pPair == g_mSlots.end()) {
@@ -250,23 +377,22 @@ namespace p11 {
 		// cancellare quelli che non ci sono pi
 		init_func
 			bool bMapChanged = false;
-		DWORD readersLen = 0;
-
-		CCardContext Context;
-
 		if (!bP11Initialized)
 			return;
 
-		auto ris = SCardListReaders(Context, NULL, NULL, &readersLen);
+		// l'elenco dei lettori usa il context condiviso del processo
+		SCARDCONTEXT hContext;
+		auto ris = CSharedCardContext::get(hContext);
+		if (ris != S_OK)
+			throw windows_error(ris);
+		std::string readers;
+		ris = CSharedCardContext::listReaders(hContext, readers);
 		if (ris != S_OK) {
 			if (ris == SCARD_E_NO_READERS_AVAILABLE)
 				return;
 			throw windows_error(ris);
 		}
-		std::string readers;
-		readers.resize(readersLen + 1);
-		if ((ris = SCardListReaders(Context, NULL, &readers[0], &readersLen)) != SCARD_S_SUCCESS)
-			throw windows_error(ris);
+		DWORD readersLen = (DWORD)readers.size();
 
 		const char *szReaderName = readers.c_str();
 
@@ -309,19 +435,65 @@ namespace p11 {
 				bMapChanged = true;
 			}
 		}
-		bMonitorUpdate = bMapChanged;
-
 		if (!bP11Initialized)
 			return;
 
-        if (!Thread.joinable())
+        if (!Thread.joinable()) {
+			// lo stato lasciato da un monitor precedente non  pi affidabile
+			for (SlotMap::iterator it = g_mSlots.begin(); it != g_mSlots.end(); it++)
+				it->second->SetReaderState(nullptr);
+			MonitorRunning = true;
             Thread = std::thread(slotMonitor, &g_mSlots);
+		}
+		else if (bMapChanged) {
+			// il monitor  fermo nell'attesa senza timeout: lo sveglio perch rilegga la mappa
+			bMonitorUpdate = true;
+			CancelMonitor();
+		}
+
+	}
+
+	bool CSlot::RemovePending()
+	{
+		return dwRemoveSynced != dwRemoveCount;
+	}
 
+	void CSlot::SyncEvents()
+	{
+		// le estrazioni viste dal monitor mentre lo slot era occupato: la carta (e con lei le
+		// sessioni e gli oggetti dello slot) non c'e' piu'
+		DWORD dwRemoved = dwRemoveCount;
+		if (dwRemoveSynced == dwRemoved)
+			return;
+		Final();
+		baATR.clear();
+		dwRemoveSynced = dwRemoved;
+	}
+
+	std::shared_ptr<const CSlotReaderState> CSlot::GetReaderState()
+	{
+		return std::atomic_load(&readerState);
+	}
+
+	void CSlot::SetReaderState(std::shared_ptr<const CSlotReaderState> state)
+	{
+		std::atomic_store(&readerState, std::move(state));
 	}
 
 	bool CSlot::IsTokenPresent()
 	{
 		init_func
+		// finch il monitor  attivo il suo stato  aggiornato ad ogni evento: rispondo
+		// senza interrogare il servizio PC/SC
+		if (MonitorRunning) {
+			auto readerState = GetReaderState();
+			if (readerState != nullptr) {
+				if ((readerState->dwState & SCARD_STATE_UNAVAILABLE) == SCARD_STATE_UNAVAILABLE)
+					throw p11_error(CKR_DEVICE_REMOVED);
+				return (readerState->dwState & SCARD_STATE_PRESENT) == SCARD_STATE_PRESENT;
+			}
+		}
+
 			SCARD_READERSTATE state;
 		memset(&state, 0, sizeof(SCARD_READERSTATE));
 		state.szReader = szName.c_str();
@@ -392,82 +564,90 @@ namespace p11 {
 		if (pTemplate == nullptr)
 			throw p11_error(CKR_TOKEN_NOT_RECOGNIZED);
 
-		memset(pInfo->label, ' ', sizeof(pInfo->label));
-		CryptoPP::memcpy_s((char*)pInfo->label, 32, pTemplate->szName.c_str(), min(pTemplate->szName.length(), sizeof(pInfo->label)));
-		memset(pInfo->manufacturerID, ' ', sizeof(pInfo->manufacturerID));
-
-		std::string manifacturer;
-		size_t position;
-		if (baATR.indexOf(baNXP_ATR, position))
-			manifacturer = "NXP";
-		else if ((baATR.indexOf(baGemalto_ATR, position)) ||
-			(baATR.indexOf(baGemalto2_ATR, position)))
-			manifacturer = "Gemalto";
-		else
-			throw p11_error(CKR_TOKEN_NOT_RECOGNIZED);
+		// la parte fissa dipende solo dalla carta inserita: la costruisco una volta e ad ogni
+		// chiamata la copio, aggiungendo i contatori delle sessioni
+		if (pTokenInfoTemplate != pTemplate) {
+			memset(tokenInfo.label, ' ', sizeof(tokenInfo.label));
+			CryptoPP::memcpy_s((char*)tokenInfo.label, 32, pTemplate->szName.c_str(), min(pTemplate->szName.length(), sizeof(tokenInfo.label)));
+			memset(tokenInfo.manufacturerID, ' ', sizeof(tokenInfo.manufacturerID));
+
+			std::string manifacturer;
+			size_t position;
+			if (baATR.indexOf(baNXP_ATR, position))
+				manifacturer = "NXP";
+			else if ((baATR.indexOf(baGemalto_ATR, position)) ||
+				(baATR.indexOf(baGemalto2_ATR, position)))
+				manifacturer = "Gemalto";
+			else
+				throw p11_error(CKR_TOKEN_NOT_RECOGNIZED);
+
+			CryptoPP::memcpy_s((char*)tokenInfo.manufacturerID, 32, manifacturer.c_str(), manifacturer.size());
+
+			if (baSerial.isEmpty() || pSerialTemplate != pTemplate) {
+				pSerialTemplate = pTemplate;
+				baSerial = pTemplate->FunctionList.templateGetSerial(*this);
+			}
 
-		CryptoPP::memcpy_s((char*)pInfo->manufacturerID, 32, manifacturer.c_str(), manifacturer.size());
+			std::string model;
+			pTemplate->FunctionList.templateGetModel(*this, model);
 
-		if (baSerial.isEmpty() || pSerialTemplate != pTemplate) {
-			pSerialTemplate = pTemplate;
-			baSerial = pTemplate->FunctionList.templateGetSerial(*this);
-		}
+			memset(tokenInfo.serialNumber, ' ', sizeof(tokenInfo.serialNumber));
+			size_t UIDsize = min(sizeof(tokenInfo.serialNumber), baSerial.size());
+			CryptoPP::memcpy_s(tokenInfo.serialNumber, 16, baSerial.data(), UIDsize);
+
+			CryptoPP::memcpy_s((char*)tokenInfo.label + pTemplate->szName.length() + 1, sizeof(tokenInfo.label) - pTemplate->szName.length() - 1, baSerial.data(), baSerial.size());
+
+			memset(tokenInfo.model, ' ', sizeof(tokenInfo.model));
+			CryptoPP::memcpy_s(tokenInfo.model, 16, model.c_str(), min(model.length(), sizeof(tokenInfo.model)));
 
-		std::string model;
-		pTemplate->FunctionList.templateGetModel(*this, model);
+			CK_FLAGS dwFlags;
+			pTemplate->FunctionList.templateGetTokenFlags(*this, dwFlags);
+			tokenInfo.flags = dwFlags;
 
-		memset(pInfo->serialNumber, ' ', sizeof(pInfo->serialNumber));
-		size_t UIDsize = min(sizeof(pInfo->serialNumber), baSerial.size());
-		CryptoPP::memcpy_s(pInfo->serialNumber, 16, baSerial.data(), UIDsize);
+			tokenInfo.ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+			tokenInfo.ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+			tokenInfo.ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+			tokenInfo.ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+			tokenInfo.ulMaxSessionCount = MAXSESSIONS;
+			tokenInfo.ulMaxRwSessionCount = MAXSESSIONS;
 
-		CryptoPP::memcpy_s((char*)pInfo->label + pTemplate->szName.length() + 1, sizeof(pInfo->label) - pTemplate->szName.length() - 1, baSerial.data(), baSerial.size());
+			tokenInfo.ulMinPinLen = 5;
+			tokenInfo.ulMaxPinLen = 8;
 
-		memset(pInfo->model, ' ', sizeof(pInfo->model));
-		CryptoPP::memcpy_s(pInfo->model, 16, model.c_str(), min(model.length(), sizeof(pInfo->model)));
+			tokenInfo.hardwareVersion.major = 0;
+			tokenInfo.hardwareVersion.minor = 0;
 
-		CK_FLAGS dwFlags;
-		pTemplate->FunctionList.templateGetTokenFlags(*this, dwFlags);
-		pInfo->flags = dwFlags;
+			tokenInfo.firmwareVersion.major = 0;
+			tokenInfo.firmwareVersion.minor = 0;
+
+			CryptoPP::memcpy_s((char*)tokenInfo.utcTime, 16, "1234567890123456", 16);  // OK
+			pTokenInfoTemplate = pTemplate;
+		}
+		*pInfo = tokenInfo;
 
-		pInfo->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
-		pInfo->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
-		pInfo->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
-		pInfo->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
-		pInfo->ulMaxSessionCount = MAXSESSIONS;
 		size_t dwSessCount = SessionCount();
 
 		pInfo->ulSessionCount = (CK_ULONG)dwSessCount;
 		size_t dwRWSessCount = RWSessionCount();
 
 		pInfo->ulRwSessionCount = dwRWSessCount;
-		pInfo->ulMaxRwSessionCount = MAXSESSIONS;
-
-		pInfo->ulMinPinLen = 5;
-		pInfo->ulMaxPinLen = 8;
-
-		pInfo->hardwareVersion.major = 0;
-		pInfo->hardwareVersion.minor = 0;
-
-		pInfo->firmwareVersion.major = 0;
-		pInfo->firmwareVersion.minor = 0;
-
-		CryptoPP::memcpy_s((char*)pInfo->utcTime, 16, "1234567890123456", 16);  // OK
 	}
 
 	void CSlot::CloseAllSessions()
 	{
 		init_func
 
-			SessionMap::iterator it = CSession::g_mSessions.begin();
-		while (it != CSession::g_mSessions.end()) {
-			if (it->second->pSlot.get() == this)
-			{
-				CSession *pSession = it->second.get();
-				it++;
-				CSession::DeleteSession(pSession->hSessionHandle);
+		// la DeleteSession pu andare sulla carta: la faccio fuori dal lock della tabella
+		std::vector<CK_SESSION_HANDLE> sessions;
+		{
+			std::unique_lock<std::mutex> lock(p11TableMutex);
+			for (SessionMap::iterator it = CSession::g_mSessions.begin(); it != CSession::g_mSessions.end(); it++) {
+				if (it->second->pSlot.get() == this)
+					sessions.push_back(it->first);
 			}
-			else it++;
 		}
+		for (auto hSession : sessions)
+			CSession::DeleteSession(hSession);
 	}
 
 	void CSlot::Init()
@@ -499,23 +679,35 @@ namespace p11 {
 
 			P11Objects.clear();
 
-			// cancello tutte le sessioni
-			SessionMap::iterator it = CSession::g_mSessions.begin();
-			while (it != CSession::g_mSessions.end()) {
-				if (it->second->pSlot.get() == this)
-				{
-					it = CSession::g_mSessions.erase(it);
-					dwSessionCount--;
+			// cancello tutte le sessioni; le distruggo fuori dal lock della tabella
+			std::vector<std::shared_ptr<CSession>> removed;
+			{
+				std::unique_lock<std::mutex> lock(p11TableMutex);
+				SessionMap::iterator it = CSession::g_mSessions.begin();
+				while (it != CSession::g_mSessions.end()) {
+					if (it->second->pSlot.get() == this)
+					{
+						removed.push_back(it->second);
+						if (it->second->flags & CKF_RW_SESSION)
+							dwRWSessionCount--;
+						it = CSession::g_mSessions.erase(it);
+						dwSessionCount--;
+					}
+					else it++;
 				}
-				else it++;
 			}
 			// dwSessionCount dovrebbe essere gi a 0...
 			// ma per sicurezza lo setto a manina
 
 			User = CKU_NOBODY;
 			dwSessionCount = 0;
+			dwRWSessionCount = 0;
 			bUpdated = false;
 		}
+		// alla prossima carta le informazioni del token vanno ricostruite, seriale compreso
+		pTokenInfoTemplate = NULL;
+		baSerial.clear();
+		Disconnect();
 	}
 
 	std::shared_ptr<CP11Object> CSlot::FindP11Object(CK_OBJECT_CLASS objClass, CK_ATTRIBUTE_TYPE attr, CK_BYTE *val, int valLen)
@@ -546,6 +738,7 @@ namespace p11 {
 	void CSlot::ClearP11Objects()
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(objMutex);
 			P11Objects.clear();
 		ObjP11Map.clear();
 		HandleP11Map.clear();
@@ -564,6 +757,7 @@ namespace p11 {
 		}
 		ER_ASSERT(bFound, ERR_FIND_OBJECT)
 
+		std::unique_lock<std::mutex> lock(objMutex);
 			ObjHandleMap::iterator itObj = ObjP11Map.find(object);
 		if (itObj != ObjP11Map.end()) {
 			HandleObjMap::iterator itHandle = HandleP11Map.find(itObj->second);
@@ -582,12 +776,7 @@ namespace p11 {
 	size_t CSlot::RWSessionCount()
 	{
 		init_func
-			size_t  dwRWSessCount = 0;
-		for (SessionMap::iterator it = CSession::g_mSessions.begin(); it != CSession::g_mSessions.end(); it++) {
-			if (it->second->pSlot.get() == this && (it->second->flags & CKF_RW_SESSION) != 0)
-				dwRWSessCount++;
-		}
-		return dwRWSessCount;
+		return dwRWSessionCount;
 	}
 
 	CK_OBJECT_HANDLE CSlot::GetIDFromObject(const std::shared_ptr<CP11Object>&pObject)
@@ -597,6 +786,7 @@ namespace p11 {
 			if (pObject->IsPrivate() && User != CKU_USER)
 				throw p11_error(CKR_USER_NOT_LOGGED_IN);
 
+		std::unique_lock<std::mutex> lock(objMutex);
 		ObjHandleMap::const_iterator pPair;
 		pPair = ObjP11Map.find(pObject);
 		if (pPair == ObjP11Map.end()) {
@@ -619,6 +809,7 @@ namespace p11 {
 	void CSlot::DelObjectHandle(const std::shared_ptr<CP11Object>& pObject)
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(objMutex);
 			ObjHandleMap::iterator pPair;
 		pPair = ObjP11Map.find(pObject);
 		if (pPair != ObjP11Map.end()) {
@@ -633,6 +824,7 @@ namespace p11 {
 	std::shared_ptr<CP11Object> CSlot::GetObjectFromID(CK_OBJECT_HANDLE hObjectHandle)
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(objMutex);
 			HandleObjMap::const_iterator pPair;
 		pPair = HandleP11Map.find(hObjectHandle);
 		if (pPair == HandleP11Map.end())
@@ -645,6 +837,25 @@ namespace p11 {
 		init_func
 			DWORD dwProtocol;
 
+		// la connessione resta aperta finch la carta  nel lettore, cos fra un'operazione e
+		// l'altra non si perdono l'applicazione selezionata e il canale SM. La ristabilisco
+		// solo se un'altra applicazione ha resettato la carta o se l'handle non vale pi
+		if (hCard != NULL) {
+			char szReader[256];
+			BYTE ATR[40];
+			DWORD dwState, dwReaderLen = sizeof(szReader), dwAtrLen = sizeof(ATR);
+			DWORD ris = SCardStatus(hCard, szReader, &dwReaderLen, &dwState, &dwProtocol, ATR, &dwAtrLen);
+			if (ris == SCARD_S_SUCCESS)
+				return;
+			if (ris == SCARD_W_RESET_CARD &&
+				SCardReconnect(hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwProtocol) == SCARD_S_SUCCESS)
+				return;
+			// carta estratta (SCARD_W_REMOVED_CARD) o servizio riavviato: riapro da capo
+			Log.write("Connessione allo slot non piu' valida - %08X", ris);
+			SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+			hCard = NULL;
+		}
+
 		Context.validate();
 		bool retry = false;
 		while (true) {
@@ -718,7 +929,12 @@ namespace p11 {
 				ATR = baATR;
 				return;
 			}
-		baATR = GetATR();
+		// l'ATR letto dal monitor non richiede una connessione alla carta
+		auto readerState = MonitorRunning ? GetReaderState() : nullptr;
+		if (readerState != nullptr && readerState->ATR.size() != 0)
+			baATR = readerState->ATR;
+		else
+			baATR = GetATR();
 		ATR = baATR;
 	}
 
@@ -9,6 +9,8 @@
 #include <vector>
 #include <memory>
 #include <thread>
+#include <mutex>
+#include <atomic>
 
 namespace p11 {
 
@@ -34,19 +36,29 @@ enum SlotEvent {
 	SE_Inserted
 };
 
+// stato del lettore come lo vede il monitor degli eventi; presenza e ATR si pubblicano
+// insieme, cos chi legge non vede mai la presenza di una carta con l'ATR di un'altra
+struct CSlotReaderState {
+	DWORD dwState;		// SCARD_STATE_* dell'ultima SCardGetStatusChange
+	ByteDynArray ATR;	// ATR della carta presente (vuoto se non c' carta)
+};
+
 class CSlot
 {
 private:
 	static DWORD dwSlotCnt; //counter degli slot (ID P11)
+	std::shared_ptr<const CSlotReaderState> readerState;	// solo via std::atomic_load/atomic_store
 	ByteDynArray GetATR();
 
 public:
-	SCARDHANDLE hCard;
+	SCARDHANDLE hCard;		// connessione condivisa, aperta finch la carta  nel lettore
 	void Connect();
+	void Disconnect();
 	DWORD dwSessionCount; // numero di session aperte su questo slot
+	DWORD dwRWSessionCount; // di cui in lettura/scrittura
 
 	static SlotMap g_mSlots; //mappa globale degli slot
-	static bool bMonitorUpdate; //mappa globale degli slot
+	static std::atomic<bool> bMonitorUpdate; // il monitor deve rileggere la mappa degli slot
 
 	CK_SLOT_ID hSlot; // ID P11 dello slot
 
@@ -58,10 +70,15 @@ public:
 	ByteDynArray baSerial;
 	std::shared_ptr<CCardTemplate> pSerialTemplate;
 
+	CK_TOKEN_INFO tokenInfo;	// parte fissa di CK_TOKEN_INFO, costruita una volta per carta inserita
+	std::shared_ptr<CCardTemplate> pTokenInfoTemplate;	// template con cui  stata costruita (NULL se da rifare)
+
 	ByteDynArray baATR;
 	void GetATR(ByteArray &ATR);
 	
 	DWORD dwP11ObjCnt;			//counter degli oggetti (ID P11)
+	std::mutex objMutex;		// protegge le due mappe seguenti, lette anche dalle
+								// operazioni software che non prendono slotMutex
 	HandleObjMap HandleP11Map;	// mi servono due mappe per gestire correttamente
 	ObjHandleMap ObjP11Map;		// gli ID oggetti specifici per uno slot
 								// una per tradurre gli ID passati dall'applicazione,
@@ -97,6 +114,9 @@ public:
 	void ClearP11Objects();
 	bool IsTokenPresent();
 
+	std::shared_ptr<const CSlotReaderState> GetReaderState();	// NULL se il monitor non lo conosce
+	void SetReaderState(std::shared_ptr<const CSlotReaderState> state);
+
 	P11ObjectVector P11Objects; // vettore degli oggetti
 
 	std::shared_ptr<CCardTemplate> pTemplate;	// template della carta
@@ -108,9 +128,23 @@ public:
 
 	static std::thread Thread;		// thread monitor degli eventi
 	static CCardContext *ThreadContext; // context del monitor degli eventi
-
-	//CSyncroMutex slotMutex;		// mutex per il lock alla carta
-	SlotEvent lastEvent;
+	static std::mutex MonitorMutex;		// protegge ThreadContext
+	static std::atomic<bool> MonitorRunning;	// il thread monitor non e' ancora uscito
+	static std::atomic<DWORD> MonitorWakeups;	// risvegli dell'attesa del monitor
+	static void CancelMonitor();	// interrompe l'attesa del monitor (aggiornamento o C_Finalize)
+
+	std::atomic<DWORD> dwInsertCount;	// inserimenti visti dal monitor
+	std::atomic<DWORD> dwRemoveCount;	// estrazioni viste dal monitor
+	std::atomic<DWORD> dwRemoveSynced;	// estrazioni gia' applicate allo stato dello slot
+	bool RemovePending();		// c'e' un'estrazione non ancora applicata
+	void SyncEvents();			// applica le estrazioni viste dal monitor; va chiamata con slotMutex
+	static void QueuePrefetch(std::shared_ptr<CSlot> pSlot);	// legge in anticipo la carta appena inserita
+	static void StopPrefetch();
+
+	std::mutex slotMutex;		// corsia dello slot: serializza l'I/O verso la carta e le sessioni
+								// aperte sullo slot; si acquisisce dopo p11Mutex e prima
+								// di p11TableMutex, mai al contrario
+	std::atomic<SlotEvent> lastEvent; // scritto dal monitor, consumato da C_WaitForSlotEvent
 
 	void GetInfo(CK_SLOT_INFO_PTR pInfo);
 	void GetTokenInfo(CK_TOKEN_INFO_PTR pInfo);
@@ -6,6 +6,7 @@
 #include "../Crypto/RSA.h"
 
 extern CLog Log;
+extern std::mutex p11TableMutex;
 
 static char *szCompiledFile = __FILE__;
 
@@ -86,12 +87,15 @@ namespace p11 {
 	CK_SESSION_HANDLE CSession::AddSession(std::unique_ptr<CSession> pSession)
 	{
 		init_func
-        pSession->hSessionHandle = (CK_SESSION_HANDLE)GetNewSessionID();
-		auto id = pSession->hSessionHandle;
-
 		pSession->pSlot->pTemplate->FunctionList.templateInitSession(pSession->pSlot->pTemplateData);
 
 		pSession->pSlot->dwSessionCount++;
+		if (pSession->flags & CKF_RW_SESSION)
+			pSession->pSlot->dwRWSessionCount++;
+
+		std::unique_lock<std::mutex> lock(p11TableMutex);
+        pSession->hSessionHandle = (CK_SESSION_HANDLE)GetNewSessionID();
+		auto id = pSession->hSessionHandle;
 		g_mSessions.insert(std::make_pair(pSession->hSessionHandle, std::move(pSession)));
 
 		return id;
@@ -105,6 +109,8 @@ namespace p11 {
 		ER_ASSERT(pSession != nullptr, ERR_SESSION_NOT_OPENED);
 
 		pSession->pSlot->dwSessionCount--;
+		if (pSession->flags & CKF_RW_SESSION)
+			pSession->pSlot->dwRWSessionCount--;
 		if (pSession->pSlot->dwSessionCount == 0) {
 			if (pSession->pSlot->User != CKU_NOBODY) {
 				pSession->Logout();
@@ -112,12 +118,15 @@ namespace p11 {
 		}
 
 		pSession->pSlot->pTemplate->FunctionList.templateFinalSession(pSession->pSlot->pTemplateData);
+
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		g_mSessions.erase(hSessionHandle);
 	}
 
 	std::shared_ptr<CSession> CSession::GetSessionFromID(CK_SESSION_HANDLE hSessionHandle)
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		SessionMap::const_iterator pPair;
 		pPair = g_mSessions.find(hSessionHandle);
 		if (pPair == g_mSessions.end())
@@ -362,6 +371,7 @@ namespace p11 {
 	bool CSession::ExistsRO()
 	{
 		init_func
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		for (SessionMap::const_iterator it = g_mSessions.begin(); it != g_mSessions.end(); it++)
 		{
 			if (it->second->pSlot == pSlot && (it->second->flags & CKF_RW_SESSION) == 0) {
@@ -377,6 +387,7 @@ namespace p11 {
 		init_func
 		if (pSlot->User != CKU_SO)
 			return false;
+		std::unique_lock<std::mutex> lock(p11TableMutex);
 		for (SessionMap::const_iterator it = g_mSessions.begin(); it != g_mSessions.end(); it++)
 		{
 			if (it->second->pSlot == pSlot && (it->second->flags & CKF_RW_SESSION) != 0)
@@ -451,17 +462,17 @@ namespace p11 {
 			if (pDigestMechanism == nullptr)
 				throw p11_error(CKR_OPERATION_NOT_INITIALIZED);
 
-		auto mech = std::move(pDigestMechanism);
+		auto mech = make_resetter(pDigestMechanism);
 		CK_ULONG ulReqLen = pDigestMechanism->DigestLength();
 
 		if (!Digest.isNull() && Digest.size()<ulReqLen) {
-				pDigestMechanism = std::move(mech);
+				mech.release();
 				throw p11_error(CKR_BUFFER_TOO_SMALL);
 			}
 
 		Digest = Digest.left(ulReqLen);
 		if (Digest.isNull()) {
-			pDigestMechanism = std::move(mech);
+			mech.release();
 			return;
 		}
 		pDigestMechanism->DigestFinal(Digest);
@@ -763,6 +774,72 @@ namespace p11 {
 		}
 	}
 
+	// firma ogni elemento di Data come farebbe C_Sign, ma con una sola autenticazione della
+	// carta per tutto il lotto. Gli esiti sono per elemento; se Signatures e' vuoto restituisce
+	// solo le dimensioni e l'operazione resta attiva
+	void CSession::SignBatch(std::vector<ByteArray> &Data, std::vector<ByteArray> &Signatures, std::vector<CK_ULONG> &SignatureLen, std::vector<CK_RV> &Results)
+	{
+		init_func
+		if (pSignMechanism == nullptr)
+			throw p11_error(CKR_OPERATION_NOT_INITIALIZED);
+
+		auto mech = make_resetter(pSignMechanism);
+
+		std::shared_ptr<CP11Object> pObject = pSlot->GetObjectFromID(pSignMechanism->hSignKey);
+		if (pObject == NULL)
+			throw p11_error(CKR_KEY_HANDLE_INVALID);
+		if (pObject->ObjClass != CKO_PRIVATE_KEY)
+			throw p11_error(CKR_KEY_HANDLE_INVALID);
+
+		auto pSignKey = std::static_pointer_cast<CP11PrivateKey>(pObject);
+
+		if (pSignKey->IsPrivate() && pSlot->User != CKU_USER)
+			throw p11_error(CKR_USER_NOT_LOGGED_IN);
+
+		CK_ULONG ulSignLength = pSignMechanism->SignLength();
+		SignatureLen.assign(Data.size(), ulSignLength);
+		Results.assign(Data.size(), CKR_OK);
+		if (Signatures.empty()) {
+			mech.release();
+			return;
+		}
+
+		// il padding e il controllo delle lunghezze li fa il meccanismo, elemento per elemento
+		std::vector<ByteDynArray> baSignBuffers;
+		std::vector<size_t> index;
+		for (size_t i = 0; i < Data.size(); i++) {
+			if (Signatures[i].size() < ulSignLength) {
+				Results[i] = CKR_BUFFER_TOO_SMALL;
+				continue;
+			}
+			try {
+				pSignMechanism->SignReset();
+				pSignMechanism->SignUpdate(Data[i]);
+				baSignBuffers.push_back(pSignMechanism->SignFinal());
+				index.push_back(i);
+			}
+			catch (p11_error &err) {
+				Results[i] = err.getP11ErrorCode();
+			}
+		}
+		if (baSignBuffers.empty())
+			return;
+
+		bool bSilent = false;
+		std::vector<ByteDynArray> baSignatures(baSignBuffers.size());
+		std::vector<CK_RV> results(baSignBuffers.size(), CKR_GENERAL_ERROR);
+		pSlot->pTemplate->FunctionList.templateSignBatch(pSlot->pTemplateData, pSignKey.get(), baSignBuffers, baSignatures, results, pSignMechanism->mtType, bSilent);
+
+		for (size_t j = 0; j < index.size(); j++) {
+			size_t i = index[j];
+			Results[i] = results[j];
+			if (results[j] == CKR_OK) {
+				Signatures[i].copy(baSignatures[j]);
+				SignatureLen[i] = (CK_ULONG)baSignatures[j].size();
+			}
+		}
+	}
+
 	/* ******************* */
 	/*       SignRecover   */
 	/* ******************* */
@@ -12,6 +12,7 @@
 #endif
 #include "P11Object.h"
 #include <memory>
+#include <mutex>
 
 namespace p11 {
 
@@ -57,6 +58,8 @@ public:
 	CK_NOTIFY notify;
 
 	std::shared_ptr<CSlot> pSlot;
+	std::mutex sessionMutex;	// corsia della sessione: serializza le operazioni sulla sessione;
+								// le operazioni solo software prendono solo questo lock
 	CSession();
 	static std::shared_ptr<CSession> GetSessionFromID(CK_SESSION_HANDLE hSessionHandle);
 	static CK_SESSION_HANDLE AddSession(std::unique_ptr<CSession> pSession);
@@ -106,6 +109,7 @@ public:
 	void Sign(ByteArray &Data, ByteArray &Signature);
 	void SignUpdate(ByteArray &Data);
 	void SignFinal(ByteArray &Signature);
+	void SignBatch(std::vector<ByteArray> &Data, std::vector<ByteArray> &Signatures, std::vector<CK_ULONG> &SignatureLen, std::vector<CK_RV> &Results);
 	std::unique_ptr<CSign> pSignMechanism;
 
 	void SignRecoverInit(CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
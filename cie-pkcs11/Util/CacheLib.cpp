@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <vector>
 #include <fstream>
+#include <iterator>
 //#include "sddl.h"
 //#include "Aclapi.h"
 //#include <VersionHelpers.h>
@@ -235,6 +236,58 @@ bool CacheRemove(const char *PAN) {
     char szPath[MAX_PATH];
     GetCardPath(PAN, szPath);
     
+    // i dati della carta non hanno senso senza l'abilitazione
+    CacheRemoveCardData(PAN);
+    
+    return !remove(szPath);
+}
+
+// dati pubblici della carta (chiave DAPP, parametri DH), gia' cifrati dal chiamante;
+// sono in un file separato per non toccare il formato della cache di PIN e certificato
+void GetCardDataPath(const char *PAN, char szPath[MAX_PATH]) {
+    auto Path=GetCardDir();
+    
+    Path += std::string(PAN);
+    Path += ".data";
+    strcpy(szPath, Path.c_str());
+}
+
+bool CacheGetCardData(const char *PAN, std::vector<uint8_t>&data) {
+    if (PAN == nullptr)
+        throw logged_error("Il PAN è necessario");
+    
+    char szPath[MAX_PATH];
+    GetCardDataPath(PAN, szPath);
+    
+    if (!file_exists(szPath))
+        return false;
+    
+    std::ifstream file(szPath, std::ifstream::in | std::ifstream::binary);
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !data.empty();
+}
+
+void CacheSetCardData(const char *PAN, uint8_t *data, int dataSize) {
+    if (PAN == nullptr)
+        throw logged_error("Il PAN è necessario");
+    
+    auto szDir=GetCardDir();
+    struct stat st = {0};
+    if (stat(szDir.c_str(), &st) == -1)
+        mkdir(szDir.c_str(), 0700);
+    
+    char szPath[MAX_PATH];
+    GetCardDataPath(PAN, szPath);
+    
+    std::ofstream file(szPath, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    file.write((char*)data, dataSize);
+    file.close();
+}
+
+bool CacheRemoveCardData(const char *PAN) {
+    char szPath[MAX_PATH];
+    GetCardDataPath(PAN, szPath);
+    
     return !remove(szPath);
 }
 
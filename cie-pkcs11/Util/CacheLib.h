@@ -7,3 +7,6 @@ void CacheGetCertificate(const char *PAN, std::vector<uint8_t>&certificate);
 void CacheGetPIN(const char *PAN, std::vector<uint8_t>&PIN);
 void CacheSetData(const char *PAN, uint8_t *certificate, int certificateSize, uint8_t *FirstPIN, int FirstPINSize);
 bool CacheRemove(const char *PAN);
+bool CacheGetCardData(const char *PAN, std::vector<uint8_t>&data);
+void CacheSetCardData(const char *PAN, uint8_t *data, int dataSize);
+bool CacheRemoveCardData(const char *PAN);
@@ -48,7 +48,7 @@ logged_error::logged_error(const char *message) : std::runtime_error(message) {
 
 scard_error::scard_error(StatusWord sw) : logged_error(stdPrintf("Errore smart card:%04x", sw)) { }
 
-windows_error::windows_error(long ris) : logged_error(stdPrintf("Errore windows:(%08x) ", ris)) {}
+windows_error::windows_error(long ris) : logged_error(stdPrintf("Errore windows:(%08x) ", ris)), ris(ris) {}
 
 
 //#endif
@@ -23,8 +23,10 @@ public:
 };
 
 class windows_error : logged_error {
+	long ris;
 public:
 	windows_error(long  ris);
+	long getErrorCode() { return ris; }
 };
 
 /*
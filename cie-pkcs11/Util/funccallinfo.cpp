@@ -1,51 +1,46 @@
-
 #include "funccallinfo.h"
 #include <stdio.h>
 
 static char *szCompiledFile=__FILE__;
 
-thread_local size_t tlsCallDepth = 0;
-thread_local std::unique_ptr<CFuncCallInfoList> callQueue = nullptr;
-extern bool FunctionLog;
+bool FunctionTrace = false;
 extern unsigned int GlobalDepth;
 extern bool GlobalParam;
 char szEmpty[]={NULL};
 
-CFuncCallInfo::CFuncCallInfo(const char *name, CLog &logInfo) : log(logInfo) {
-	fName = name;
-	//OutputDebugString(fName);
-	if (FunctionLog) {
-		if (tlsCallDepth < GlobalDepth) {
-			LogNum = logInfo.write("%*sIN -> %s", (DWORD)tlsCallDepth, szEmpty, fName);
-		}
-	}
+#if FUNC_TRACE
 
-	//fName = name;
-	tlsCallDepth = tlsCallDepth + 1;
+thread_local size_t tlsCallDepth = 0;
+thread_local const char *tlsCallStack[CallStackSize];
 
+void CFuncCallInfo::enter(CLog &logInfo) {
+	if (tlsCallDepth < GlobalDepth)
+		LogNum = logInfo.write("%*sIN -> %s", (DWORD)tlsCallDepth, szEmpty, fName);
 
-	auto head = callQueue.release();
-	callQueue = std::unique_ptr<CFuncCallInfoList>(new CFuncCallInfoList(this));
-	callQueue->next = std::unique_ptr<CFuncCallInfoList>(head);
+	if (tlsCallDepth < CallStackSize)
+		tlsCallStack[tlsCallDepth] = fName;
+	tlsCallDepth = tlsCallDepth + 1;
 }
 
-CFuncCallInfo::~CFuncCallInfo() {
-	//OutputDebugString(stdPrintf("OUT %s", fName).c_str());
-	//fName = NULL;
-	tlsCallDepth=tlsCallDepth-1;
-	//if (fName)
-	//	log.write("%*sOUT -> %s (%u)",(DWORD)tlsCallDepth,szEmpty,fName,LogNum-1);
-
-	if (callQueue!=nullptr && callQueue->info == this) {
-		auto head = callQueue->next.release();
-		callQueue = std::unique_ptr<CFuncCallInfoList>(head);
-	}
-	else {
-		callQueue = nullptr;
+void CFuncCallInfo::leave() {
+	if (tlsCallDepth == 0) {
 		OutputDebugString("Errore nella sequenza delle funzioni");
+		return;
 	}
+	tlsCallDepth = tlsCallDepth - 1;
+	//log.write("%*sOUT -> %s (%u)",(DWORD)tlsCallDepth,szEmpty,fName,LogNum-1);
+}
+
+size_t CFuncCallInfo::CallStack(const char **&stack) {
+	stack = tlsCallStack;
+	return tlsCallDepth < CallStackSize ? tlsCallDepth : CallStackSize;
 }
 
-const char *CFuncCallInfo::FunctionName() {
-	return fName;
+#else
+
+size_t CFuncCallInfo::CallStack(const char **&stack) {
+	stack = nullptr;
+	return 0;
 }
+
+#endif
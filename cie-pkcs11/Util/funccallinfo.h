@@ -3,20 +3,44 @@
 #include "log.h"
 #include <memory>
 
+// Traccia delle chiamate (init_func / init_p11_func).
+// Con FUNC_TRACE a 0 la traccia e' esclusa in compilazione; altrimenti e' abilitata a runtime
+// da FunctionTrace (LogEnable e FunctionLog nel file di configurazione). Da disabilitata
+// costa un solo test, senza allocazioni ne' formattazione.
+#ifndef FUNC_TRACE
+#define FUNC_TRACE 1
+#endif
+
+// profondita' massima dello stack delle chiamate registrato per thread
+#define CallStackSize 64
+
+extern bool FunctionTrace;
+
 class  CFuncCallInfo {
+#if FUNC_TRACE
 	const char *fName;
 	unsigned int LogNum;
-	CLog &log;
-public:
-	CFuncCallInfo(const char *name,CLog &logInfo);
-	~CFuncCallInfo();
+	bool traced;
 
-	const char *FunctionName();
-};
-
-class CFuncCallInfoList {
+	void enter(CLog &logInfo);
+	void leave();
+#endif
 public:
-	CFuncCallInfoList(CFuncCallInfo *info) : info(info) {}
-	CFuncCallInfo *info;
-	std::unique_ptr<CFuncCallInfoList> next = nullptr;
+#if FUNC_TRACE
+	CFuncCallInfo(const char *name, CLog &logInfo) : fName(name), traced(FunctionTrace) {
+		if (traced)
+			enter(logInfo);
+	}
+	~CFuncCallInfo() {
+		if (traced)
+			leave();
+	}
+	const char *FunctionName() { return fName; }
+#else
+	CFuncCallInfo(const char *name, CLog &logInfo) {}
+	const char *FunctionName() { return ""; }
+#endif
+
+	// stack delle chiamate tracciate nel thread corrente (la piu' recente per ultima)
+	static size_t CallStack(const char **&stack);
 };
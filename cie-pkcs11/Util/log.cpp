@@ -1,4 +1,10 @@
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "util.h"
 #include "ModuleInfo.h"
 #include <vector>
@@ -18,6 +24,7 @@ static char *szCompiledFile=__FILE__;
 std::string globalLogDir;
 std::string globalLogName;
 bool FunctionLog=false;
+extern bool FunctionTrace;
 bool globalLogParam=false;
 bool firstGlobal=false;
 const char *logGlobalVersion;
@@ -33,6 +40,208 @@ enum logMode {
 	LM_Module_Thread	// un file per modulo e per thread
 } LogMode = LM_Module;
 
+// Scrittura asincrona del log.
+// Ogni thread formatta le righe e le accoda in un proprio ring buffer (un solo produttore,
+// un solo consumatore, senza lock); un thread di scrittura svuota periodicamente i buffer
+// tenendo aperti i file. Se un buffer è pieno la riga viene scartata e contata: la
+// memoria usata dal log è limitata a LogRingSize righe per thread.
+
+#define LogRingSize 512
+#define LogFlushInterval std::chrono::milliseconds(50)
+
+struct CLogRecord {
+	std::string path;
+	std::string line;
+};
+
+class CLogRing {
+public:
+	CLogRecord records[LogRingSize];
+	std::atomic<size_t> head;		// scritto solo dal thread proprietario
+	std::atomic<size_t> tail;		// scritto solo dal thread di scrittura
+	std::atomic<size_t> dropped;
+	std::atomic<bool> closed;		// il thread proprietario è terminato
+
+	CLogRing() : head(0), tail(0), dropped(0), closed(false) {}
+
+	// restituisce true se il buffer è arrivato a metà, per svegliare il writer
+	bool push(const std::string &path, const char *line, size_t len) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t used = h - tail.load(std::memory_order_acquire);
+		if (used >= LogRingSize) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		CLogRecord &rec = records[h % LogRingSize];
+		rec.path = path;
+		rec.line.assign(line, len);
+		head.store(h + 1, std::memory_order_release);
+		return used + 1 == LogRingSize / 2;
+	}
+};
+
+class CLogWriter {
+	std::mutex ringsMutex;		// solo per la registrazione dei buffer
+	std::vector<std::shared_ptr<CLogRing>> rings;
+	std::map<std::string, FILE*> files;
+
+	std::mutex wakeMutex;
+	std::condition_variable wake;
+	bool stop;
+	std::thread thread;
+
+	struct ThreadRing {
+		std::shared_ptr<CLogRing> ring;
+		~ThreadRing() {
+			if (ring)
+				ring->closed = true;
+		}
+	};
+
+	FILE *file(const std::string &path) {
+		auto it = files.find(path);
+		if (it != files.end())
+			return it->second;
+		FILE *lf = nullptr;
+#ifdef WIN32
+		fopen_s(&lf, path.c_str(), "a+t");
+#else
+		lf = fopen(path.c_str(), "a+t");
+#endif
+		if (lf)
+			files[path] = lf;
+		return lf;
+	}
+
+	void drain() {
+		std::vector<std::shared_ptr<CLogRing>> current;
+		{
+			std::unique_lock<std::mutex> lock(ringsMutex);
+			current = rings;
+		}
+		bool written = false;
+		for (auto &ring : current) {
+			size_t t = ring->tail.load(std::memory_order_relaxed);
+			size_t h = ring->head.load(std::memory_order_acquire);
+			FILE *lf = nullptr;
+			for (; t != h; t++) {
+				CLogRecord &rec = ring->records[t % LogRingSize];
+				lf = file(rec.path);
+				if (lf) {
+					fwrite(rec.line.data(), 1, rec.line.size(), lf);
+					fputc('\n', lf);
+					written = true;
+				}
+			}
+			ring->tail.store(t, std::memory_order_release);
+
+			size_t dropped = ring->dropped.exchange(0);
+			if (dropped != 0 && lf != nullptr)
+				fprintf(lf, "*** %u righe di log scartate (buffer pieno)\n", (unsigned int)dropped);
+		}
+		if (written) {
+			for (auto &f : files)
+				fflush(f.second);
+		}
+
+		// rimuovo i buffer dei thread terminati e già svuotati
+		std::unique_lock<std::mutex> lock(ringsMutex);
+		for (auto it = rings.begin(); it != rings.end();) {
+			if ((*it)->closed && (*it)->tail == (*it)->head)
+				it = rings.erase(it);
+			else
+				it++;
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(wakeMutex);
+		while (!stop) {
+			wake.wait_for(lock, LogFlushInterval);
+			lock.unlock();
+			drain();
+			lock.lock();
+		}
+	}
+
+public:
+	static std::atomic<bool> Destroyed;
+
+	CLogWriter() : stop(false) {
+		thread = std::thread(&CLogWriter::run, this);
+	}
+
+	~CLogWriter() {
+		Destroyed = true;
+		{
+			std::unique_lock<std::mutex> lock(wakeMutex);
+			stop = true;
+		}
+		wake.notify_one();
+		thread.join();
+		drain();
+		for (auto &f : files)
+			fclose(f.second);
+	}
+
+	static CLogWriter &Instance() {
+		static CLogWriter writer;
+		return writer;
+	}
+
+	void write(const std::string &path, const char *line, size_t len) {
+		static thread_local ThreadRing threadRing;
+		if (!threadRing.ring) {
+			threadRing.ring = std::make_shared<CLogRing>();
+			std::unique_lock<std::mutex> lock(ringsMutex);
+			rings.push_back(threadRing.ring);
+		}
+		if (threadRing.ring->push(path, line, len))
+			wake.notify_one();
+	}
+};
+
+std::atomic<bool> CLogWriter::Destroyed(false);
+
+// il nome del thread nel file di log (LM_Thread e LM_Module_Thread) si calcola una volta sola
+static const std::string &threadLogSuffix()
+{
+	static thread_local std::string suffix;
+	if (suffix.empty()) {
+		std::hash<std::thread::id> hasher;
+		std::stringstream th;
+		th << std::setiosflags(std::ios::hex | std::ios::uppercase);
+		th << std::setw(8);
+		th << hasher(std::this_thread::get_id()) << ".log";
+		suffix = th.str();
+	}
+	return suffix;
+}
+
+static void logLine(CLog &log, const char *line, size_t len)
+{
+	const std::string *path = &log.logPath;
+	if (LogMode == LM_Thread || LogMode == LM_Module_Thread) {
+		// se siamo in LM_thread devo scrivere il thread nel nome del file
+		static thread_local std::string threadPath;
+		threadPath.assign(log.logPath.begin(), log.threadPos);
+		threadPath.append(threadLogSuffix());
+		path = &threadPath;
+	}
+
+	if (!CLogWriter::Destroyed) {
+		CLogWriter::Instance().write(*path, line, len);
+		return;
+	}
+	// writer già distrutto (chiusura del processo): scrivo direttamente
+	FILE *lf = fopen(path->c_str(), "a+t");
+	if (lf) {
+		fwrite(line, 1, len, lf);
+		fputc('\n', lf);
+		fclose(lf);
+	}
+}
+
 
 void initLog(const char *moduleName, const char *iniFile,const char *version)
 {
@@ -67,6 +276,9 @@ void initLog(const char *moduleName, const char *iniFile,const char *version)
 
     GlobalDepth = settings.getIntProperty("FunctionDepth", 10);//, "Definisce la profondità massima di log delle funzioni\n")).GetValue((char*)iniFile);
 
+    // la traccia delle chiamate è attiva solo se il log è abilitato
+    FunctionTrace = mainEnable && FunctionLog;
+
     globalLogParam = settings.getIntProperty("ParamLog", 1);//, "Abilitazione log dei parametri di input delle funzioni")).GetValue((char*)iniFile);
     
     globalLogName = moduleName;
@@ -186,6 +398,20 @@ void CLog::init() {
 	
 }
 
+// aggiunge a line (che contiene già len caratteri) il messaggio formattato
+static size_t appendLine(char *line, size_t size, size_t len, const char *format, va_list params)
+{
+	if (len < size) {
+		va_list args;
+		va_copy(args, params);
+		int n = vsnprintf(line + len, size - len, format, args);
+		va_end(args);
+		if (n > 0)
+			len += n;
+	}
+	return len < size ? len : size - 1;
+}
+
 DWORD CLog::write(const char *format,...) {
  	va_list params;
 	va_start (params, format);
@@ -217,55 +443,29 @@ DWORD CLog::write(const char *format,...) {
 		SYSTEMTIME  stTime;
 		GetLocalTime(&stTime);
 		sprintf_s(pbtDate,sizeof(pbtDate),"%05u:[%02d:%02d:%02d.%03d]", *Num, stTime.wHour, stTime.wMinute, stTime.wSecond, stTime.wMilliseconds);	
-#else
-        time_t t = time(NULL);
-        tm tm = *localtime(&t);
-        
-        sprintf(pbtDate,"%05u:[%02d:%02d:%02d]", *Num, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		auto pid = GetCurrentProcessId();
+#else
+        auto now = std::chrono::system_clock::now();
+        time_t t = std::chrono::system_clock::to_time_t(now);
+        tm tm;
+        localtime_r(&t, &tm);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count() % 1000000;
+
+        sprintf(pbtDate,"%05u:[%02d:%02d:%02d.%06d]", *Num, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)us);
+		auto pid = getpid();
 #endif
-		// se siamo in LM_thread devo scrivere il thread nel nome del file
 		std::hash<std::thread::id> hasher;
 		auto dwThreadID = hasher(std::this_thread::get_id());
-		if (LogMode == LM_Thread || LogMode == LM_Module_Thread) {
-			std::stringstream th;
-			th << std::setiosflags(std::ios::hex | std::ios::uppercase);
-			th << std::setw(8);
-			th << dwThreadID << ".log";
 
-			logPath.replace(threadPos, threadPos + 14, th.str());
+		char line[0x800];
+		int len = 0;
+		switch(LogMode) {
+			case (LM_Single) : len = snprintf(line, sizeof(line), "%s|%04i|%04i|%02i|", pbtDate, pid, dwThreadID, ModuleNum); break;
+			case (LM_Module) : len = snprintf(line, sizeof(line), "%s|%04i|%04x|", pbtDate, pid, dwThreadID); break;
+			case (LM_Thread) : len = snprintf(line, sizeof(line), "%s|%04i|%02i|", pbtDate, pid, ModuleNum); break;
+			case (LM_Module_Thread) : len = snprintf(line, sizeof(line), "%s|", pbtDate); break;
 		}
-		FILE *lf=nullptr;
-#ifdef WIN32
-		fopen_s(&lf,logPath.c_str(), "a+t");
-        if (lf) {
-            switch(LogMode) {
-                case (LM_Single) : fprintf(lf,"%s|%04i|%04i|%02i|", pbtDate, GetCurrentProcessId(), dwThreadID, ModuleNum); break;
-                case (LM_Module) : fprintf(lf,"%s|%04i|%04x|", pbtDate, GetCurrentProcessId(), dwThreadID); break;
-                case (LM_Thread) : fprintf(lf,"%s|%04i|%02i|", pbtDate, GetCurrentProcessId(), ModuleNum); break;
-                case (LM_Module_Thread) : fprintf(lf,"%s|", pbtDate); break;
-            }
-            vfprintf(lf, format, params);
-            fprintf(lf, "\n");
-            fclose(lf);
-        }
-#else
-        lf = fopen(logPath.c_str(), "a+t");
-        if (lf) {
-            switch(LogMode) {
-                case (LM_Single) : fprintf(lf,"%s|%04i|%04i|%02i|", pbtDate, getpid(), dwThreadID, ModuleNum); break;
-                case (LM_Module) : fprintf(lf,"%s|%04i|%04x|", pbtDate, getpid(), dwThreadID); break;
-                case (LM_Thread) : fprintf(lf,"%s|%04i|%02i|", pbtDate, getpid(), ModuleNum); break;
-                case (LM_Module_Thread) : fprintf(lf,"%s|", pbtDate); break;
-            }
-            vfprintf(lf, format, params);
-            fprintf(lf, "\n");
-            fclose(lf);
-        }
-        
-//        printf(format, params);
-//        printf("\n", NULL);
-#endif
-		
+		logLine(*this, line, appendLine(line, sizeof(line), len > 0 ? len : 0, format, params));
 	}
 
 #ifdef _DEBUG
@@ -306,31 +506,8 @@ void CLog::writePure(const char *format,...) {
 			writeModuleInfo();
 		}
 
-		// se siamo in LM_thread devo scrivere il thread nel nome del file
-		std::hash<std::thread::id> hasher;
-		auto dwThreadID = hasher(std::this_thread::get_id());
-		if (LogMode == LM_Thread || LogMode == LM_Module_Thread) {
-			std::stringstream th;
-			th << std::setiosflags(std::ios::hex | std::ios::uppercase);
-			th << std::setw(8);
-			th << dwThreadID << ".log";
-
-			logPath.replace(threadPos, threadPos + 14, th.str());
-		}
-		FILE *lf = nullptr;
-#ifdef WIN32
-		fopen_s(&lf,logPath.c_str(), "a+t");
-#else
-        lf = fopen(logPath.c_str(), "a+t");
-#endif
-		if (lf) {
-			vfprintf(lf, format, params);
-			fprintf(lf, "\n");
-			fclose(lf);
-		}
-        
-//        printf(format, params);
-//        printf("\n", NULL);
+		char line[0x800];
+		logLine(*this, line, appendLine(line, sizeof(line), 0, format, params));
 	}
 #ifdef _DEBUG
 #ifdef WIN32
@@ -359,33 +536,16 @@ void CLog::writeBinData(BYTE *data, size_t datalen) {
 		writeModuleInfo();
 	}
 
-	char pbtDate[0x800]={NULL};
-
-	// se siamo in LM_thread devo scrivere il thread nel nome del file
-	std::hash<std::thread::id> hasher;
-	auto dwThreadID = hasher(std::this_thread::get_id());
-	if (LogMode == LM_Thread || LogMode == LM_Module_Thread) {
-		std::stringstream th;
-		th << std::setiosflags(std::ios::hex | std::ios::uppercase);
-		th << std::setw(8);
-		th << dwThreadID << ".log";
-
-		logPath.replace(threadPos, threadPos + 14, th.str());
-	}
-
-	FILE *lf = nullptr;
-#ifdef WIN32
-	fopen_s(&lf,logPath.c_str(), "a+t");
-#else
-    lf = fopen(logPath.c_str(), "a+t");
-#endif
-	if (lf) {
-		if (datalen>100) datalen=100;
-		for (size_t i=0;i<datalen;i++)
-			fprintf(lf, "%02x ", data[i]);
-		fprintf(lf, "\n");
-		fclose(lf);
+	static const char hex[] = "0123456789abcdef";
+	char line[300];
+	size_t len = 0;
+	if (datalen>100) datalen=100;
+	for (size_t i=0;i<datalen;i++) {
+		line[len++] = hex[data[i] >> 4];
+		line[len++] = hex[data[i] & 0x0f];
+		line[len++] = ' ';
 	}
+	logLine(*this, line, len);
 }
 
 void CLog::writeModuleInfo() {